@@ -5,6 +5,10 @@ if '__test' in COMMAND_LINE_TARGETS:
     #print(env.get('SRC_FILTER'))
     env.Replace(SRC_FILTER=["+<*>", "-<DCC.cpp>"])
 
+if env.PioPlatform().name == 'native':
+    # host build (native tests and benchmarks): only portable sources, no ESP32 peripherals
+    env.Replace(SRC_FILTER=["+<*>", "-<src/esp32_*.cpp>"])
+
 # pass flags to a global build environment (for all libraries, etc)
 # global_env = DefaultEnvironment()
 # global_env.Append(
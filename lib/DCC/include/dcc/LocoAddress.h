@@ -1,7 +1,10 @@
 #pragma once
 
+#ifdef ARDUINO
 #include <Arduino.h>
+#endif
 #include <stdint.h>
+#include <stdlib.h>
 #include <math.h>
 
 /**
@@ -29,13 +32,17 @@ public:
     /** Returns numeric value of this address. */
     uint16_t addr() const { return abs(num); }
     bool isValid() const { return num!=0; }
-    bool operator < (const LocoAddress& a) const {
-        // long address must be "larger" than short one
-        size_t key = (isShort() ? num : -num + 128);
-        size_t aKey = (a.isShort() ? a.num : -a.num + 128);
-        return (key < aKey);
-    }
+    /**
+     * Unique numeric key of this address: short addresses map to 0--127,
+     * long ones to 128 and above (so long address is "larger" than short one).
+     */
+    uint16_t key() const { return isShort() ? num : -num + 128; }
+    bool operator < (const LocoAddress& a) const { return key() < a.key(); }
+    bool operator == (const LocoAddress& a) const { return num == a.num; }
+    bool operator != (const LocoAddress& a) const { return num != a.num; }
+#ifdef ARDUINO
     explicit operator String() const {  return String( (isShort() ? 'S' : 'L') )+addr(); }
+#endif
 private:
     int16_t num;
     LocoAddress(int16_t num): num{num} { }
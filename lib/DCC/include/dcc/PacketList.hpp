@@ -4,13 +4,17 @@
 #include "LocoAddress.h"
 #include "LocoSpeed.h"
 #include "log.hpp"
+#include "mpsc_ring.hpp"
+#include "slot_table.hpp"
+#include "stats.hpp"
 
-#include <etl/map.h>
 #include <etl/array.h>
 #include <etl/optional.h>
-#include <etl/priority_queue.h>
+#include <etl/vector.h>
 #include <etl/variant.h>
 
+#include <atomic>
+#include <climits>
 #include <cstdlib>
 #include <cstdint>
 
@@ -28,9 +32,31 @@ namespace dcc {
      *   while higher functions aren't.
      *
      * Internally, maintains a priority queue with packets that need to be sent once
-     *   and a table of packets that need to be refreshed, indexed by Loco address.
-     * Each table row cycles through its packets with speed-dir packet being emitted every even cycle,
-     *   while odd cycles are given to function packets.
+     *   (or table locations whose packet has just changed and should go out before refresh)
+     *   and a table of packets that need to be refreshed, indexed by Loco address
+     *   (see ISlotTable, lookups and round-robin step are O(1), so it scales to 100+ locos).
+     * The queue keeps at most one location per table row and packet index: when e.g. a throttle
+     *   sends a burst of speed changes, the table holds the latest packet and the queue entry
+     *   is reused (its priority raised if the new packet is more urgent).
+     *
+     * Locos whose decoders support it can use combined speed, direction and functions instruction
+     *   instead of separate packets, see set_loco_combined().
+     *
+     * When queue is empty, the table packet that is most overdue relative to the target refresh period
+     *   of its class (speed-dir, F0-F4, F5-F12) is sent, see set_refresh_period().
+     * Function packets that haven't changed for a while are refreshed less often, see set_fn_settle_time().
+     *
+     * Signal aspect packets have a queue of their own, see put_signal_aspect_packet(),
+     *   and so do ops mode programming packets, see put_pom_packet().
+     *
+     * Packets are built into bytes when they are put into the list, not when they are fetched,
+     *   as fetching is done from waveform generator interrupts.
+     *
+     * Threading: `put_*` and `clear_*` methods are producers, they can be called from
+     *   several tasks at once and never block. They only push a Command into a lock-free ring.
+     * `fetch_next_packet` is the single consumer (waveform generator, usually an ISR).
+     *   It applies pending commands and is the only code touching the table and priority queue,
+     *   so it never sees a half-updated table.
      *
      * Example of table:
      * ```
@@ -46,84 +72,326 @@ namespace dcc {
     class BasePacketList {
     public:
 
-        size_t free_loco_slots() const { return loco_slots.available(); }
+        constexpr static int PRIORITY_NORMAL = 0;
+        constexpr static int PRIORITY_EMGR = 100; ///< higher value is fetched first
 
-        bool has_loco(const LocoAddress addr) const {
-            return loco_slots.find(addr) != loco_slots.end();
-        }
+        constexpr static size_t N_POM_PACKETS = 8;
 
-        // TODO: for S14 mode, F0 bit is also needed
-        bool put_loco_speed_dir_packet(const LocoAddress addr, const LocoSpeed speed, const SpeedMode mode, const bool fwd) {
+        /** Ops mode packet that is done, see put_pom_packet(). */
+        struct PomDone {
+            uint32_t token;
+            bool sent;      ///< false if it was dropped because POM queue was full
+        };
 
-            auto it = find_or_add_slot(addr);
-            if(it == loco_slots.end() ) {
-                return false;
+        /**
+         * Table packets are refreshed by class, each class has a target period.
+         * Index 0 is speed-dir, 1 is F0-F4, 2 and 3 are F5-F8 and F9-F12.
+         * Function packets that have not changed for a while are moved to REFRESH_FN_SETTLED, see set_fn_settle_time().
+         */
+        enum RefreshClass: uint8_t {
+            REFRESH_SPEED_DIR = 0,
+            REFRESH_F0_F4,
+            REFRESH_F5_F12,
+            REFRESH_FN_SETTLED,
+            N_REFRESH_CLASSES
+        };
+
+        /**
+         * Snapshot of packet list statistics, see stats().
+         * Packet counters count fetches (a packet with repeats is counted once) and wrap around,
+         *   so rates should be computed from differences of two snapshots.
+         */
+        struct Stats {
+            uint32_t speed_refresh;     ///< speed-dir packets sent from table because they were due
+            uint32_t fn_refresh;        ///< function packets sent from table because they were due
+            uint32_t queued_slot;       ///< table packets sent ahead of refresh because they changed
+            uint32_t queued_generic;    ///< one-off packets: programming, higher functions etc.
+            uint32_t queued_accessory;  ///< one-off accessory packets, signal aspect packets included
+            uint32_t coalesced;         ///< slot packets merged into a queued entry of same loco and index
+            uint32_t signal_superseded; ///< signal aspects replaced by a newer aspect before all repeats were sent
+            uint32_t dropped;           ///< slot entries dropped or evicted from full queue (packet is still refreshed from table),
+                                        ///< signal aspects evicted from full signal queue, or POM packets that found it full
+            uint32_t put_rejected;      ///< put_* calls that failed because command ring or priority queue was full
+            uint32_t queue_high_water;  ///< max number of queued items since last reset_stats_max()
+            /** Time between two sendings of a table packet, in fetches, per refresh class. */
+            struct Interval {
+                uint32_t count;
+                uint32_t sum;       ///< mean is sum/count
+                uint32_t max;       ///< since last reset_stats_max()
+            };
+            etl::array<Interval, N_REFRESH_CLASSES> refresh_interval;
+
+            uint32_t fetched() const {
+                return speed_refresh + fn_refresh + queued_slot + queued_generic + queued_accessory;
             }
+        };
+
+        // ---- Producer side: can be called concurrently from any task (loop, network callbacks).
+
+        // TODO: for S14 mode, F0 bit is also needed
+        bool put_loco_speed_dir_packet(const LocoAddress addr, const LocoSpeed speed, const SpeedMode mode, const bool fwd) {
             auto bytes = make_speed_dir_packet(addr, speed, mode, fwd);
-            it->second.packets[0] = packet_from_bytes(bytes); // here is actual putting into table
-            enqueue_slot_packet(SlotLocation{it, 0}, speed.isEmgr() ? -100 : 0);
             DCC_LOGI("Addr:%d, spd:%d(%s) %c, %s",
                 addr.addr(), speed.get128(), mode.c_str(), fwd?'F':'R',
                 fmt_span(bytes));
-            return true;
+            return push_command(Command{
+                .type = Command::Type::SlotPacket,
+                .addr = addr,
+                .idx = 0,
+                .priority = speed.isEmgr() ? PRIORITY_EMGR : PRIORITY_NORMAL,
+                .packet = PacketWithRepeats::from_bytes(bytes, 1),
+                .state = speed_dir_byte(speed, fwd)
+            });
         }
 
-        bool put_loco_fn_packet(const LocoAddress addr, fn_group fg, uint32_t data) {
-            auto bytes = make_fn_packet(addr, fg, data);
+        bool put_loco_fn_packet(const LocoAddress addr, fn_group fg, const FnState &fns) {
+            auto bytes = make_fn_packet(addr, fg, fns);
 
-            size_t idx = fn_group_index(fg);
-            if(idx >= N_FN_GROUPS_PER_LOCO) {
-                // use non-slot packet for extra functions
-                return put_generic_packet(bytes, FN_PACKET_REPEATS, 0);
-            }
-            idx += 1; // 0th index is speed+dir
-            auto it = find_or_add_slot(addr);
-            if(it == loco_slots.end() ) {
-                return false;
-            }
-            it->second.packets[idx] = packet_from_bytes(bytes);
-            enqueue_slot_packet(SlotLocation{it, idx}, 0);
+            const size_t idx = fn_group_index(fg) + 1; // 0th index is speed+dir
             DCC_LOGI("Addr:%d, fg:%d, %s", addr.addr(), (int)fg, fmt_span(bytes));
-            return true;
+            if(idx > N_FN_GROUPS_PER_LOCO) {
+                // use non-slot packet for extra functions, but let table know their state for combined instruction
+                return push_queue_command(Command{
+                    .type = Command::Type::QueuePacket,
+                    .addr = addr,
+                    .idx = static_cast<uint8_t>(idx),
+                    .priority = PRIORITY_NORMAL,
+                    .packet = PacketWithRepeats::from_bytes(bytes, FN_PACKET_REPEATS),
+                    .state = fns.bits(0, 16)
+                });
+            }
+            return push_command(Command{
+                .type = Command::Type::SlotPacket,
+                .addr = addr,
+                .idx = static_cast<uint8_t>(idx),
+                .priority = PRIORITY_NORMAL,
+                .packet = PacketWithRepeats::from_bytes(bytes, 1),
+                .state = fns.bits(0, 16)
+            });
         }
 
-        bool put_generic_packet(const etl::span<const uint8_t> bytes, uint8_t n_repeats, int priority = 0) {
-            if(queue_packets.full()) return false;
-            DCC_LOGI("%sx%d", fmt_span(bytes), n_repeats);
+        /** Binary states are not refreshed, so they are sent with repeats like higher functions. */
+        bool put_binary_state_packet(const LocoAddress addr, uint16_t state, bool on) {
+            auto bytes = make_binary_state_packet(addr, state, on);
+            return put_generic_packet(bytes, FN_PACKET_REPEATS);
+        }
 
-            QueueItem item{
+        bool put_generic_packet(const etl::span<const uint8_t> bytes, uint8_t n_repeats, int priority = PRIORITY_NORMAL) {
+            DCC_LOGI("%sx%d", fmt_span(bytes), n_repeats);
+            return push_queue_command(Command{
+                .type = Command::Type::QueuePacket,
+                .addr = LocoAddress{},
+                .idx = 0,
                 .priority = priority,
-                .data = PacketWithRepeats{packet_from_bytes(bytes), n_repeats}
-            };
-            queue_packets.push(item);
-            return true;
+                .packet = PacketWithRepeats::from_bytes(bytes, n_repeats)
+            });
         }
 
         bool put_accessory_packet(uint16_t addr11, bool thrown) {
-            if(queue_packets.full()) return false;
             auto bytes = make_accessory_packet(addr11, thrown);
             return put_generic_packet(bytes, ACCESSORY_PACKET_REPEATS);
         }
 
-        void clear_loco(const LocoAddress addr) {
-            auto it = loco_slots.find(addr);
-            if(it != loco_slots.end() ) {
-                if(cur_slot == it) {
-                    // if currently selected slot is being cleared, move to next one to avoid sending invalid packet
-                    ++cur_slot;
-                    if(cur_slot == loco_slots.end()) {
-                        cur_slot = loco_slots.begin();
-                    }
-                }
-                if(loco_slots.size()==1) {
-                    // if we are clearing the only slot, reset cur_slot to end to prevent dereferencing it
-                    cur_slot = loco_slots.end();
-                }
-                DCC_LOGI("Clearing slot %d (loco %d), cur is %d",
-                    std::distance(loco_slots.begin(), it), addr.addr(),
-                    std::distance(loco_slots.begin(), cur_slot));
-                loco_slots.erase(it);
+        /**
+         * Extended accessory (signal aspect) packet, see make_ext_accessory_packet().
+         * Signal packets have a queue of their own: their repeats are spread over time and take at most every
+         *   set_signal_pacing()-th fetch, so that a route change flipping many signals does not hold up loco packets.
+         * A new aspect of a signal replaces its pending one, superseded aspects are never sent.
+         */
+        bool put_signal_aspect_packet(uint16_t addr11, uint8_t aspect) {
+            auto bytes = make_ext_accessory_packet(addr11, aspect);
+            DCC_LOGI("Signal %d aspect %d, %s", addr11, aspect, fmt_span(bytes));
+            return push_command(Command{
+                .type = Command::Type::SignalPacket,
+                .addr = LocoAddress{},
+                .idx = 0,
+                .priority = PRIORITY_NORMAL,
+                .packet = PacketWithRepeats::from_bytes(bytes, 1),
+                .state = addr11
+            });
+        }
+
+        /**
+         * Ops mode programming (POM) packet, see make_pom_byte_packet(), for decoder at `addr`.
+         * POM packets have a queue of their own: each is sent POM_PACKET_REPEATS times, and a repeat never
+         *   follows a packet to the same decoder, so there's another packet (over 5ms) in between, as S-9.2 asks.
+         *   Packets to one decoder go in order, each with all its repeats before the next one, so the decoder
+         *   gets two identical CV access instructions with no other one in between; packets to different decoders are interleaved.
+         * They take at most every set_pom_pacing()-th fetch, so that bulk programming does not hold up loco refresh.
+         * When POM queue is full, packet is dropped.
+         * @param token if not 0, PomDone with it is reported to take_pom_done() when the packet is done.
+         */
+        bool put_pom_packet(const LocoAddress addr, const etl::span<const uint8_t> bytes, uint32_t token = 0) {
+            DCC_LOGI("POM %d: %s", addr.addr(), fmt_span(bytes));
+            return push_command(Command{
+                .type = Command::Type::PomPacket,
+                .addr = addr,
+                .idx = 0,
+                .priority = PRIORITY_NORMAL,
+                .packet = PacketWithRepeats::from_bytes(bytes, 1),
+                .state = token
+            });
+        }
+
+        /**
+         * Takes next POM packet that is done (see put_pom_packet()), in no particular order.
+         * Can be called from one task only.
+         */
+        bool take_pom_done(PomDone &out) {
+            const PomDone *d = pom_done.front();
+            if(d == nullptr) return false;
+            out = *d;
+            pom_done.pop();
+            return true;
+        }
+
+        /**
+         * Layout-wide emergency stop.
+         * Does not go through command ring (which can be full of throttle commands at that moment):
+         *   the next fetch sends broadcast e-stop packet ahead of anything queued, and every loco in the table
+         *   is stopped with EMGR speed, so refresh keeps them stopped. Commands put before this call are
+         *   applied first and overridden.
+         * Fetch only counts e-stops, a row is switched to EMGR speed when it is next used, see park_if_stopped(),
+         *   so e-stop costs the same with any number of locos.
+         */
+        void emergency_stop_all() {
+            DCC_LOGI("Emergency stop all");
+            estop_requested.store(true, std::memory_order_release);
+        }
+
+        /**
+         * Waveform generators should check this before sending next repeat of a packet,
+         *   and fetch instead, so that e-stop does not wait for repeats of e.g. an accessory packet.
+         */
+        bool estop_pending() const { return estop_requested.load(std::memory_order_relaxed); }
+
+        /**
+         * Switches a loco to the combined speed, direction and functions instruction (see make_combined_packet())
+         *   or back to separate packets. In combined mode, the speed-dir table entry of the loco carries 128-step speed
+         *   and F0-F15, and F0-F12 packets are not refreshed on their own, so the loco takes one refresh slot instead of four.
+         * Speed mode given to put_loco_speed_dir_packet() is ignored for such locos.
+         * Only for decoders that support the instruction. Mode is forgotten when loco is cleared.
+         */
+        bool set_loco_combined(const LocoAddress addr, bool enable) {
+            DCC_LOGI("Addr:%d, combined instruction %s", addr.addr(), enable ? "on" : "off");
+            return push_command(Command{
+                .type = Command::Type::SetCombined,
+                .addr = addr,
+                .idx = 0,
+                .priority = PRIORITY_NORMAL,
+                .packet = {},
+                .state = enable ? 1U : 0U
+            });
+        }
+
+        bool clear_loco(const LocoAddress addr) {
+            DCC_LOGI("Clearing loco %d", addr.addr());
+            return push_command(Command{
+                .type = Command::Type::ClearLoco,
+                .addr = addr,
+                .idx = 0,
+                .priority = 0,
+                .packet = {}
+            });
+        }
+
+        /**
+         * Removes speed-dir packet of a loco from the table, its function packets stay and are refreshed,
+         *   e.g. for a member of advanced consist, whose decoder takes speed from consist address.
+         * A loco in combined instruction mode is switched to separate function packets.
+         * Next speed-dir packet put for the loco adds it back.
+         */
+        bool clear_loco_speed(const LocoAddress addr) {
+            DCC_LOGI("Clearing speed of loco %d", addr.addr());
+            return push_command(Command{
+                .type = Command::Type::ClearSpeed,
+                .addr = addr,
+                .idx = 0,
+                .priority = 0,
+                .packet = {}
+            });
+        }
+
+        // ---- Consumer side: must be called from waveform generator context only (e.g. RMT interrupt).
+
+        size_t free_loco_slots() const { return loco_slots.available(); }
+
+        bool has_loco(const LocoAddress addr) const {
+            return loco_slots.find(addr).valid();
+        }
+
+        size_t queued_packets() const { return queue_packets.size(); }
+
+        size_t queued_signals() const { return signals.size(); }
+
+        size_t queued_pom() const { return pom.size(); }
+
+        // ---- Statistics: can be read from any task, without blocking consumer.
+
+        Stats stats() const {
+            Stats ret{
+                .speed_refresh = counters.speed_refresh.get(),
+                .fn_refresh = counters.fn_refresh.get(),
+                .queued_slot = counters.queued_slot.get(),
+                .queued_generic = counters.queued_generic.get(),
+                .queued_accessory = counters.queued_accessory.get(),
+                .coalesced = counters.coalesced.get(),
+                .signal_superseded = counters.signal_superseded.get(),
+                .dropped = counters.dropped.get(),
+                .put_rejected = counters.put_rejected.get(),
+                .queue_high_water = counters.queue_high_water.get(),
+                .refresh_interval = {}
+            };
+            for(size_t c=0; c<N_REFRESH_CLASSES; c++) {
+                ret.refresh_interval[c] = {
+                    counters.interval[c].count.get(),
+                    counters.interval[c].sum.get(),
+                    counters.interval[c].max.get()
+                };
             }
+            return ret;
+        }
+
+        /** Asks consumer to restart high-water marks on its next fetch. */
+        void reset_stats_max() { counters.reset_max.store(true, std::memory_order_relaxed); }
+
+        /**
+         * Sets target refresh period of a class, in packets sent to track (one packet takes roughly 5-7ms).
+         * When table has more packets than fit into their periods, all periods get stretched by the same factor.
+         * Should be called before waveform generator is started.
+         */
+        void set_refresh_period(RefreshClass c, uint16_t period_packets) {
+            refresh_periods[c] = period_packets;
+        }
+
+        /**
+         * Function packets that were not changed for `fetches` are refreshed with REFRESH_FN_SETTLED period,
+         *   and go back to their class on next change. Speed-dir is always refreshed at full rate.
+         * 0 disables this. Should be called before waveform generator is started.
+         */
+        void set_fn_settle_time(uint32_t fetches) {
+            fn_settle_time = fetches;
+        }
+
+        /**
+         * Signal packets are sent at most once per `fetches` (when there is anything else to send).
+         * Should be called before waveform generator is started.
+         */
+        void set_signal_pacing(uint16_t fetches) {
+            signal_pacing = fetches;
+        }
+
+        /**
+         * POM packets are sent at most once per `fetches` (when there is anything else to send).
+         * Should be called before waveform generator is started.
+         */
+        void set_pom_pacing(uint16_t fetches) {
+            pom_pacing = fetches;
+        }
+
+        /** Class of a table packet by its index, when it has been changed recently. */
+        static RefreshClass refresh_class(size_t idx) {
+            return idx == 0 ? REFRESH_SPEED_DIR : idx == 1 ? REFRESH_F0_F4 : REFRESH_F5_F12;
         }
 
         /**
@@ -132,177 +400,695 @@ namespace dcc {
          * @return true if packet was put into dst, false if no packets available.
          */
         bool fetch_next_packet(PacketWithRepeats &packet_out) {
+            const bool ret = fetch_packet(packet_out);
+            last_addr = ret ? packet_loco_address(packet_out.packet) : LocoAddress{};
+            return ret;
+        }
+
+    protected:
+
+        bool fetch_packet(PacketWithRepeats &packet_out) {
+
+            apply_commands();
+
+            now++;
+            if(counters.reset_max.exchange(false, std::memory_order_relaxed)) {
+                counters.queue_high_water.set(queue_packets.size());
+                for(auto &i: counters.interval) i.max.set(0);
+            }
+
+            if(estop_requested.exchange(false, std::memory_order_acquire)) {
+                estops++;
+                packet_out = estop_packet;
+                counters.queued_generic.inc();
+                return true;
+            }
 
             // if priority queue is not empty, use it
             if(!queue_packets.empty()) {
-                QueueItem item = queue_packets.top();
-                queue_packets.pop();
+                QueueItem item = pop_queue_item();
                 if(etl::holds_alternative<PacketWithRepeats>(item.data)) {
                     // queue has a packet, return it
                     packet_out = etl::get<PacketWithRepeats>(item.data);
+                    queue_reserved.fetch_sub(1, std::memory_order_relaxed);
                     DCC_LOGD("ret queue packet: %s", fmt_span(packet_out.packet));
+                    if(is_accessory_packet(packet_out.packet)) counters.queued_accessory.inc();
+                    else counters.queued_generic.inc();
                     return true;
                 } else {
                     // queue has a slot ref
                     auto loc = etl::get<SlotLocation>(item.data);
-                    LocoSlot &slot = loc.it->second;
-                    if(slot.packets[loc.idx].has_value() ) {
-                        packet_out = PacketWithRepeats{slot.packets[loc.idx].value(), 1};
-                        DCC_LOGD("ret queue location slot %d/%d, idx %d, len %d",
-                            std::distance(loco_slots.begin(), loc.it),
-                            loco_slots.size(), loc.idx, packet_out.packet.size());
-
-                        // update cur_slot and phase, it will be advanced on next call;
-                        cur_slot = loc.it;
-                        slot.phase = Phase::from_index(loc.idx);
+                    LocoSlot *slot = loco_slots.get(loc.handle);
+                    if(slot != nullptr && slot->packets[loc.idx].has_value() ) {
+                        park_if_stopped(*slot);
+                        packet_out = slot->packets[loc.idx].value();
+                        DCC_LOGD("ret queue location loco %d, idx %d, len %d",
+                            loco_slots.address(loc.handle).addr(), loc.idx, packet_out.packet.size());
+                        // it was just sent, so it is not due for refresh
+                        mark_emitted(refresh_id(loc.handle.index, loc.idx));
+                        counters.queued_slot.inc();
                         return true;
                     } // must have been removed from slots, fall through
                 }
             }
 
-            // prevent null pointer dereference in case of empty slots
-            if(loco_slots.empty()) return false;
-
-            // get packet from loco slots in round-robin way
-            ++cur_slot;
-            if(cur_slot == loco_slots.end()) {
-                cur_slot = loco_slots.begin();
-            }
-            LocoSlot &slot = cur_slot->second;
-
-            slot.phase.inc();
-            size_t idx = slot.phase.to_index();
-            if(!slot.packets[idx].has_value() ) {
-                // index we want has no packet, advance index (with rollover)
-                for(size_t attempt=0; attempt<N_PACKETS_PER_LOCO; attempt++) {
-                    ++idx; if(idx>=N_PACKETS_PER_LOCO) idx=0;
-                    if(slot.packets[idx].has_value()) {
-                        // found it
-                        slot.phase = Phase::from_index(idx);
-                        break;
-                    }
-                }
+            const uint16_t id = most_overdue();
+            if(!signals.empty() && (id == NO_REFRESH || now - last_signal_emit >= signal_pacing)) {
+                pop_signal(packet_out);
+                DCC_LOGD("ret signal packet: %s", fmt_span(packet_out.packet));
+                counters.queued_accessory.inc();
+                return true;
             }
-            if(!slot.packets[idx].has_value()) {
-                // slot allocated, but we didn't find packets it in
-                DCC_LOGW("Slot %d of %d (loco %d) has no packet at idx %d",
-                    std::distance(loco_slots.begin(), cur_slot),
-                    loco_slots.size(),
-                    cur_slot->first.addr(),
-                    idx);
-                assert(false);
+            if(!pom.empty() && (id == NO_REFRESH || now - last_pom_emit >= pom_pacing) && pop_pom(packet_out)) {
+                DCC_LOGD("ret POM packet: %s", fmt_span(packet_out.packet));
+                counters.queued_generic.inc();
+                return true;
             }
+            if(id == NO_REFRESH) return false;
 
-            packet_out = PacketWithRepeats{slot.packets[idx].value(), 1};
-            DCC_LOGD("ret slot %d/%d idx %d (ph %d): %s",
-                std::distance(loco_slots.begin(), cur_slot),
-                loco_slots.size(),
-                idx, slot.phase, fmt_span(packet_out.packet));
+            LocoSlot &slot = loco_slots.row_value(id / N_PACKETS_PER_LOCO);
+            const size_t idx = id % N_PACKETS_PER_LOCO;
+            park_if_stopped(slot);
+            packet_out = slot.packets[idx].value();
+            DCC_LOGD("ret slot %d idx %d (after %d fetches): %s",
+                id / N_PACKETS_PER_LOCO, idx, now - slot.refresh[idx].last_emit,
+                fmt_span(packet_out.packet));
+            mark_emitted(id);
+            if(idx == 0) counters.speed_refresh.inc();
+            else counters.fn_refresh.inc();
             return true;
         }
-    protected:
 
         constexpr static size_t N_FN_GROUPS_PER_LOCO = 3;
         constexpr static size_t N_PACKETS_PER_LOCO = N_FN_GROUPS_PER_LOCO + 1;
-        constexpr static size_t NUM_PHASES = N_FN_GROUPS_PER_LOCO * 2;
 
-        /** Class to advance phase within one row of packet table.
-         * Every even phase -> 0th (speed/dir) packet, every odd one -> fn packet
-         * phase: 0  1  2  3  4  5
-         * index: 0  1  0  2  0  3
-         * I.e. for 3 fn packets, 6 phases are needed.
-         */
-        struct Phase {
-            size_t phase{0};
-
-            /// @brief  convert phase to index
-            /// @return
-            size_t to_index() {
-                return phase % 2 == 0 ? 0 : (phase / 2 + 1);
-            }
-
-            /// convert index to phase
-            static Phase from_index(size_t idx) {
-                // 0->0, 1->1, 2->3, 3->5
-                return {idx == 0 ? 0 : (idx*2 - 1)};
-            }
+        constexpr static uint16_t NO_REFRESH = 0xFFFF;
 
-            void inc() {
-                ++phase;
-                if(phase == BasePacketList::NUM_PHASES) phase = 0;
-            }
+        /** Refresh bookkeeping of one table packet, see most_overdue(). */
+        struct RefreshLink {
+            uint32_t last_emit;   ///< value of `now` when packet was last sent
+            uint32_t last_change; ///< value of `now` when packet was last put into table
+            uint16_t prev;        ///< refresh id of neighbours in class list
+            uint16_t next;
+            RefreshClass cls;     ///< list this packet is in
         };
 
-        /** A row in slots table */
+        /**
+         * A row in slots table. Packets in it always have nRepeats=1.
+         * Speed and function state is kept alongside encoded packets, to build combined instruction from it.
+         */
         struct LocoSlot {
-            etl::array< etl::optional<Packet>, N_PACKETS_PER_LOCO> packets;
-            Phase phase;
+            etl::array< etl::optional<PacketWithRepeats>, N_PACKETS_PER_LOCO> packets;
+            etl::array<RefreshLink, N_PACKETS_PER_LOCO> refresh;
+            uint8_t speed_dir;  ///< DSSSSSSS, see speed_dir_byte()
+            uint16_t fns;       ///< F0-F15, bit N is FN
+            bool combined;      ///< packets[0] is combined instruction, F0-F12 packets are not used
+            uint32_t estops;    ///< value of `estops` when speed was last set or parked
         };
 
-        using ISlotMap = etl::imap<LocoAddress, LocoSlot>;
+        using ISlotMap = ISlotTable<LocoSlot>;
 
         /** A 2D table with packets that need to be periodically refreshed. */
         ISlotMap &loco_slots;
-        ISlotMap::iterator cur_slot;
 
-        /** A location in slot table: a map iterator and an index in packet array. */
+        /** Fetch counter, the time base of refresh scheduling. */
+        uint32_t now{0};
+
+        /** Emergency stops sent, see emergency_stop_all(). */
+        uint32_t estops{0};
+
+        /**
+         * Table packets of one refresh class, least recently sent first.
+         * A packet goes to the tail when it is sent, so as all packets in a class have the same period,
+         *   the head is always the most overdue one of its class.
+         */
+        struct RefreshList {
+            uint16_t head{NO_REFRESH};
+            uint16_t tail{NO_REFRESH};
+        };
+        etl::array<RefreshList, N_REFRESH_CLASSES> refresh_lists;
+        /** Target refresh period of each class, in fetches. */
+        etl::array<uint16_t, N_REFRESH_CLASSES> refresh_periods{20, 60, 200, 1000};
+        /** See set_fn_settle_time(), default is about 20 seconds. */
+        uint32_t fn_settle_time{3000};
+
+        /**
+         * A location in slot table: a row handle and an index in packet array.
+         * Handle becomes stale when the row is cleared, such locations are skipped.
+         */
         struct SlotLocation {
-            ISlotMap::iterator it; ///< slot location in the map
+            SlotHandle handle; ///< slot row in the table
             size_t idx; ///< index in slot, 0=speed/dir, 1.. = fn packets
         };
 
         constexpr static size_t N_QUEUE_PACKETS = 10;
 
-        /** Item for priority queue, either a packet or a location in the slot table. */
+        /**
+         * Item for priority queue, either a packet or a location in the slot table.
+         * Items of equal priority are fetched in order they were queued (by `seq`),
+         *   e.g. CV programming packets must not be reordered.
+         */
         struct QueueItem {
             int priority;
+            uint32_t seq;
             etl::variant<
                 PacketWithRepeats,
                 SlotLocation
             > data;
-            bool operator< (const QueueItem& other) const {
-                return priority < other.priority;
+            /** @return true if this item should be fetched before `other`. */
+            bool before(const QueueItem& other) const {
+                if(priority != other.priority) return priority > other.priority;
+                return static_cast<int32_t>(seq - other.seq) < 0;
             }
+            bool is_location() const { return etl::holds_alternative<SlotLocation>(data); }
         };
-        etl::priority_queue<QueueItem, N_QUEUE_PACKETS> queue_packets;
+        /**
+         * Priority queue is an unsorted array: it is small, and coalescing and eviction
+         *   need to look at every entry anyway.
+         */
+        etl::vector<QueueItem, N_QUEUE_PACKETS> queue_packets;
+        uint32_t queue_seq{0};
+
+        /** Written by consumer only, except `put_rejected` and `reset_max`. */
+        struct Counters {
+            StatCounter speed_refresh, fn_refresh, queued_slot, queued_generic, queued_accessory;
+            StatCounter coalesced, signal_superseded, dropped;
+            SharedStatCounter put_rejected;
+            StatCounter queue_high_water;
+            struct Interval {
+                StatCounter count, sum, max;
+            };
+            etl::array<Interval, N_REFRESH_CLASSES> interval;
+            std::atomic<bool> reset_max{false};
+        };
+        Counters counters;
+
+        /**
+         * A change to the list requested by producer.
+         * Producers only build these (encoding included), consumer applies them
+         *   to the table and priority queue that it exclusively owns.
+         */
+        struct Command {
+            enum class Type: uint8_t {
+                SlotPacket,   ///< put packet into table at `addr`/`idx` and queue it
+                QueuePacket,  ///< put packet into priority queue only, update function state of `addr` if it's valid
+                ClearLoco,    ///< remove table row of `addr`
+                ClearSpeed,   ///< remove speed-dir packet from table row of `addr`
+                SetCombined,  ///< switch `addr` to combined instruction if `state` is not 0
+                SignalPacket, ///< put packet into signal queue, `state` is 11-bit accessory address
+                PomPacket     ///< put packet for decoder at `addr` into POM queue, `state` is token
+            };
+            Type type;
+            LocoAddress addr;
+            uint8_t idx;
+            int priority;
+            PacketWithRepeats packet;
+            uint32_t state{0}; ///< speed-dir byte for idx 0, function bits for others, see update_state()
+        };
+
+        constexpr static size_t N_SIGNAL_PACKETS = 32;
+
+        /** A signal aspect packet that has repeats left to send. */
+        struct SignalItem {
+            uint16_t addr11;
+            uint8_t repeats_left;
+            PacketWithRepeats packet; ///< with nRepeats=1, repeats are sent one by one
+        };
+        /** Signal queue, sent round-robin so that repeats of one signal are interleaved with others. */
+        etl::vector<SignalItem, N_SIGNAL_PACKETS> signals;
+        size_t signal_next{0};
+        uint32_t last_signal_emit{0};
+        uint16_t signal_pacing{4};
+
+        /** A POM packet that has repeats left to send. */
+        struct PomItem {
+            LocoAddress addr;
+            uint32_t token;
+            uint8_t repeats_left;
+            PacketWithRepeats packet; ///< with nRepeats=1, repeats are sent one by one
+        };
+        /** POM queue in order of arrival, see pop_pom(). */
+        etl::vector<PomItem, N_POM_PACKETS> pom;
+        size_t pom_next{0};
+        uint32_t last_pom_emit{0};
+        uint16_t pom_pacing{2};
+        MpscRing<PomDone, N_POM_PACKETS * 2> pom_done;
+        LocoAddress last_addr;  ///< decoder that last fetched packet was for
+
+        constexpr static size_t N_COMMANDS = 16;
+        MpscRing<Command, N_COMMANDS> commands;
+        /** QueuePacket commands in ring plus packets in priority queue, at most N_QUEUE_PACKETS. */
+        std::atomic<uint16_t> queue_reserved{0};
+
+        std::atomic<bool> estop_requested{false};
+        /** Encoded in advance, so that e-stop does not wait for encoding. */
+        const PacketWithRepeats estop_packet;
 
         explicit BasePacketList(ISlotMap &loco_slots)
-        : loco_slots{loco_slots}, cur_slot{loco_slots.end()}
+        : loco_slots{loco_slots}
+        , estop_packet{PacketWithRepeats::from_bytes(make_broadcast_stop_packet(true), ESTOP_PACKET_REPEATS)}
         {
         }
 
-        ISlotMap::iterator find_or_add_slot(LocoAddress addr) {
-            auto it = loco_slots.find(addr);
-            if(it == loco_slots.end() ) {
-                if(!loco_slots.full()) {
-                    it = loco_slots.insert(ETL_OR_STD::make_pair(addr, LocoSlot{})).first;
+        /**
+         * Sets speed of a row to EMGR stop if there was an e-stop since its speed was last set.
+         * To be called before a row is read or changed. It's a byte change in the stored packet, no encoding.
+         */
+        void park_if_stopped(LocoSlot &slot) {
+            if(slot.estops == estops) return;
+            slot.estops = estops;
+            slot.speed_dir = (slot.speed_dir & 0x80) | DCC_SPEED_EMGR;
+            if(slot.packets[0].has_value()) set_speed_packet_emgr(slot.packets[0]->packet);
+        }
+
+        /** Like ISlotTable::find_or_add(), a new row is not stopped by e-stops that were before it. */
+        SlotHandle find_or_add_row(const LocoAddress addr) {
+            const size_t n = loco_slots.size();
+            const SlotHandle h = loco_slots.find_or_add(addr);
+            if(h.valid() && loco_slots.size() != n) loco_slots.get(h)->estops = estops;
+            return h;
+        }
+
+        bool push_command(const Command &cmd) {
+            if(!commands.push(cmd)) {
+                DCC_LOGD("Command ring is full");
+                counters.put_rejected.inc();
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Pushes a packet for priority queue, if queue has place for it when it's applied.
+         * Checking it here keeps the ring flowing: a command in ring is always applied on next fetch,
+         *   and producers waiting for queue space (e.g. CV programming) are paced by the put_* result.
+         */
+        bool push_queue_command(const Command &cmd) {
+            if(queue_reserved.fetch_add(1, std::memory_order_relaxed) >= N_QUEUE_PACKETS) {
+                queue_reserved.fetch_sub(1, std::memory_order_relaxed);
+                DCC_LOGD("Priority queue is full");
+                counters.put_rejected.inc();
+                return false;
+            }
+            if(!push_command(cmd)) {
+                queue_reserved.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+
+        /** Moves pending commands from ring into table/queue. Bounded by ring size. */
+        void apply_commands() {
+            for(size_t i=0; i<N_COMMANDS; i++) {
+                const Command *cmd = commands.front();
+                if(cmd == nullptr) return;
+                apply_command(*cmd);
+                commands.pop();
+            }
+        }
+
+        void apply_command(const Command &cmd) {
+            switch(cmd.type) {
+                case Command::Type::SlotPacket: {
+                    const SlotHandle h = find_or_add_row(cmd.addr);
+                    if(!h.valid() ) {
+                        DCC_LOGD_ISR("No free slot for loco %d", cmd.addr.addr());
+                        return; // table is full, drop packet
+                    }
+                    LocoSlot &slot = *loco_slots.get(h);
+                    park_if_stopped(slot);
+                    update_state(slot, cmd.idx, cmd.state);
+                    if(slot.combined) {
+                        store_combined(h, slot);
+                        enqueue_slot_packet(SlotLocation{h, 0}, cmd.priority);
+                        return;
+                    }
+                    store_packet(h, slot, cmd.idx, cmd.packet); // here is actual putting into table
+                    enqueue_slot_packet(SlotLocation{h, cmd.idx}, cmd.priority);
+                    return;
+                }
+                case Command::Type::QueuePacket: {
+                    // a queued slot location can make place, table will refresh its packet anyway;
+                    // queue_reserved keeps at least one location in a full queue, less urgent ones go first
+                    if(queue_packets.full() && !evict_location(cmd.priority + 1)) evict_location(INT_MAX);
+                    queue_packets.push_back(QueueItem{
+                        .priority = cmd.priority,
+                        .seq = queue_seq++,
+                        .data = cmd.packet
+                    });
+                    counters.queue_high_water.update_max(queue_packets.size());
+                    if(cmd.addr.isValid()) {
+                        const SlotHandle h = loco_slots.find(cmd.addr);
+                        LocoSlot *slot = loco_slots.get(h);
+                        if(slot != nullptr) {
+                            park_if_stopped(*slot);
+                            update_state(*slot, cmd.idx, cmd.state);
+                            // queued packet is sent anyway, just keep refreshed one in sync
+                            if(slot->combined && slot->packets[0].has_value()) store_combined(h, *slot);
+                        }
+                    }
+                    return;
+                }
+                case Command::Type::ClearLoco:
+                    erase_slot(cmd.addr);
+                    return;
+                case Command::Type::ClearSpeed:
+                    erase_speed(cmd.addr);
+                    return;
+                case Command::Type::SetCombined:
+                    set_combined(cmd.addr, cmd.state != 0);
+                    return;
+                case Command::Type::SignalPacket:
+                    enqueue_signal(static_cast<uint16_t>(cmd.state), cmd.packet);
+                    return;
+                case Command::Type::PomPacket:
+                    enqueue_pom(cmd.addr, cmd.state, cmd.packet);
+                    return;
+            }
+        }
+
+        /**
+         * Replaces pending aspect of the same signal, or adds a new one.
+         * When signal queue is full, the signal with fewest repeats left is dropped: it has been sent the most times.
+         */
+        void enqueue_signal(uint16_t addr11, const PacketWithRepeats &packet) {
+            for(auto &item: signals) {
+                if(item.addr11 == addr11) {
+                    item.packet = packet;
+                    item.repeats_left = ACCESSORY_PACKET_REPEATS;
+                    counters.signal_superseded.inc();
+                    return;
+                }
+            }
+            if(signals.full()) {
+                size_t victim = 0;
+                for(size_t i=1; i<signals.size(); i++) {
+                    if(signals[i].repeats_left < signals[victim].repeats_left) victim = i;
+                }
+                DCC_LOGD_ISR("Signal queue is full, dropping signal %d", signals[victim].addr11);
+                signals.erase(signals.begin() + victim);
+                counters.dropped.inc();
+            }
+            signals.push_back(SignalItem{addr11, ACCESSORY_PACKET_REPEATS, packet});
+        }
+
+        /** Takes one repeat of the next signal in round-robin order. */
+        void pop_signal(PacketWithRepeats &packet_out) {
+            if(signal_next >= signals.size()) signal_next = 0;
+            SignalItem &item = signals[signal_next];
+            packet_out = item.packet;
+            last_signal_emit = now;
+            if(--item.repeats_left == 0) {
+                signals.erase(signals.begin() + signal_next);
+            } else {
+                signal_next++;
+            }
+        }
+
+        /** Full POM queue drops the packet rather than holding up the command ring, and with it throttles. */
+        void enqueue_pom(LocoAddress addr, uint32_t token, const PacketWithRepeats &packet) {
+            if(pom.full()) {
+                DCC_LOGD_ISR("POM queue is full, dropping packet for %d", addr.addr());
+                counters.dropped.inc();
+                if(token != 0) pom_done.push(PomDone{token, false});
+                return;
+            }
+            pom.push_back(PomItem{addr, token, POM_PACKET_REPEATS, packet});
+        }
+
+        /**
+         * Takes one repeat of the next POM packet in round-robin order, skipping packets to the decoder
+         *   that got the last fetched packet, and packets that wait for an earlier one to the same decoder.
+         * @return false if there's no such packet.
+         */
+        bool pop_pom(PacketWithRepeats &packet_out) {
+            for(size_t k=0; k<pom.size(); k++) {
+                const size_t i = (pom_next + k) % pom.size();
+                PomItem &item = pom[i];
+                if(item.addr == last_addr) continue;
+                bool first = true;
+                for(size_t j=0; j<i && first; j++) first = pom[j].addr != item.addr;
+                if(!first) continue;
+
+                packet_out = item.packet;
+                last_pom_emit = now;
+                if(--item.repeats_left == 0) {
+                    if(item.token != 0) pom_done.push(PomDone{item.token, true});
+                    pom.erase(pom.begin() + i);
+                    pom_next = i;
+                } else {
+                    pom_next = i + 1;
                 }
+                return true;
             }
-            return it;
+            return false;
+        }
+
+        /** Keeps speed and function state of a row, combined instruction is built from it. */
+        static void update_state(LocoSlot &slot, size_t idx, uint32_t state) {
+            if(idx == 0) {
+                slot.speed_dir = state;
+            } else {
+                const fn_group fg = static_cast<fn_group>(idx - 1);
+                if(fn_group_first(fg) >= 16) return; // not in combined instruction
+                const uint32_t mask = (((1u << fn_group_size(fg)) - 1) << fn_group_first(fg)) & 0xFFFF;
+                slot.fns = (slot.fns & ~mask) | (state & mask);
+            }
+        }
+
+        void store_packet(SlotHandle h, LocoSlot &slot, size_t idx, const PacketWithRepeats &packet) {
+            const uint16_t id = refresh_id(h.index, idx);
+            if(!slot.packets[idx].has_value()) {
+                refresh_link(id, refresh_class(idx));
+            } else if(link_of(id).cls != refresh_class(idx)) {
+                // settled packet has changed, refresh it at full rate again
+                refresh_unlink(id);
+                refresh_link(id, refresh_class(idx));
+            }
+            link_of(id).last_change = now;
+            slot.packets[idx] = packet;
+        }
+
+        void remove_packet(SlotHandle h, LocoSlot &slot, size_t idx) {
+            if(!slot.packets[idx].has_value()) return;
+            refresh_unlink(refresh_id(h.index, idx));
+            slot.packets[idx].reset();
+        }
+
+        /**
+         * Encodes combined instruction from row state into speed-dir entry.
+         * Unlike other packets, it is encoded by consumer, as only consumer knows the whole state.
+         */
+        void store_combined(SlotHandle h, LocoSlot &slot) {
+            const auto bytes = make_combined_packet(loco_slots.address(h), slot.speed_dir, slot.fns);
+            store_packet(h, slot, 0, PacketWithRepeats::from_bytes(bytes, 1));
+        }
+
+        void set_combined(const LocoAddress addr, bool combined) {
+            const SlotHandle h = find_or_add_row(addr);
+            if(!h.valid()) return;
+            LocoSlot &slot = *loco_slots.get(h);
+            park_if_stopped(slot);
+            if(slot.combined == combined) return;
+            slot.combined = combined;
+            // a loco that has not got any packets yet will get them with first put
+            if(!slot.packets[0].has_value()) return;
+
+            if(combined) {
+                for(size_t idx=1; idx<N_PACKETS_PER_LOCO; idx++) remove_packet(h, slot, idx);
+                store_combined(h, slot);
+                enqueue_slot_packet(SlotLocation{h, 0}, PRIORITY_NORMAL);
+            } else {
+                const bool fwd = (slot.speed_dir & 0x80) != 0;
+                const LocoSpeed speed = LocoSpeed::from128(slot.speed_dir & 0x7F);
+                store_packet(h, slot, 0,
+                    PacketWithRepeats::from_bytes(make_speed_dir_packet(addr, speed, SpeedMode::S128, fwd), 1));
+                enqueue_slot_packet(SlotLocation{h, 0}, PRIORITY_NORMAL);
+                for(size_t idx=1; idx<N_PACKETS_PER_LOCO; idx++) {
+                    const auto bytes = make_fn_packet(addr, static_cast<fn_group>(idx - 1), slot.fns);
+                    store_packet(h, slot, idx, PacketWithRepeats::from_bytes(bytes, 1));
+                    enqueue_slot_packet(SlotLocation{h, idx}, PRIORITY_NORMAL);
+                }
+            }
+        }
+
+        void erase_slot(const LocoAddress addr) {
+            const SlotHandle h = loco_slots.find(addr);
+            if(!h.valid()) return;
+            const LocoSlot &slot = *loco_slots.get(h);
+            for(size_t idx=0; idx<N_PACKETS_PER_LOCO; idx++) {
+                if(slot.packets[idx].has_value()) refresh_unlink(refresh_id(h.index, idx));
+            }
+            // queued locations of this row become stale and are skipped by fetch_next_packet
+            loco_slots.erase(addr);
+            DCC_LOGD_ISR("Cleared slot of loco %d, %d left", addr.addr(), loco_slots.size());
+        }
+
+        /** Removes speed-dir packet of a row, combined instruction is split into function packets first. */
+        void erase_speed(const LocoAddress addr) {
+            const SlotHandle h = loco_slots.find(addr);
+            LocoSlot *slot = loco_slots.get(h);
+            if(slot == nullptr) return;
+            park_if_stopped(*slot);
+            if(slot->combined) {
+                slot->combined = false;
+                for(size_t idx=1; idx<N_PACKETS_PER_LOCO && slot->packets[0].has_value(); idx++) {
+                    const auto bytes = make_fn_packet(addr, static_cast<fn_group>(idx - 1), slot->fns);
+                    store_packet(h, *slot, idx, PacketWithRepeats::from_bytes(bytes, 1));
+                }
+            }
+            // a queued location of it is skipped by fetch_next_packet
+            remove_packet(h, *slot, 0);
+        }
+
+        /** Identifies a packet in the table by row index (stable while row exists) and packet index. */
+        static uint16_t refresh_id(uint16_t row, size_t idx) {
+            return row * N_PACKETS_PER_LOCO + idx;
+        }
+
+        RefreshLink& link_of(uint16_t id) {
+            return loco_slots.row_value(id / N_PACKETS_PER_LOCO).refresh[id % N_PACKETS_PER_LOCO];
         }
 
-        /** Put a slot location into priority queue. */
+        /** Adds a table packet to the tail of a class list, as if it was just sent. */
+        void refresh_link(uint16_t id, RefreshClass cls) {
+            RefreshList &list = refresh_lists[cls];
+            RefreshLink &link = link_of(id);
+            link.cls = cls;
+            link.last_emit = now;
+            link.prev = list.tail;
+            link.next = NO_REFRESH;
+            if(list.tail != NO_REFRESH) link_of(list.tail).next = id;
+            else list.head = id;
+            list.tail = id;
+        }
+
+        void refresh_unlink(uint16_t id) {
+            const RefreshLink &link = link_of(id);
+            RefreshList &list = refresh_lists[link.cls];
+            if(link.prev != NO_REFRESH) link_of(link.prev).next = link.next;
+            else list.head = link.next;
+            if(link.next != NO_REFRESH) link_of(link.next).prev = link.prev;
+            else list.tail = link.prev;
+        }
+
+        /** Moves just sent packet to the tail of its list, or to settled list if it hasn't changed for a while. */
+        void mark_emitted(uint16_t id) {
+            const RefreshLink &link = link_of(id);
+            const uint32_t elapsed = now - link.last_emit;
+            auto &interval = counters.interval[link.cls];
+            interval.count.inc();
+            interval.sum.inc(elapsed);
+            interval.max.update_max(elapsed);
+
+            const size_t idx = id % N_PACKETS_PER_LOCO;
+            const bool settled = idx != 0 && fn_settle_time != 0 && now - link.last_change >= fn_settle_time;
+            refresh_unlink(id);
+            refresh_link(id, settled ? REFRESH_FN_SETTLED : refresh_class(idx));
+        }
+
+        /**
+         * Picks the table packet with the largest time since last sending relative to its class period.
+         * If table can't be refreshed within target periods, all classes get stretched by the same factor
+         *   (so speed is still refreshed more often than functions).
+         * If nothing is due yet, the least early packet is sent, so track time is not wasted on idle packets.
+         * Only heads of class lists are compared, so this is O(number of classes) regardless of table size.
+         */
+        uint16_t most_overdue() const {
+            uint16_t best = NO_REFRESH;
+            uint32_t best_elapsed = 0, best_period = 1;
+            for(size_t c=0; c<N_REFRESH_CLASSES; c++) {
+                const uint16_t id = refresh_lists[c].head;
+                if(id == NO_REFRESH) continue;
+                const RefreshLink &link = loco_slots.row_value(id / N_PACKETS_PER_LOCO).refresh[id % N_PACKETS_PER_LOCO];
+                const uint32_t elapsed = now - link.last_emit;
+                const uint32_t period = refresh_periods[c] > 0 ? refresh_periods[c] : 1;
+                // elapsed/period > best_elapsed/best_period
+                if(best == NO_REFRESH || (uint64_t)elapsed * best_period > (uint64_t)best_elapsed * period) {
+                    best = id;
+                    best_elapsed = elapsed;
+                    best_period = period;
+                }
+            }
+            return best;
+        }
+
+        /**
+         * Put a slot location into priority queue, or merge it with already queued location
+         *   of the same packet.
+         */
         bool enqueue_slot_packet(SlotLocation loc, int priority) {
-            if(queue_packets.full()) return false;
+            for(QueueItem &item: queue_packets) {
+                if(!item.is_location()) continue;
+                const SlotLocation &queued = etl::get<SlotLocation>(item.data);
+                if(queued.handle == loc.handle && queued.idx == loc.idx) {
+                    // table already has the new packet, just make sure it's sent as urgently as requested
+                    if(priority > item.priority) item.priority = priority;
+                    counters.coalesced.inc();
+                    return true;
+                }
+            }
+
+            if(queue_packets.full() && !evict_location(priority)) {
+                counters.dropped.inc();
+                return false;
+            }
 
-            QueueItem item{
+            queue_packets.push_back(QueueItem{
                 .priority = priority,
+                .seq = queue_seq++,
                 .data = loc
-            };
-            queue_packets.push(item);
+            });
+            counters.queue_high_water.update_max(queue_packets.size());
+            return true;
+        }
+
+        /**
+         * Removes a queued slot location to make place for a new item.
+         * Prefers locations of cleared rows, then least urgent and newest.
+         * @param below only locations with priority lower than this are considered.
+         */
+        bool evict_location(int below) {
+            QueueItem *victim = nullptr;
+            for(QueueItem &item: queue_packets) {
+                if(!item.is_location()) continue;
+                if(loco_slots.get(etl::get<SlotLocation>(item.data).handle) == nullptr) {
+                    victim = &item;
+                    break;
+                }
+                if(item.priority >= below) continue;
+                if(victim == nullptr || victim->before(item)) victim = &item;
+            }
+            if(victim == nullptr) return false;
+            *victim = queue_packets.back();
+            queue_packets.pop_back();
+            counters.dropped.inc();
             return true;
         }
 
+        /** Removes and returns most urgent item. Queue must not be empty. */
+        QueueItem pop_queue_item() {
+            size_t best = 0;
+            for(size_t i=1; i<queue_packets.size(); i++) {
+                if(queue_packets[i].before(queue_packets[best])) best = i;
+            }
+            QueueItem item = queue_packets[best];
+            queue_packets[best] = queue_packets.back();
+            queue_packets.pop_back();
+            return item;
+        }
+
     };
 
     /** Specific template with data, templated by size. */
     template<size_t NUM_SLOTS>
     class PacketList: public BasePacketList{
+        static_assert(NUM_SLOTS * N_PACKETS_PER_LOCO < NO_REFRESH, "Too many slots");
     public:
         PacketList(): BasePacketList(_loco_slots) {}
 
     private:
-        using SlotMap = etl::map<LocoAddress, LocoSlot, NUM_SLOTS>;
+        using SlotMap = SlotTable<LocoSlot, NUM_SLOTS>;
         SlotMap _loco_slots;
 
     };
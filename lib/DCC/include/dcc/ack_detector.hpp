@@ -0,0 +1,131 @@
+#pragma once
+
+#include "current_samples.hpp"
+
+#include <cstdint>
+
+namespace dcc {
+
+    /**
+     * Recognises service mode ACK in current samples: S-9.2.3 asks decoder to increase its load
+     *   by at least 60mA for 6ms +-1ms.
+     *
+     * A pulse is a rise to baseline + threshold, a plateau, and a fall below baseline + threshold/2.
+     * Hysteresis keeps noise around threshold from splitting a pulse, and a single low sample inside
+     *   a plateau is taken for noise too: the pulse ends at the first of two low samples in a row.
+     * Once the rise is confirmed, pulse start is taken back to the first sample above threshold/2, so that
+     *   both edges are measured at the same level: a weak ACK whose first samples stay below threshold
+     *   in noise is not measured short.
+     * Pulses shorter than min width (spikes) or longer than max width (e.g. motor start) are not ACKs.
+     * Width is measured between samples, so default limits are 6ms +-1ms widened by 1ms sample period.
+     *
+     * Detection stops at the first ACK, until next begin().
+     */
+    class AckDetector {
+    public:
+        static constexpr uint16_t DEFAULT_THRESHOLD_MA = 60;
+        static constexpr uint32_t DEFAULT_MIN_US = 4000;
+        static constexpr uint32_t DEFAULT_MAX_US = 8000;
+
+        struct Ack {
+            uint32_t start_us;  ///< time of the first sample above threshold/2
+            uint32_t width_us;
+        };
+
+        void setThreshold(uint16_t mA) { threshold = mA; }
+
+        void setWidth(uint32_t min_us, uint32_t max_us) {
+            minUs = min_us;
+            maxUs = max_us;
+        }
+
+        /** Starts looking for ACK above `baseline_mA`. */
+        void begin(uint16_t baseline_mA) {
+            high = baseline_mA + threshold;
+            low = baseline_mA + threshold / 2;
+            state = State::Low;
+            lows = 0;
+            rising = false;
+        }
+
+        /** @return true if this sample completes an ACK. */
+        bool feed(const CurrentSample &s) {
+            switch(state) {
+                case State::Acked:
+                    return false;
+                case State::Low:
+                    if(s.mA < low) {
+                        rising = false;
+                        return false;
+                    }
+                    if(!rising) {
+                        rising = true;
+                        start = s.t_us;
+                    }
+                    if(s.mA >= high) {
+                        state = State::Pulse;
+                        lows = 0;
+                    }
+                    return false;
+                case State::Pulse:
+                case State::TooLong:
+                    break;
+            }
+
+            if(s.mA >= low) {
+                lows = 0;
+                if(state == State::Pulse && s.t_us - start > maxUs) {
+                    state = State::TooLong;
+                    rejectedCount++;
+                }
+                return false;
+            }
+            if(lows++ == 0) fall = s.t_us;
+            if(lows < 2) return false;
+
+            rising = false;
+            if(state == State::TooLong) {
+                state = State::Low;
+                return false;
+            }
+            const uint32_t width = fall - start;
+            if(width < minUs || width > maxUs) {
+                rejectedCount++;
+                state = State::Low;
+                return false;
+            }
+            found = Ack{start, width};
+            state = State::Acked;
+            return true;
+        }
+
+        bool acked() const { return state == State::Acked; }
+
+        /** Current is above threshold now, an ACK may be in progress. */
+        bool inPulse() const { return state == State::Pulse; }
+
+        /** Valid if acked(). */
+        Ack ack() const { return found; }
+
+        /** Pulses that were not ACKs because of their width, since construction. */
+        uint32_t rejected() const { return rejectedCount; }
+
+    private:
+        enum class State: uint8_t { Low, Pulse, TooLong, Acked };
+
+        uint16_t threshold{DEFAULT_THRESHOLD_MA};
+        uint32_t minUs{DEFAULT_MIN_US};
+        uint32_t maxUs{DEFAULT_MAX_US};
+
+        uint16_t high{0};
+        uint16_t low{0};
+        State state{State::Low};
+        uint8_t lows{0};
+        bool rising{false};     ///< in Low, samples are above low level since `start`
+        uint32_t start{0};
+        uint32_t fall{0};
+        Ack found{};
+        uint32_t rejectedCount{0};
+    };
+
+}
@@ -4,23 +4,28 @@
 #include "LocoSpeed.h"
 #include "packet.hpp"
 #include "PacketList.hpp"
+#include "current_samples.hpp"
 #include "power_event.hpp"
+#include "stats.hpp"
+#include "waveform_timing.hpp"
 #include "log.hpp"
 
+#include "arduino_compat.hpp"
+
 #include <etl/map.h>
 #include <etl/bitset.h>
 #include <etl/observer.h>
-
-#include <Arduino.h>
+#include <etl/vector.h>
 
 #include <atomic>
+#include <limits>
 
 
 namespace dcc {
 
 extern Packet idlePacket;
 extern Packet resetPacket;
-extern PacketBits idle_packet_bits;
+extern PacketWithRepeats idle_packet_with_repeats; ///< idle packet, for waveform generators when packet list is empty
 
 /**
  * A (abstract) class that manages one DCC track.
@@ -51,27 +56,45 @@ public:
     /** Sends a function group command to a locomotive.
      * Can either put it in a refreshing slot or only send once.
      */
-    void sendFunctionGroup(LocoAddress addr, fn_group group, uint32_t fn);
+    void sendFunctionGroup(LocoAddress addr, fn_group group, const FnState &fn);
+
+    /** Sends binary state control command (not refreshed). */
+    void sendBinaryState(LocoAddress addr, uint16_t state, bool on);
 
     /**
      * @param addr11 is 1-based.
      */
     void sendAccessory(uint16_t addr11, bool thr);
+
+    /** Sends signal aspect with extended accessory packet, through paced signal queue. */
+    void sendSignalAspect(uint16_t addr11, uint8_t aspect);
     /**
      * @param addr9 is 1-based
      * @param ch is 0-based.
      */
     // void sendAccessory(uint16_t addr9, uint8_t ch, bool);
 
-    int16_t readCVProg(int cv);
-    bool verifyCVByteProg(uint16_t cv, uint8_t bValue);
-    bool writeCVByteProg(int cv, uint8_t bValue);
-    bool writeCVBitProg(int cv, uint8_t bNum, uint8_t bValue);
+    /**
+     * Writes CV on main (POM), see make_pom_byte_packet() and BasePacketList::put_pom_packet().
+     * Fire and forget, PomQueue queues writes and reports when they are done. Service mode programming is done by ProgTrack.
+     */
     void writeCVByteMain(LocoAddress addr, int cv, uint8_t bValue);
     void writeCVBitMain(LocoAddress addr, int cv, uint8_t bNum, uint8_t bValue);
 
     void unloadSlot(const LocoAddress addr) { packets.clear_loco(addr); }
 
+    /** Stops refreshing speed of a loco, but not its functions, see BasePacketList::clear_loco_speed(). */
+    void unloadSpeed(const LocoAddress addr) { packets.clear_loco_speed(addr); }
+
+    /** See BasePacketList::set_loco_combined(). */
+    void setCombinedInstruction(const LocoAddress addr, bool v) { packets.set_loco_combined(addr, v); }
+
+    /** Stops all locos on this track with broadcast e-stop packet, see BasePacketList::emergency_stop_all(). */
+    void emergencyStop() {
+        packets.emergency_stop_all();
+        notify_observers(PowerEvent{getPower(), PowerEvent::Reason::EmergencyStop, this});
+    }
+
     /** Different channels may have different thresholds. */
     void setOvercurrentThreshold(uint16_t mA) { overCurrentThreshold = mA; }
     bool checkOvercurrent() {
@@ -95,6 +118,39 @@ public:
     /** Reads current consumption and updates internal state. */
     virtual void updateCurrent() = 0;
 
+    /** Reads current and records it into currentSamples(), called by CurrentMeter every 1ms. */
+    void sampleCurrent(uint32_t now_us) {
+        updateCurrent();
+        samples.push(CurrentSample{now_us, current.load()});
+    }
+
+    /** Latest current samples, e.g. for ACK detection. */
+    const CurrentRing& currentSamples() const { return samples; }
+
+    /**
+     * What waveform generator has put on track, see countTransmission().
+     * Counters wrap around, rates should be computed from differences of two snapshots.
+     */
+    struct TrackStats {
+        uint32_t packets;   ///< packet transmissions, including repeats and idle packets
+        uint32_t repeats;   ///< transmissions that were repeats of previous packet
+        uint32_t idle;      ///< idle packets sent because packet list was empty
+        uint32_t bits;      ///< bits on track, preambles included
+    };
+
+    /** Can be called from any task, does not block waveform generator. */
+    TrackStats getTrackStats() const {
+        return {trackPackets.get(), trackRepeats.get(), trackIdle.get(), trackBits.get()};
+    }
+
+    /** Refill timing of waveform generator, all zeros unless built with DCC_WAVEFORM_TIMING. */
+    virtual WaveformTiming::Stats getTimingStats() const { return {}; }
+
+    /** Packet mix and queue statistics of this channel's packet list. */
+    BasePacketList::Stats getPacketStats() const { return packets.stats(); }
+
+    void resetStatsMax() { packets.reset_stats_max(); }
+
     virtual ~BaseChannel() = default;
 
 protected:
@@ -102,21 +158,22 @@ protected:
     std::atomic<uint16_t> current{0};
     std::atomic<uint16_t> maxCurrent{0};
     bool overCurrentFlag{false};
+    CurrentRing samples;
 
     BasePacketList &packets;
 
-    /** Tries to load a packet for a specified duration. */
-    bool loadPacket(const etl::span<uint8_t> packet, size_t nRepeat, size_t timeout_ms=1000) {
-        //TODO: original code probably waited until packet appeared on tracks, while this just waits for space in queue.
-        for(size_t i=0; i<timeout_ms; i++) {
-            if (packets.put_generic_packet(packet, nRepeat)) return true;
-            delay(1);
-        }
-        return false;
+    StatCounter trackPackets, trackRepeats, trackIdle, trackBits;
+
+    /** To be called by waveform generator for every packet transmission. */
+    void countTransmission(const PacketWithRepeats &p, bool idle, bool repeat) {
+        trackPackets.inc();
+        if(repeat) trackRepeats.inc();
+        if(idle) trackIdle.inc();
+        trackBits.inc(DEF_PREAMBLE_LEN + p.payload_bits());
     }
 
-    uint getBaselineCurrent() const;
-    bool checkCurrentResponse(uint baseline) const;
+    friend class ProgTrack; ///< puts service mode packets
+    friend class PomQueue;  ///< puts ops mode packets
 
 };
 
@@ -136,9 +193,9 @@ public:
         channels.push_back(&ch);
     }
 
-    void update() {
+    void update(uint32_t now_us) {
         for(auto ch: channels) {
-            ch->updateCurrent();
+            ch->sampleCurrent(now_us);
         }
     }
 
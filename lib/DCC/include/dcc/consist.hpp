@@ -0,0 +1,143 @@
+#pragma once
+
+#include "base_channel.hpp"
+#include "LocoAddress.h"
+#include "log.hpp"
+
+#include <etl/map.h>
+#include <etl/vector.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dcc {
+
+constexpr uint16_t CV_CONSIST_ADDR = 19;
+
+/** CV19 value of a consist member: consist address in bits 0-6, bit 7 is set if loco runs opposite to consist. */
+constexpr uint8_t consist_cv19(uint8_t consistAddr, bool reversed) {
+    return (consistAddr & 0x7F) | (reversed ? 0x80 : 0);
+}
+
+/**
+ * Advanced consists (RP-9.2.1): members get consist address in CV19 (see consist_cv19()) written on main,
+ *   and then take speed and direction from it, while functions stay on their own addresses.
+ * Consists and members are identified by slots of the owner (e.g. CommandStation), which drives the consist
+ *   through its own slot with short consist address, so the whole consist is one refresh row.
+ * A member's own speed packet is removed from refresh of the main channel, its function packets are still refreshed,
+ *   so a decoder that loses power on dirty track gets its lights and sound back.
+ *
+ * Not thread safe, to be used from one task.
+ */
+template<size_t N_CONSISTS, size_t N_MEMBERS>
+class ConsistTable {
+public:
+    struct Member {
+        uint8_t slot;
+        LocoAddress addr;
+        bool reversed; ///< loco runs opposite to consist direction
+    };
+    using Members = etl::vector<Member, N_MEMBERS>;
+
+    /** Main track channel, CV19 is written and refresh is changed on it. Can be nullptr. */
+    void setChannel(BaseChannel *c) { ch = c; }
+
+    bool full() const { return consists.full(); }
+
+    /**
+     * Registers a consist driven through `consistSlot`.
+     * @return false if address is not 1-127, slot is already a consist, or there's no place.
+     */
+    bool create(uint8_t consistSlot, uint8_t consistAddr) {
+        if(consistAddr == 0 || consistAddr > 127 || consists.full() || isConsist(consistSlot)) return false;
+        consists[consistSlot] = Consist{consistAddr, Members{}};
+        return true;
+    }
+
+    bool isConsist(uint8_t slot) const { return consists.find(slot) != consists.end(); }
+
+    /** @return short address of consist, 0 if `consistSlot` is not a consist. */
+    uint8_t address(uint8_t consistSlot) const {
+        auto c = consists.find(consistSlot);
+        return c != consists.end() ? c->second.addr : 0;
+    }
+
+    /**
+     * Adds a loco to consist: writes its CV19 and stops refreshing its own speed.
+     * A loco that is a member of another consist is moved (its CV19 is just overwritten).
+     * @return false if `consistSlot` is not a consist or it is full.
+     */
+    bool add(uint8_t consistSlot, uint8_t slot, LocoAddress addr, bool reversed) {
+        auto c = consists.find(consistSlot);
+        if(c == consists.end() || isConsist(slot)) return false;
+        if(consistOf(slot) != 0) erase(slot);
+        if(c->second.members.full()) return false;
+        DCC_LOGI("Loco %d joins consist %d%s", addr.addr(), c->second.addr, reversed ? " reversed" : "");
+        c->second.members.push_back(Member{slot, addr, reversed});
+        if(ch == nullptr) return true;
+        ch->unloadSpeed(addr);
+        ch->writeCVByteMain(addr, CV_CONSIST_ADDR, consist_cv19(c->second.addr, reversed));
+        return true;
+    }
+
+    /**
+     * Removes a loco from its consist and clears its CV19.
+     * Its speed is not refreshed until owner sends it again.
+     * @return slot of consist it has left, 0 if it was in none.
+     */
+    uint8_t remove(uint8_t slot) {
+        const uint8_t consistSlot = consistOf(slot);
+        if(consistSlot == 0) return 0;
+        const Member m = erase(slot);
+        DCC_LOGI("Loco %d leaves consist %d", m.addr.addr(), address(consistSlot));
+        if(ch != nullptr) ch->writeCVByteMain(m.addr, CV_CONSIST_ADDR, 0);
+        return consistSlot;
+    }
+
+    /** Teardown: removes members that are left (see remove()) and forgets the consist. */
+    void release(uint8_t consistSlot) {
+        auto c = consists.find(consistSlot);
+        if(c == consists.end()) return;
+        while(!c->second.members.empty()) remove(c->second.members.back().slot);
+        consists.erase(c);
+    }
+
+    /** @return slot of consist the loco is member of, 0 if none. */
+    uint8_t consistOf(uint8_t slot) const {
+        for(const auto &c: consists) {
+            for(const auto &m: c.second.members) {
+                if(m.slot == slot) return c.first;
+            }
+        }
+        return 0;
+    }
+
+    const Members* members(uint8_t consistSlot) const {
+        auto c = consists.find(consistSlot);
+        return c != consists.end() ? &c->second.members : nullptr;
+    }
+
+private:
+    struct Consist {
+        uint8_t addr;
+        Members members;
+    };
+
+    etl::map<uint8_t, Consist, N_CONSISTS> consists; ///< key is consist slot
+    BaseChannel *ch{nullptr};
+
+    Member erase(uint8_t slot) {
+        for(auto &c: consists) {
+            auto &m = c.second.members;
+            for(auto it = m.begin(); it != m.end(); ++it) {
+                if(it->slot != slot) continue;
+                const Member ret = *it;
+                m.erase(it);
+                return ret;
+            }
+        }
+        return Member{};
+    }
+};
+
+}
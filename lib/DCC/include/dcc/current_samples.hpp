@@ -0,0 +1,83 @@
+#pragma once
+
+#include <etl/algorithm.h>
+#include <etl/array.h>
+#include <etl/span.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace dcc {
+
+    /** Track current at a point in time. */
+    struct CurrentSample {
+        uint32_t t_us;  ///< wraps around, compare differences only
+        uint16_t mA;
+    };
+
+    /**
+     * Lock-free single-writer ring of the latest current samples, written by current meter every 1ms.
+     *
+     * Writer never waits: it overwrites the oldest sample. Every reader keeps its own position and gets
+     *   samples in order; a reader that falls behind by more than N samples loses the oldest ones.
+     * Samples are checked after copying (as with a seqlock), so a sample being overwritten
+     *   while it's read is never returned.
+     *
+     * @tparam N capacity, must be a power of 2.
+     */
+    template<size_t N>
+    class SampleRing {
+        static_assert(N >= 2 && (N & (N - 1)) == 0, "SampleRing size must be a power of 2");
+    public:
+        /** Writer side. */
+        void push(const CurrentSample &s) {
+            const uint32_t i = w.load(std::memory_order_relaxed);
+            t[i & MASK].store(s.t_us, std::memory_order_relaxed);
+            mA[i & MASK].store(s.mA, std::memory_order_relaxed);
+            w.store(i + 1, std::memory_order_release);
+        }
+
+        /** Position of the next sample to be written: reading from here gets only new samples. */
+        uint32_t head() const { return w.load(std::memory_order_acquire); }
+
+        /**
+         * Copies samples from position `pos` on into `out`, and advances `pos` past them.
+         * @return number of samples copied.
+         */
+        size_t read(uint32_t &pos, etl::span<CurrentSample> out) const {
+            const uint32_t h = w.load(std::memory_order_acquire);
+            if(h - pos > N) pos = h - N;
+            size_t n = h - pos;
+            if(n > out.size()) n = out.size();
+            for(size_t k=0; k<n; k++) {
+                const uint32_t i = (pos + k) & MASK;
+                out[k] = CurrentSample{t[i].load(std::memory_order_relaxed), mA[i].load(std::memory_order_relaxed)};
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // writer may be storing the next sample right now, over the oldest one
+            const uint32_t first_valid = w.load(std::memory_order_relaxed) + 1 - N;
+            const int32_t stale = static_cast<int32_t>(first_valid - pos);
+            if(stale > 0) {
+                const size_t skip = etl::min(static_cast<size_t>(stale), n);
+                for(size_t k=skip; k<n; k++) out[k - skip] = out[k];
+                n -= skip;
+                pos = first_valid;
+            }
+            pos += n;
+            return n;
+        }
+
+        static constexpr size_t capacity() { return N; }
+
+    private:
+        static constexpr uint32_t MASK = N - 1;
+
+        etl::array<std::atomic<uint32_t>, N> t{};
+        etl::array<std::atomic<uint16_t>, N> mA{};
+        std::atomic<uint32_t> w{0};
+    };
+
+    using CurrentRing = SampleRing<64>; ///< 64ms of 1ms samples
+
+}
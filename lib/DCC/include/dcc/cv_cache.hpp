@@ -0,0 +1,220 @@
+#pragma once
+
+#include "LocoAddress.h"
+#include "log.hpp"
+
+#include <etl/span.h>
+#include <etl/vector.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dcc {
+
+    struct CvValue {
+        uint16_t cv;    ///< 1-based
+        uint8_t value;
+    };
+
+    /**
+     * Decoder identity, as far as CVs tell: manufacturer (CV8), version (CV7) and address
+     *   (long one from CV17/CV18 if CV29 bit 5 is set, short one from CV1 otherwise).
+     */
+    struct DecoderId {
+        uint8_t manufacturer;
+        uint8_t version;
+        LocoAddress address;
+
+        uint32_t key() const { return uint32_t(manufacturer) << 24 | uint32_t(version) << 16 | address.key(); }
+        bool operator==(const DecoderId &o) const { return key() == o.key(); }
+    };
+
+    constexpr uint16_t CV_SHORT_ADDR = 1;
+    constexpr uint16_t CV_VERSION = 7;
+    constexpr uint16_t CV_MANUFACTURER = 8;
+    constexpr uint16_t CV_LONG_ADDR_HI = 17;
+    constexpr uint16_t CV_LONG_ADDR_LO = 18;
+    constexpr uint16_t CV_CONFIG = 29;
+
+    constexpr size_t MAX_DECODER_CVS = 256;
+
+    /**
+     * CVs from `first` to `last` in the order to read them from a decoder: identity CVs first,
+     *   so that values stored for this decoder are known (and predicted) for the rest of them.
+     * @return CV number `index` in this order, 0 if there are not that many.
+     */
+    inline uint16_t decoder_read_order(uint16_t first, uint16_t last, uint16_t index) {
+        constexpr uint16_t IDENTITY[] = {CV_SHORT_ADDR, CV_VERSION, CV_MANUFACTURER, CV_CONFIG, CV_LONG_ADDR_HI, CV_LONG_ADDR_LO};
+        auto identity = [&](uint32_t cv) {
+            for(auto i: IDENTITY) if(i == cv) return true;
+            return false;
+        };
+        for(auto cv: IDENTITY) {
+            if(cv < first || cv > last) continue;
+            if(index-- == 0) return cv;
+        }
+        for(uint32_t cv = first; cv <= last; cv++) {
+            if(identity(cv)) continue;
+            if(index-- == 0) return static_cast<uint16_t>(cv);
+        }
+        return 0;
+    }
+
+    /** CV values of one decoder, sorted by CV number. */
+    using DecoderCvs = etl::vector<CvValue, MAX_DECODER_CVS>;
+
+    /** Persistent storage of decoder CVs, e.g. in flash. */
+    class CvStorage {
+    public:
+        virtual bool load(const DecoderId &id, DecoderCvs &cvs) = 0;
+        virtual bool save(const DecoderId &id, const DecoderCvs &cvs) = 0;
+        virtual ~CvStorage() = default;
+
+        static constexpr size_t PACKED_SIZE = 3; ///< bytes per CV: number (LE) and value
+
+        /** @return number of bytes used in `out`. */
+        static size_t pack(const DecoderCvs &cvs, etl::span<uint8_t> out) {
+            size_t n = 0;
+            for(const auto &c: cvs) {
+                if(n + PACKED_SIZE > out.size()) break;
+                out[n++] = c.cv & 0xFF;
+                out[n++] = c.cv >> 8;
+                out[n++] = c.value;
+            }
+            return n;
+        }
+
+        static void unpack(etl::span<const uint8_t> in, DecoderCvs &cvs) {
+            cvs.clear();
+            for(size_t i=0; i + PACKED_SIZE <= in.size() && !cvs.full(); i += PACKED_SIZE) {
+                cvs.push_back(CvValue{static_cast<uint16_t>(in[i] | in[i+1] << 8), in[i+2]});
+            }
+        }
+    };
+
+    /**
+     * CV values of the decoder on programming track, as they are read, verified and written.
+     *
+     * Once identity CVs are known (see DecoderId), values stored for this decoder earlier are loaded
+     *   from CvStorage, so CVs that were not read in this session can be predicted too; save() writes them back.
+     * A different CV7 or CV8 means another decoder: what's known is saved and forgotten.
+     *
+     * Not thread-safe, used from programming track loop.
+     */
+    class CvCache {
+    public:
+        void setStorage(CvStorage *s) { storage = s; }
+
+        bool get(uint16_t cv, uint8_t &value) const {
+            const CvValue *c = find(cv);
+            if(c == nullptr) return false;
+            value = c->value;
+            return true;
+        }
+
+        /** Value seen on track. */
+        void put(uint16_t cv, uint8_t value) {
+            const CvValue *old = find(cv);
+            if(old != nullptr && old->value == value) return;
+            if(old != nullptr && (cv == CV_VERSION || cv == CV_MANUFACTURER)) {
+                DCC_LOGI("CV%d changed %d->%d, another decoder", cv, old->value, value);
+                save();
+                clear();
+            }
+            if(!store(cv, value)) return;
+            changed = true;
+            if(!loaded && identify(current)) load();
+        }
+
+        /** Value is not known anymore, e.g. its verify failed. */
+        void forget(uint16_t cv) {
+            CvValue *c = find(cv);
+            if(c != nullptr) cvs.erase(c);
+        }
+
+        /** Forgets everything, e.g. when another decoder is put on programming track. */
+        void clear() {
+            cvs.clear();
+            loaded = changed = false;
+        }
+
+        /** @return false if identity CVs are not known yet. */
+        bool id(DecoderId &out) const {
+            if(!loaded) return false;
+            out = current;
+            return true;
+        }
+
+        const DecoderCvs& values() const { return cvs; }
+
+        /** Values changed since load or last save(). */
+        bool dirty() const { return changed && loaded; }
+
+        /** Writes values to storage if they changed. */
+        bool save() {
+            if(!dirty() || storage == nullptr) return false;
+            identify(current); // address may have been written
+            changed = false;
+            DCC_LOGI("Saving %d CVs of decoder %08x", (int)cvs.size(), current.key());
+            return storage->save(current, cvs);
+        }
+
+    private:
+        CvStorage *storage{nullptr};
+        DecoderCvs cvs;
+        DecoderId current{};
+        bool loaded{false};   ///< identity is known and stored values were merged
+        bool changed{false};
+
+        const CvValue* find(uint16_t cv) const {
+            for(const auto &c: cvs) {
+                if(c.cv == cv) return &c;
+                if(c.cv > cv) break;
+            }
+            return nullptr;
+        }
+
+        CvValue* find(uint16_t cv) { return const_cast<CvValue*>(static_cast<const CvCache*>(this)->find(cv)); }
+
+        /** Keeps `cvs` sorted. @return false if there's no room. */
+        bool store(uint16_t cv, uint8_t value) {
+            auto it = cvs.begin();
+            while(it != cvs.end() && it->cv < cv) ++it;
+            if(it != cvs.end() && it->cv == cv) {
+                it->value = value;
+                return true;
+            }
+            if(cvs.full()) {
+                DCC_LOGW("No room for CV%d", cv);
+                return false;
+            }
+            cvs.insert(it, CvValue{cv, value});
+            return true;
+        }
+
+        bool identify(DecoderId &out) const {
+            uint8_t cv1, cv7, cv8, cv17, cv18, cv29;
+            if(!get(CV_VERSION, cv7) || !get(CV_MANUFACTURER, cv8) || !get(CV_CONFIG, cv29)) return false;
+            if(cv29 & 0x20) {
+                if(!get(CV_LONG_ADDR_HI, cv17) || !get(CV_LONG_ADDR_LO, cv18)) return false;
+                out = DecoderId{cv8, cv7, LocoAddress::longAddr((cv17 & 0x3F) << 8 | cv18)};
+            } else {
+                if(!get(CV_SHORT_ADDR, cv1)) return false;
+                out = DecoderId{cv8, cv7, LocoAddress::shortAddr(cv1 & 0x7F)};
+            }
+            return true;
+        }
+
+        /** Merges stored values, those seen in this session take precedence. */
+        void load() {
+            loaded = true;
+            DecoderCvs stored;
+            if(storage == nullptr || !storage->load(current, stored)) return;
+            DCC_LOGI("Loaded %d CVs of decoder %08x", (int)stored.size(), current.key());
+            for(const auto &s: stored) {
+                if(find(s.cv) == nullptr) store(s.cv, s.value);
+            }
+        }
+    };
+
+}
@@ -33,9 +33,7 @@ namespace dcc {
             static_cast<ESP32CurrentMeter*>(arg)->adcTimerFunc();
         }
         void adcTimerFunc() {
-            for(auto ch: channels) {
-                ch->updateCurrent();
-            }
+            update(static_cast<uint32_t>(esp_timer_get_time()));
         }
     };
 }
@@ -1,10 +1,15 @@
 #pragma once
 
 #include "esp32_channel.hpp"
+#include "symbol_encoder.hpp"
+#include "tx_pipeline.hpp"
+#include "waveform_timing.hpp"
 
 #include <driver/rmt_common.h>
 #include <driver/rmt_encoder.h>
 #include <driver/rmt_tx.h>
+#include <esp_timer.h>
+#include <esp_cpu.h>
 
 #include <etl/array.h>
 #include <etl/span.h>
@@ -17,7 +22,15 @@ namespace dcc {
     // constexpr int _debug_pin2 = 12;
 
 /**
- * A DCC channel that outputs DCC waveform using ESP32 RMT TX peripheral.
+ * A DCC channel that outputs DCC waveform using ESP32 RMT TX peripheral (new driver).
+ *
+ * Transmit task keeps RMT transaction queue full (see TxPipeline): while packets queued before
+ *   are on the wire, it fetches and encodes the next one into a free buffer. So a preempted task
+ *   causes a gap only if it's late by more than the whole queue (QUEUE_DEPTH packets, 15ms and more).
+ * Gaps that did happen are counted, see getPipelineStats().
+ *
+ * With DCC_WAVEFORM_TIMING, packet fetch and encoding time and gaps go to histograms (see getTimingStats()).
+ *   Refill is done by the task here, so there is no interrupt latency to measure, and overrun is a queue underrun.
  */
 class ESP32RMTChannel : public ESP32Channel {
 public:
@@ -39,7 +52,7 @@ public:
         txCfg.clk_src = RMT_CLK_SRC_DEFAULT;
         txCfg.resolution_hz = 1000'000;  // 1 tick = 1us
         txCfg.mem_block_symbols = 64;
-        txCfg.trans_queue_depth = 1; // !!! can be 2 (in zimo example)
+        txCfg.trans_queue_depth = QUEUE_DEPTH;
         txCfg.intr_priority = 0;
 
         if (rmt_new_tx_channel(&txCfg, &_rmtChannel) != ESP_OK) {
@@ -55,10 +68,10 @@ public:
             return;
         }
 
-        // rmt_tx_event_callbacks_t cb {
-        //     .on_trans_done = txDoneFunc
-        // };
-        // rmt_tx_register_event_callbacks(_rmtChannel, &cb, this);
+        rmt_tx_event_callbacks_t cb {
+            .on_trans_done = txDone_c
+        };
+        rmt_tx_register_event_callbacks(_rmtChannel, &cb, this);
 
         if (rmt_enable(_rmtChannel) != ESP_OK) {
             DCC_LOGW("RMT TX channel enable failed");
@@ -69,6 +82,7 @@ public:
             return;
         }
 
+        _timing.begin(getCpuFrequencyMhz());
         _running = true;
         if (xTaskCreate(packetTaskLoop_c, "dcc_rmt_tx", 4096, this, 1, &_packetTask) != pdPASS) {
             _running = false;
@@ -103,9 +117,32 @@ public:
 private:
     static constexpr uint16_t DCC_ONE_HALF_US = 58;
     static constexpr uint16_t DCC_ZERO_HALF_US = 116;
-    static constexpr size_t MAX_RMT_ITEMS = PacketBits::MAX_RAW_PACKET_BYTES * 8;
+    static constexpr size_t PREAMBLE_BITS = DEF_PREAMBLE_LEN - 1;
 
-    etl::array<rmt_symbol_word_t, MAX_RMT_ITEMS> rmt_items;
+    using Encoder = SymbolEncoder<DCC_ONE_HALF_US, DCC_ZERO_HALF_US, true>;
+
+    // preamble, payload and one extra bit
+    static constexpr size_t MAX_RMT_ITEMS = PREAMBLE_BITS + Encoder::packet_symbols(MAX_PACKET_LEN) + 1;
+
+    /** Transactions queued in RMT driver, each one is a whole packet (roughly 5-7ms). */
+    static constexpr size_t QUEUE_DEPTH = 3;
+
+    /**
+     * Driver starts next queued transaction from its interrupt, which makes last bit of previous one longer.
+     * It goes to the extra bit after end bit. TODO: to tune later.
+     */
+    static constexpr uint16_t TX_RESTART_US = 30;
+
+public:
+    using Pipeline = TxPipeline<rmt_symbol_word_t, MAX_RMT_ITEMS, QUEUE_DEPTH>;
+
+    Pipeline::Stats getPipelineStats() const { return pipeline.stats(); }
+
+    WaveformTiming::Stats getTimingStats() const override { return _timing.stats(); }
+
+private:
+    Pipeline pipeline;
+    WaveformTiming _timing;
 
     rmt_channel_handle_t _rmtChannel{nullptr};
     rmt_encoder_handle_t _copyEncoder{nullptr};
@@ -118,36 +155,30 @@ private:
         vTaskDelete(nullptr);
     }
 
+    static IRAM_ATTR bool txDone_c(rmt_channel_handle_t, const rmt_tx_done_event_data_t *, void *arg) {
+        static_cast<ESP32RMTChannel *>(arg)->pipeline.done(static_cast<uint32_t>(esp_timer_get_time()));
+        return false;
+    }
+
     static size_t fillRmt(
         const Packet &packet,
         etl::span<rmt_symbol_word_t> items
     ) {
 
-        if (items.size() == 0 || packet.size() == 0) {
+        if (items.size() < PREAMBLE_BITS + 1 || packet.size() == 0) {
             return 0;
         }
 
-        PacketBits bits = PacketBits::from_packet(packet, DEF_PREAMBLE_LEN-1);
+        size_t n = Encoder::fill_preamble(PREAMBLE_BITS, items);
+        // TODO: if packet does not fit, this skips it. Maybe fail?
+        const size_t payload = Encoder::fill_packet(packet, items.subspan(n, items.size() - n - 1));
+        if(payload == 0) return 0;
+        n += payload;
 
         // add one bit more so that last bit with currupted duration is not an end bit.
-        // uint8_t *dd = bits.buf.data();
-        // DCC_LOGI("bytes %d: %02X %02X %02X", packet.size(), packet[0],packet[1],packet[2]);
-        // Serial.printf("bytes %s\r\n", fmt_span(packet));
-        bits.append_bit(1);
-        // DCC_LOGI("bits  %d: %02X %02X %02X %02X  %02X %02X %02X", bits.size_bits, dd[0],dd[1],dd[2], dd[3],dd[4],dd[5], dd[6]);
-
-        // TODO: if packet does not fit, this just fills what it can. Maybe fail?
-        size_t nBit = 0;
-        for (nBit = 0; nBit < bits.size_bits && nBit < items.size(); ++nBit) {
-            const bool isOne = bits.bit_at(nBit);
-            const uint16_t half = isOne ? DCC_ONE_HALF_US : DCC_ZERO_HALF_US;
-
-            rmt_symbol_word_t &item = items[nBit];
-            item.level0 = 1;  item.duration0 = half;
-            item.level1 = 0;  item.duration1 = half;
-        }
+        items[n++].val = Encoder::ONE;
 
-        return nBit;
+        return n;
     }
 
     void packetTaskLoop() {
@@ -155,9 +186,11 @@ private:
 
         while (_running) {
             // gpio_set_level(static_cast<gpio_num_t>(_debug_pin), 1);
-            if (!packets.fetch_next_packet(packet)) {
+            const uint32_t refillStart = esp_cpu_get_cycle_count();
+            const bool fetched = packets.fetch_next_packet(packet);
+            if (!fetched) {
                 //DCC_LOGD_ISR("No packets pending, sending idle");
-                packet = {idlePacket, 1};
+                packet = idle_packet_with_repeats;
             } else {
                 DCC_LOGD("fetched: %sx%d", fmt_span(packet.packet), packet.nRepeats);
             }
@@ -166,12 +199,18 @@ private:
             tx_opts.flags.eot_level = 0; // set output low at end of transmission to match last pulse
             // gpio_set_level(static_cast<gpio_num_t>(_debug_pin), 0);
 
+            // packets before this one are still being sent from other buffers
+            auto &rmt_items = pipeline.next();
             const size_t itemCount = fillRmt(packet.packet, rmt_items);
             assert(itemCount>0);
-            rmt_items[itemCount-1].duration1 -= 30; // compensate for latency before next transmission starts. TODO: to tune later.
+            rmt_items[itemCount-1].duration1 -= TX_RESTART_US;
+            _timing.refill_done(refillStart, esp_cpu_get_cycle_count());
 
             // gpio_set_level(static_cast<gpio_num_t>(_debug_pin), 1);
             for(size_t i=0; i<packet.nRepeats; i++) { // OG ESP32 doesn't support loop_count, so loop manually
+                if(i>0 && packets.estop_pending()) break;
+                // before rmt_transmit(), which blocks while queue is full: transmission can be done before it returns
+                _timing.packet_gap(pipeline.submitted(static_cast<uint32_t>(esp_timer_get_time())));
                 ESP_ERROR_CHECK(rmt_transmit(
                     _rmtChannel,
                     this->_copyEncoder,
@@ -179,7 +218,9 @@ private:
                     itemCount * sizeof(rmt_symbol_word_t),
                     &tx_opts
                 ));
+                countTransmission(packet, !fetched, i>0);
             }
+            pipeline.advance();
             // gpio_set_level(static_cast<gpio_num_t>(_debug_pin), 0);
 
         }
@@ -2,8 +2,12 @@
 
 #include "base_channel.hpp"
 #include "esp32_channel.hpp"
+#include "symbol_encoder.hpp"
+#include "symbol_stream.hpp"
+#include "waveform_timing.hpp"
 
 #include <rmt_cont.h>
+#include <esp_cpu.h>
 
 #include <etl/array.h>
 #include <etl/span.h>
@@ -21,26 +25,70 @@ namespace dcc {
  *   . in TX DONE interrupt rewrite only payload area.
  *     RMT is outputting preamble while core is filling payload,
  *     so there are no gaps.
+ * Payload is converted to RMT items with a lookup table (see SymbolEncoder)
+ *   to keep the interrupt short.
  *
- * DCC packet always starts at the beginning of the RMT block,
- *   as a consequence it must fully fit into RMT memory.
+ * In this mode (Refill::Loop) DCC packet always starts at the beginning of the RMT block,
+ *   as a consequence it must fully fit into RMT memory, and takes 2 memory blocks.
  * Not a problem for OG ESP32 (it has 8 channels 64 bits each, which can be combined),
  *   somewhat a problem for ESP32-S2/S3 (4 TX blocks 48 bits each),
  *   but definitely a problem for ESP32-C3/C5/C6 where there are only 2 TX blocks 48 bits each.
  *
+ * Refill::PingPong needs only 1 memory block for any packet length: RMT runs in wrap mode
+ *   with TX threshold at half of the block, and the threshold interrupt refills the half that has
+ *   just been sent from an endless SymbolStream, while the other half is being output.
+ *   Interrupt has half a block of symbols (at least 24 * 116us) to do it.
+ *
  * On memory blocks:
  *   https://docs.espressif.com/projects/arduino-esp32/en/latest/api/rmt.html#rmt-memory-blocks
+ *
+ * Optional RailCom cutout (see setRailcomCutout()): the block starts with a cutout symbol
+ *   followed by a shorter preamble, so that cutout comes right after end bit of previous packet.
+ * H-bridge is put into brake by a second RMT channel on brake pin, running in loop mode alongside:
+ *   its block has the same symbol durations with levels replaced (see SymbolEncoder::brake_symbol()),
+ *   and is refilled together with data block, so both stay in sync.
+ *
+ * With DCC_WAVEFORM_TIMING, refill interrupts are timed (see WaveformTiming, getTimingStats()).
+ *   Loop mode overruns when payload is written after preamble is out,
+ *   ping-pong mode when a half is refilled after the other one is out.
  */
 class ESP32RMTChannel : public ESP32Channel {
 public:
+    enum class Refill {
+        Loop,       ///< packet fits in memory, RMT loops it, payload is rewritten in TX DONE interrupt
+        PingPong,   ///< endless stream, half of memory is refilled in TX threshold interrupt
+    };
+
+    /** Loop mode is well proven on OG ESP32, other chips have too little RMT memory for it. */
+    static constexpr Refill DEFAULT_REFILL = SOC_RMT_MEM_WORDS_PER_CHANNEL >= 64 ? Refill::Loop : Refill::PingPong;
+
     ESP32RMTChannel(
         uint8_t outputPin,
         uint8_t enPin,
         uint8_t sensePin,
-        BasePacketList &packets
-    ) : ESP32Channel{outputPin, enPin, sensePin, packets}
+        BasePacketList &packets,
+        Refill refill = DEFAULT_REFILL
+    ) : ESP32Channel{outputPin, enPin, sensePin, packets},
+        _refill{refill},
+        _memBlocks{refill == Refill::PingPong ? size_t{1} : size_t{2}}
     { }
 
+    /**
+     * Enables RailCom cutout after every packet. `brakePin` goes high during cutout
+     *   (e.g. BRAKE input of LMD18200) to short track outputs. Must be called before begin().
+     */
+    void setRailcomCutout(uint8_t brakePin) {
+        _brakePin = brakePin;
+        if(!_railcom) _brakeChannel = static_cast<rmt_channel_t>(incChannel(_memBlocks));
+        _railcom = true;
+    }
+
+    bool getRailcomCutout() const { return _railcom; }
+
+    Refill getRefill() const { return _refill; }
+
+    WaveformTiming::Stats getTimingStats() const override { return _timing.stats(); }
+
     void begin() override {
         ESP32Channel::begin();
 
@@ -50,23 +98,56 @@ public:
         cfg.channel = _rmtChannel;
         cfg.clk_div = APB_CLK_FREQ  / 1'000'000;
         cfg.gpio_num = static_cast<gpio_num_t>(_outputPin);
-        cfg.mem_block_num = MEM_BLOCKS;
+        cfg.mem_block_num = _memBlocks;
         ESP_ERROR_CHECK(rmt_config(&cfg));
 
         // NOTE: no ESP_INTR_FLAG_IRAM here
         ESP_ERROR_CHECK(rmt_driver_install(
             cfg.channel, 0, ESP_INTR_FLAG_LOWMED|ESP_INTR_FLAG_SHARED));
-        ESP_ERROR_CHECK(rmt_set_tx_loop_mode(_rmtChannel, true));
+        ESP_ERROR_CHECK(rmt_set_tx_loop_mode(_rmtChannel, _refill == Refill::Loop));
 
         _channelObjects[_rmtChannel] = this;
-        rmt_register_tx_end_callback(rmtTxDone_c, nullptr);
-        rmt_set_tx_intr_en(_rmtChannel, true);
-
-        const size_t itemCount = fillRmt(PacketBits::from_packet(idlePacket, PREAMBLE_BITS), rmt_items);
+        _timing.begin(getCpuFrequencyMhz());
+
+        size_t itemCount = 0;
+        if(_refill == Refill::PingPong) {
+            // no loop: RMT wraps around the block (rmt_config enables it), the stream never puts an end marker
+            itemCount = memItems();
+            _stream.begin(DEF_PREAMBLE_LEN, _railcom);
+            _stream.fill(etl::span<rmt_item32_t>{rmt_items.data(), itemCount}, [this]() -> const Packet& {
+                advancePacket();
+                return packet.packet;
+            });
+            _fillOffset = 0;
+            // first threshold event comes when RMT starts the second half
+            if constexpr(WaveformTiming::ENABLED) _playingUs = symbols_duration(rmt_items.data() + itemCount / 2, itemCount / 2);
+            rmt_register_tx_thr_callback(rmtTxThr_c, nullptr);
+            rmt_set_tx_intr_en(_rmtChannel, false);
+            rmt_set_tx_thr_intr_en(_rmtChannel, true, itemCount / 2);
+        } else {
+            rmt_register_tx_end_callback(rmtTxDone_c, nullptr);
+            rmt_set_tx_intr_en(_rmtChannel, true);
+
+            if(_railcom) itemCount += Encoder::fill_cutout(etl::span<rmt_item32_t>{rmt_items});
+            itemCount += Encoder::fill_preamble(
+                _railcom ? PREAMBLE_BITS - RailcomCutout::PREAMBLE_BITS : PREAMBLE_BITS,
+                etl::span<rmt_item32_t>{rmt_items}.subspan(itemCount));
+            _payloadOffset = itemCount;
+            itemCount += fillRmt(idlePacket, {rmt_items.begin() + _payloadOffset, memItems() - _payloadOffset});
+            if constexpr(WaveformTiming::ENABLED) {
+                _preambleUs = symbols_duration(rmt_items.data(), _payloadOffset);
+                _playingUs = symbols_duration(rmt_items.data(), itemCount);
+            }
+        }
 
-        // put whole idle packet, its preamble will be kept forever
+        // loop mode: put whole idle packet, its preamble will be kept forever
         rmt_fill_tx_items(_rmtChannel, rmt_items.data(), itemCount, 0);
 
+        if(_railcom) {
+            beginBrake(itemCount);
+            // back to back, channels start within a few APB cycles of each other
+            rmt_tx_start(_brakeChannel, true);
+        }
         rmt_tx_start(_rmtChannel, true);
 
         // _running = true;
@@ -85,8 +166,15 @@ public:
         // }
 
         _channelObjects[_rmtChannel] = nullptr;
+        if(_refill == Refill::PingPong) rmt_set_tx_thr_intr_en(_rmtChannel, false, 0);
         rmt_tx_stop(_rmtChannel);
         rmt_driver_uninstall(_rmtChannel);
+        if(_railcom) {
+            rmt_tx_stop(_brakeChannel);
+            rmt_driver_uninstall(_brakeChannel);
+            pinMode(_brakePin, OUTPUT);
+            digitalWrite(_brakePin, LOW);
+        }
 
 
         ESP32Channel::end();
@@ -95,21 +183,43 @@ public:
 private:
     static constexpr uint16_t DCC_ONE_HALF_US = 58;
     static constexpr uint16_t DCC_ZERO_HALF_US = 100;
-    static constexpr size_t MEM_BLOCKS = 2;
-    static constexpr size_t MAX_RMT_ITEMS = SOC_RMT_MEM_WORDS_PER_CHANNEL * MEM_BLOCKS; // can't go above this
-    static constexpr size_t PREAMBLE_BITS = DEF_PREAMBLE_LEN - 1; // for some reason, one extra bit it output first
+    static constexpr size_t MAX_MEM_BLOCKS = 2;
+    static constexpr size_t MAX_RMT_ITEMS = SOC_RMT_MEM_WORDS_PER_CHANNEL * MAX_MEM_BLOCKS; // can't go above this
+    static constexpr size_t PREAMBLE_BITS = DEF_PREAMBLE_LEN - 1; // for some reason, one extra bit it output first in loop mode
+
+    using Encoder = SymbolEncoder<DCC_ONE_HALF_US, DCC_ZERO_HALF_US, false>;
+
+    const Refill _refill;
+    const size_t _memBlocks;
+    size_t memItems() const { return SOC_RMT_MEM_WORDS_PER_CHANNEL * _memBlocks; }
 
     etl::array<rmt_item32_t, MAX_RMT_ITEMS> rmt_items;
+    SymbolStream<Encoder> _stream;
+    /** Half of the block the next threshold interrupt refills. */
+    size_t _fillOffset{0};
+
+    WaveformTiming _timing;
+    /** Loop mode: preamble (with cutout) duration, that's how long payload refill may take. */
+    uint32_t _preambleUs{0};
+    /** Duration of what RMT outputs until next refill event: whole block in loop mode, a half in ping-pong mode. */
+    uint32_t _playingUs{0};
+
+    bool _railcom{false};
+    uint8_t _brakePin{0};
+    rmt_channel_t _brakeChannel{};
+    etl::array<rmt_item32_t, MAX_RMT_ITEMS> brake_items;
+    /** Where payload starts in RMT block: after cutout symbol and preamble. */
+    size_t _payloadOffset{PREAMBLE_BITS};
 
     /** Used in ISR that is shared between channels. */
     inline static etl::array<ESP32RMTChannel *, SOC_RMT_CHANNELS_PER_GROUP> _channelObjects{nullptr};
     inline static uint8_t _channelCount{0};
-    static uint8_t incChannel() {
+    static uint8_t incChannel(size_t memBlocks) {
         uint8_t t = _channelCount;
-        _channelCount+=MEM_BLOCKS;
+        _channelCount+=memBlocks;
         return t;
     }
-    rmt_channel_t _rmtChannel{static_cast<rmt_channel_t>(incChannel())}; // auto-increment for now.
+    rmt_channel_t _rmtChannel{static_cast<rmt_channel_t>(incChannel(_memBlocks))}; // auto-increment for now.
 
     // volatile bool _running{false};
     // TaskHandle_t _txTask{nullptr};
@@ -119,29 +229,46 @@ private:
     //     vTaskDelete(nullptr);
     // }
 
+    /** Brake channel gets the same block as data channel, with brake levels. */
+    void beginBrake(size_t itemCount) {
+        rmt_config_t cfg{};
+        cfg.rmt_mode = RMT_MODE_TX;
+        cfg.channel = _brakeChannel;
+        cfg.clk_div = APB_CLK_FREQ  / 1'000'000;
+        cfg.gpio_num = static_cast<gpio_num_t>(_brakePin);
+        cfg.mem_block_num = _memBlocks;
+        ESP_ERROR_CHECK(rmt_config(&cfg));
+        ESP_ERROR_CHECK(rmt_driver_install(cfg.channel, 0, 0));
+        ESP_ERROR_CHECK(rmt_set_tx_loop_mode(_brakeChannel, _refill == Refill::Loop));
+        fillBrake(itemCount, 0);
+    }
+
+    /**
+     * Mirrors first `itemCount` data items into brake block at `offset`.
+     * In ping-pong mode brake channel has no threshold interrupt of its own: it is refilled
+     *   by data channel interrupt, with the same number of symbols, so both stay in sync.
+     */
+    IRAM_ATTR void fillBrake(size_t itemCount, size_t offset) {
+        for(size_t i=0; i<itemCount; i++) {
+            const uint32_t v = rmt_items[i].val;
+            brake_items[i].val = v == 0 ? 0 : Encoder::brake_symbol(v, v == Encoder::CUTOUT);
+        }
+        rmt_fill_tx_items(_brakeChannel, brake_items.data(), itemCount, offset);
+    }
+
+    /** Puts packet payload (without preamble) and stop symbol into items. */
     static size_t fillRmt(
-        const PacketBits &packet,
+        const Packet &packet,
         etl::span<rmt_item32_t> items
     ) {
 
-        if (packet.size_bits == 0 || items.size() == 0) {
+        if (items.size() == 0) {
             return 0;
         }
 
-        size_t maxItems = items.size() - 1; // account for stop symbol in the end
-        size_t itemIdx = 0;
-        for (size_t bit = 0; bit < packet.size_bits; ++bit) {
-            if(itemIdx == maxItems) return 0; // for now, skip packet if it's too big.
-            const bool isOne = packet.bit_at(bit);
-            const uint16_t half = isOne ? DCC_ONE_HALF_US : DCC_ZERO_HALF_US;
-
-            rmt_item32_t item{};
-            item.level0 = 0;
-            item.duration0 = half;
-            item.level1 = 1;
-            item.duration1 = half;
-            items[itemIdx++] = item;
-        }
+        // account for stop symbol in the end
+        size_t itemIdx = Encoder::fill_packet(packet, items.first(items.size() - 1));
+        if(itemIdx == 0) return 0; // for now, skip packet if it's too big.
 
         items[itemIdx++].val = 0; // stop symbol
         return itemIdx;
@@ -189,7 +316,58 @@ private:
         }
     }
 
+    static IRAM_ATTR void rmtTxThr_c(rmt_channel_t channel, void *arg) {
+        if(_channelObjects[channel]) {
+            _channelObjects[channel]->rmtTxThrCallback();
+        }
+    }
+
     uint8_t repeatsLeft{0};
+    PacketWithRepeats packet; ///< kept as member so that ISR does not construct it on stack every time
+
+    /**
+     * Picks what goes on track next: next repeat of current packet,
+     *   or next packet from the list (idle packet if it's empty).
+     * @return true if `packet` has changed.
+     */
+    IRAM_ATTR bool advancePacket() {
+        if (repeatsLeft>0 && !packets.estop_pending()) {
+            repeatsLeft--;
+            DCC_LOGD_ISR("repeat packet = %d", repeatsLeft);
+            countTransmission(packet, false, true);
+            return false;
+        }
+        const bool fetched = packets.fetch_next_packet(packet);
+        if (!fetched) {
+            packet = idle_packet_with_repeats;
+        }
+        countTransmission(packet, !fetched, false);
+        repeatsLeft = packet.nRepeats > 0 ? packet.nRepeats - 1 : 0;
+        DCC_LOGD_ISR("next packet: [%d]=[%02X %02X...]*%d",
+            packet.packet.size(),
+            packet.packet[0], packet.packet[1],
+            packet.nRepeats);
+        return true;
+    }
+
+    /** Ping-pong mode: refills the half of the block that has just been sent. */
+    IRAM_ATTR void rmtTxThrCallback() {
+        _timing.refill_begin(esp_cpu_get_cycle_count());
+        const size_t half = memItems() / 2;
+        _stream.fill(etl::span<rmt_item32_t>{rmt_items.data(), half}, [this]() -> const Packet& {
+            advancePacket();
+            return packet.packet;
+        });
+        rmt_fill_tx_items(_rmtChannel, rmt_items.data(), half, _fillOffset);
+        if(_railcom) fillBrake(half, _fillOffset);
+        _fillOffset = _fillOffset == 0 ? half : 0;
+        if constexpr(WaveformTiming::ENABLED) {
+            // the other half must be out before this one was refilled
+            const uint32_t us = symbols_duration(rmt_items.data(), half);
+            _timing.refill_end(esp_cpu_get_cycle_count(), _playingUs, _playingUs);
+            _playingUs = us;
+        }
+    }
 
     IRAM_ATTR void rmtTxDoneCallback() {
         // ets_printf("RMT channel %d, len %d\n", _rmtChannel, rmt_items.size());
@@ -198,30 +376,23 @@ private:
         //     vTaskNotifyGiveFromISR(_txTask, &xHigherPriorityTaskWoken);
         //     portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
         // }
-        if (repeatsLeft>0) {
-            repeatsLeft--;
-            DCC_LOGD_ISR("repeat packet = %d", repeatsLeft);
-            // don't do anything, RMT will repeat on its own
-        } else {
-            PacketWithRepeats packet;
-            if (!packets.fetch_next_packet(packet)) {
-                packet = {idlePacket, 1};
-            }
-
+        _timing.refill_begin(esp_cpu_get_cycle_count());
+        // on repeat, don't do anything, RMT will repeat on its own
+        if (advancePacket()) {
             // note 0 preamble bits here!
             // also limit number of bits that can be written
             const size_t itemCount = fillRmt(
-                PacketBits::from_packet(packet.packet, 0),
-                {rmt_items.begin(), rmt_items.size() - PREAMBLE_BITS});
+                packet.packet,
+                {rmt_items.begin(), memItems() - _payloadOffset});
             assert(itemCount!=0);
 
-            DCC_LOGD_ISR("next packet: [%d]=[%02X %02X...]*%d",
-                packet.packet.size_bits,
-                packet.packet.buf[0], packet.packet.buf[1],
-                packet.nRepeats);
             // this is data without preamble, put with offset.
-            rmt_fill_tx_items(_rmtChannel, rmt_items.data(), itemCount, PREAMBLE_BITS);
+            rmt_fill_tx_items(_rmtChannel, rmt_items.data(), itemCount, _payloadOffset);
+            // stop symbol is 0 and stays 0
+            if(_railcom) fillBrake(itemCount, _payloadOffset);
+            if constexpr(WaveformTiming::ENABLED) _playingUs = _preambleUs + symbols_duration(rmt_items.data(), itemCount);
         }
+        if constexpr(WaveformTiming::ENABLED) _timing.refill_end(esp_cpu_get_cycle_count(), _playingUs, _preambleUs);
 
     }
 };
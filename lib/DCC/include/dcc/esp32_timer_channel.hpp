@@ -41,8 +41,9 @@ public:
 
 private:
 
-    PacketBitsWithRepeats currentPacket{};
-    size_t current_bit{0};
+    PacketWithRepeats currentPacket{};
+    uint8_t currentChecksum{0};  ///< of currentPacket, the only thing computed per packet, its bits are read from bytes
+    size_t current_bit{0};  ///< counts preamble bits first, then payload bits of currentPacket
 
     /* how many 58us periods needed for half-cycle (1 for "1", 2 for "0") */
     volatile uint8_t timerPeriodsHalf = 1; // some sane nonzero value
@@ -52,21 +53,23 @@ private:
     void IRAM_ATTR nextBit() {
         //DCC_DEBUGF_ISR("nextBit: currentPacket=%d, activePacket=%d, cbit=%d, bits=%d", R.currentIdx(),  R.currentPacket->activeIdx(), R.currentBit, p->nBits );
         // end of packet, either repeat this or get next one
-        if (current_bit == currentPacket.packet.size_bits) {
+        if (current_bit == DEF_PREAMBLE_LEN + currentPacket.payload_bits()) {
             current_bit = 0;
-            if (currentPacket.nRepeats>0) {
+            if (currentPacket.nRepeats>1 && !packets.estop_pending()) {
                 currentPacket.nRepeats--;
                 DCC_LOGD_ISR("repeat packet = %d", currentPacket.nRepeats);
+                countTransmission(currentPacket, false, true);
             } else {
-                PacketWithRepeats bytes;
-                if(packets.fetch_next_packet(bytes)) {
-                    currentPacket = PacketBitsWithRepeats::from_packet(bytes, DEF_PREAMBLE_LEN);
-                } else {
-                    currentPacket = {idle_packet_bits, 1};
+                const bool fetched = packets.fetch_next_packet(currentPacket);
+                if(!fetched) {
+                    currentPacket = idle_packet_with_repeats;
                 }
+                // once per packet, repeats reuse it
+                currentChecksum = packet_checksum(currentPacket.packet);
+                countTransmission(currentPacket, !fetched, false);
                 DCC_LOGD_ISR("next packet: [%d]=[%02X %02X...]*%d",
-                    currentPacket.packet.size_bits,
-                    currentPacket.packet.buf[0], currentPacket.packet.buf[1],
+                    currentPacket.packet.size(),
+                    currentPacket.packet[0], currentPacket.packet[1],
                     currentPacket.nRepeats);
             }
         }
@@ -75,15 +78,20 @@ private:
         current_bit++;
     }
 
+    uint8_t current_bit_value() const {
+        if(current_bit < DEF_PREAMBLE_LEN) return 1;
+        return currentPacket.payload_bit_at(current_bit - DEF_PREAMBLE_LEN, currentChecksum);
+    }
+
     inline void set_bit_timings() {
-        if ( currentPacket.packet.bit_at(current_bit) != 0 ) {
+        if ( current_bit_value() != 0 ) {
             /* For "1" bit, we need 1 58us timer tick for each signal level */
-            DCC_LOGD_ISR("bit %d (0x%02x) = 1", current_bit, currentPacket.packet.buf[current_bit/8] );
+            DCC_LOGD_ISR("bit %d = 1", current_bit );
             timerPeriodsHalf = 1;
             timerPeriodsLeft = 2;
         } else {  /* ELSE it is a ZERO bit */
             /* For "0" bit, we need 2 58us timer ticks for each signal level */
-            DCC_LOGD_ISR("bit %d (0x%02x) = 0", current_bit, currentPacket.packet.buf[current_bit/8] );
+            DCC_LOGD_ISR("bit %d = 0", current_bit );
             timerPeriodsHalf = 2;
             timerPeriodsLeft = 4;
         }
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "base_channel.hpp"
+#include "symbol_encoder.hpp"
+#include "waveform_validator.hpp"
+
+#include <etl/array.h>
+#include <etl/span.h>
+
+#include <vector>
+
+namespace dcc {
+
+/**
+ * A "virtual track" DCC channel for host builds: records the waveform instead of outputting it.
+ *
+ * Pulls packets from the packet list the same way ESP32RMTChannel does in its TX DONE interrupt:
+ *   one fetch per packet transmission, repeat it nRepeats times, send idle packet if list is empty.
+ * Packets are converted with the same SymbolEncoder and appended to a timeline of half-bits
+ *   (preamble, payload with end bit, optional gap before next preamble).
+ *
+ * There is no real time here: the simulated clock only advances in step()/run_*(),
+ *   so tests are deterministic. Timeline can be checked with WaveformValidator.
+ *
+ * With RailCom cutout on, the cutout follows end bit of every packet and takes place of
+ *   first preamble bits of the next one, the same way ESP32RMTChannel lays out its RMT block.
+ */
+class HostChannel: public BaseChannel {
+public:
+    static constexpr uint16_t DCC_ONE_HALF_US = 58;
+    static constexpr uint16_t DCC_ZERO_HALF_US = 100;
+    using Encoder = SymbolEncoder<DCC_ONE_HALF_US, DCC_ZERO_HALF_US, true>;
+
+    /** A packet transmission, as it was put on track. */
+    struct Emitted {
+        uint64_t start_us;  ///< start of preamble
+        uint64_t end_us;    ///< end of packet end bit
+        Packet packet;
+        bool idle;          ///< packet list had nothing, idle packet was sent
+    };
+
+    explicit HostChannel(BasePacketList &packets): BaseChannel{packets} {}
+
+    void begin() override {
+        now = 0;
+        repeatsLeft = 0;
+        clearRecording();
+        power = true;
+    }
+
+    void end() override { power = false; }
+
+    void setPower(bool v, PowerEvent::Reason reason = PowerEvent::Reason::Normal) override {
+        BaseChannel::setPower(v, reason);
+        power = v;
+    }
+
+    bool getPower() const override { return power; }
+
+    /** Current that "track" draws, for tests of current sensing code. */
+    void setCurrent(uint16_t mA) { simCurrent = mA; }
+
+    void updateCurrent() override {
+        current = simCurrent;
+        if(simCurrent > maxCurrent) maxCurrent = simCurrent;
+    }
+
+    /**
+     * Time the line is held at its last level after packet end bit, before next preamble.
+     * Models late refill of waveform generator; anything above 0 stretches the end bit
+     *   and should be reported by validator.
+     */
+    void setGapUs(uint32_t us) { gapUs = us; }
+
+    /** Cutout after every packet, see RailcomCutout. */
+    void setRailcomCutout(bool v) { railcom = v; }
+
+    /** Whether to keep half-bits (a lot of memory for long runs) or only emitted packets. */
+    void setRecordHalfBits(bool v) { recordHalfBits = v; }
+
+    /** Transmits one packet (or next repeat of current one). @return packet duration in us. */
+    uint32_t step() {
+        if (repeatsLeft>0 && !packets.estop_pending()) {
+            repeatsLeft--;
+            countTransmission(packet, false, true);
+        } else {
+            fetched = packets.fetch_next_packet(packet);
+            if (!fetched) {
+                packet = idle_packet_with_repeats;
+            }
+            repeatsLeft = packet.nRepeats > 0 ? packet.nRepeats - 1 : 0;
+            countTransmission(packet, !fetched, false);
+        }
+
+        const uint64_t start = now;
+        size_t n = Encoder::fill_preamble(railcom ? DEF_PREAMBLE_LEN - RailcomCutout::PREAMBLE_BITS : DEF_PREAMBLE_LEN,
+            etl::span<SymbolWord>{symbols});
+        n += Encoder::fill_packet(packet.packet, etl::span<SymbolWord>{symbols}.subspan(n));
+        for(size_t i=0; i<n; i++) put_symbol(symbols[i].val, i == n-1 ? gapUs : 0);
+
+        emitted.push_back(Emitted{start, now - gapUs, packet.packet, !fetched});
+        if(railcom) {
+            Encoder::fill_cutout(etl::span<SymbolWord>{symbols});
+            put_symbol(symbols[0].val, 0, true);
+        }
+        return now - start;
+    }
+
+    void runPackets(size_t n) {
+        for(size_t i=0; i<n; i++) step();
+    }
+
+    /** Transmits packets until simulated clock reaches `t_us` (last packet is completed). */
+    void runUntil(uint64_t t_us) {
+        while(now < t_us) step();
+    }
+
+    uint64_t nowUs() const { return now; }
+
+    const std::vector<HalfBit>& halfBits() const { return timeline; }
+    const std::vector<Emitted>& emittedPackets() const { return emitted; }
+
+    void clearRecording() {
+        timeline.clear();
+        emitted.clear();
+    }
+
+    /** Decodes and validates recorded half-bits. */
+    WaveformValidator validate() const {
+        WaveformValidator v;
+        v.feed(timeline.begin(), timeline.end());
+        return v;
+    }
+
+private:
+    bool power{false};
+    uint16_t simCurrent{0};
+    uint32_t gapUs{0};
+    bool recordHalfBits{true};
+    bool railcom{false};
+
+    uint64_t now{0};
+    uint8_t repeatsLeft{0};
+    bool fetched{false};
+    PacketWithRepeats packet;
+    etl::array<SymbolWord, DEF_PREAMBLE_LEN + Encoder::packet_symbols(MAX_PACKET_LEN)> symbols;
+
+    std::vector<HalfBit> timeline;
+    std::vector<Emitted> emitted;
+
+    /** @param cutout second half of symbol is RailCom cutout */
+    void put_symbol(uint32_t val, uint32_t extraUs, bool cutout = false) {
+        const uint32_t d0 = val & 0x7FFF, d1 = (val >> 16 & 0x7FFF) + extraUs;
+        const bool l0 = val & 0x8000, l1 = val & 0x80000000u;
+        if(recordHalfBits) {
+            timeline.push_back(HalfBit{now, d0, l0});
+            timeline.push_back(HalfBit{now + d0, d1, l1, cutout});
+        }
+        now += d0 + d1;
+    }
+};
+
+}
@@ -1,9 +1,33 @@
 #pragma once
 
+#ifdef ARDUINO
+
 #include <esp32-hal-log.h>
+#include  "rom/ets_sys.h"  // for ets_printf
+
+#ifndef DCC_LOG_LVL
 #define DCC_LOG_LVL  ARDUHAL_LOG_LEVEL_INFO
+#endif
 
-#include  "rom/ets_sys.h"  // for ets_printf
+#else
+
+// Host build (native tests and benchmarks): minimal stand-ins for ESP32 Arduino logging.
+#include <cstdio>
+
+#define ARDUHAL_LOG_LEVEL_NONE       (0)
+#define ARDUHAL_LOG_LEVEL_ERROR      (1)
+#define ARDUHAL_LOG_LEVEL_WARN       (2)
+#define ARDUHAL_LOG_LEVEL_INFO       (3)
+#define ARDUHAL_LOG_LEVEL_DEBUG      (4)
+#define ARDUHAL_LOG_FORMAT(letter, format)  "[" #letter "][%s:%d] %s(): " format "\n", __FILE__, __LINE__, __func__
+#define log_printf  printf
+#define ets_printf  printf
+
+#ifndef DCC_LOG_LVL
+#define DCC_LOG_LVL  ARDUHAL_LOG_LEVEL_WARN  // keep test and benchmark output clean
+#endif
+
+#endif
 
 #if DCC_LOG_LVL >= ARDUHAL_LOG_LEVEL_WARN
     #define DCC_LOGW(format, ...) log_printf(ARDUHAL_LOG_FORMAT(W, format), ##__VA_ARGS__)
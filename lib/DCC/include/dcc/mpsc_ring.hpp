@@ -0,0 +1,96 @@
+#pragma once
+
+#include <etl/array.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace dcc {
+
+    /**
+     * Bounded lock-free multi-producer single-consumer FIFO.
+     *
+     * Based on Dmitry Vyukov's bounded MPMC queue: every cell has a sequence number
+     *   that tells whether the cell is free for producer at position `pos` (seq == pos)
+     *   or holds data published for consumer (seq == pos+1).
+     * Producers claim a position with CAS and never wait for each other or the consumer.
+     * Consumer never waits either: if a claimed cell is not published yet
+     *   (e.g. producer was preempted by consumer's interrupt), queue looks empty for now.
+     *
+     * Consumer side (front(), pop()) must be called from one context only.
+     *
+     * @tparam N capacity, must be a power of 2.
+     */
+    template<typename T, size_t N>
+    class MpscRing {
+        static_assert(N >= 2 && (N & (N - 1)) == 0, "MpscRing size must be a power of 2");
+    public:
+        MpscRing() {
+            for(size_t i=0; i<N; i++) {
+                cells[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        /** Producer side. @return false if ring is full. */
+        bool push(const T& value) {
+            size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+            Cell *cell;
+            for(;;) {
+                cell = &cells[pos & MASK];
+                const size_t seq = cell->seq.load(std::memory_order_acquire);
+                const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                if(dif == 0) {
+                    if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                    // pos was reloaded by failed CAS, retry
+                } else if(dif < 0) {
+                    return false; // cell still holds data from previous lap
+                } else {
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->data = value;
+            cell->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Consumer side. Peeks at oldest published element without removing it.
+         * @return nullptr if there is nothing to consume.
+         */
+        const T* front() const {
+            const size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            const Cell &cell = cells[pos & MASK];
+            const size_t seq = cell.seq.load(std::memory_order_acquire);
+            if(seq != pos + 1) return nullptr;
+            return &cell.data;
+        }
+
+        /** Consumer side. Removes element returned by front(). */
+        void pop() {
+            const size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            cells[pos & MASK].seq.store(pos + N, std::memory_order_release);
+            dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+        }
+
+        /** Approximate number of elements, for statistics only. */
+        size_t size_approx() const {
+            return enqueue_pos.load(std::memory_order_relaxed) - dequeue_pos.load(std::memory_order_relaxed);
+        }
+
+        static constexpr size_t capacity() { return N; }
+
+    private:
+        static constexpr size_t MASK = N - 1;
+
+        struct Cell {
+            std::atomic<size_t> seq;
+            T data;
+        };
+
+        etl::array<Cell, N> cells;
+        std::atomic<size_t> enqueue_pos{0};
+        std::atomic<size_t> dequeue_pos{0}; ///< written by consumer only
+    };
+
+}
@@ -12,41 +12,95 @@
 
 namespace dcc {
 
+    /** Function groups, as they are sent to decoders. F0-F12 are refreshed, higher ones are sent once. */
     enum class fn_group {
-        F0_4, F5_8, F9_12, F13_20, F21_28, F29_36
+        F0_4, F5_8, F9_12, F13_20, F21_28, F29_36, F37_44, F45_52, F53_60, F61_68
     };
 
-    constexpr size_t FN_NUMBER = 6;
+    constexpr size_t FN_NUMBER = 10; ///< number of function groups
 
     constexpr size_t fn_group_index(const fn_group fg) {
         return etl::to_underlying(fg);
     }
 
-    constexpr uint32_t fn_group_mask(const fn_group fg) {
+    /** @return number of the first function in group. */
+    constexpr uint8_t fn_group_first(const fn_group fg) {
         switch(fg) {
-            case fn_group::F0_4:   return                                  0b1'1111;
-            case fn_group::F5_8:   return                             0b1'1110'0000;
-            case fn_group::F9_12:  return                        0b1'1110'0000'0000;
-            case fn_group::F13_20: return              0b1'1111'1110'0000'0000'0000;
-            case fn_group::F21_28: return    0b1'1111'1110'0000'0000'0000'0000'0000;
-            case fn_group::F29_36: return 0b1110'0000'0000'0000'0000'0000'0000'0000;
+            case fn_group::F0_4:  return 0;
+            case fn_group::F5_8:  return 5;
+            case fn_group::F9_12: return 9;
+            default: return 13 + (fn_group_index(fg) - fn_group_index(fn_group::F13_20)) * 8;
+        }
+    }
+
+    constexpr uint8_t fn_group_size(const fn_group fg) {
+        switch(fg) {
+            case fn_group::F0_4:  return 5;
+            case fn_group::F5_8:
+            case fn_group::F9_12: return 4;
+            default: return 8;
         }
-        return 0; // should never reach
     }
 
     constexpr fn_group fn_to_group(const size_t fn) {
         if(fn < 5) return fn_group::F0_4;
         else if(fn < 9) return fn_group::F5_8;
         else if(fn < 13) return fn_group::F9_12;
-        else if(fn < 21) return fn_group::F13_20;
-        else if(fn < 29) return fn_group::F21_28;
-        else return fn_group::F29_36;
+        else if(fn < 69) return static_cast<fn_group>(fn_group_index(fn_group::F13_20) + (fn - 13) / 8);
+        else return fn_group::F61_68;
     }
 
+    /**
+     * States of functions F0-F68, bit N is FN.
+     * Can be made from uint32_t (F0-F31), so code that only deals with lower functions can keep using integers.
+     */
+    class FnState {
+    public:
+        static constexpr size_t N_FUNCTIONS = 69;
+
+        constexpr FnState() = default;
+        constexpr FnState(uint32_t f0_f31): words{f0_f31, 0, 0} {}
+
+        bool get(size_t fn) const {
+            return fn < N_FUNCTIONS && (words[fn / 32] >> (fn % 32) & 1) != 0;
+        }
+
+        void set(size_t fn, bool v) {
+            if(fn >= N_FUNCTIONS) return;
+            if(v) words[fn / 32] |= 1u << (fn % 32);
+            else words[fn / 32] &= ~(1u << (fn % 32));
+        }
+
+        /** @return states of `count` (up to 32) functions starting with `first`, first one in bit 0. */
+        uint32_t bits(size_t first, size_t count) const {
+            const size_t w = first / 32, b = first % 32;
+            uint64_t v = words[w];
+            if(w + 1 < N_WORDS) v |= (uint64_t)words[w + 1] << 32;
+            v >>= b;
+            return count >= 32 ? (uint32_t)v : (uint32_t)v & ((1u << count) - 1);
+        }
+
+        void set_bits(size_t first, size_t count, uint32_t v) {
+            for(size_t i=0; i<count; i++) set(first + i, (v >> i & 1) != 0);
+        }
+
+        uint32_t group(fn_group fg) const { return bits(fn_group_first(fg), fn_group_size(fg)); }
+        void set_group(fn_group fg, uint32_t v) { set_bits(fn_group_first(fg), fn_group_size(fg), v); }
+
+        bool operator==(const FnState &o) const { return words == o.words; }
+        bool operator!=(const FnState &o) const { return !(*this == o); }
+
+    private:
+        static constexpr size_t N_WORDS = (N_FUNCTIONS + 31) / 32;
+        etl::array<uint32_t, N_WORDS> words{};
+    };
+
     constexpr size_t MAX_PACKET_LEN = 6;
 
     constexpr size_t ACCESSORY_PACKET_REPEATS = 4; // repeat accessory packets this number of times
 
+    constexpr size_t ESTOP_PACKET_REPEATS = 5; // broadcast stop is not refreshed, so make sure every decoder gets it
+
     // NMRA DCC norm asks for >1 packets if not refreshed (for F13-...):
     // "Command Stations that generate these packets, and which are not periodically refreshing these functions,
     // must send at least two repetitions of these commands when any function state is changed."
@@ -54,16 +108,24 @@ namespace dcc {
     // DCC++ uses 4.
     constexpr size_t FN_PACKET_REPEATS = 4;
 
+    // S-9.2.1: decoder acts on a CV access instruction after two identical packets in a row.
+    constexpr size_t POM_PACKET_REPEATS = 4;
+
     constexpr size_t DEF_PREAMBLE_LEN = 22;
 
+    /** Error detection byte: XOR of all packet bytes. */
+    inline uint8_t packet_checksum(const etl::span<const uint8_t> src) {
+        uint8_t crc = 0;
+        for(const uint8_t b: src) crc ^= b;
+        return crc;
+    }
+
     /**
      * Takes DCC packet bytes and adds preamble, spacer bits etc.
      **/
     inline size_t encode_dcc(const etl::span<const uint8_t> src, etl::span<uint8_t> dst, size_t preamble_bits) {
-        uint8_t crc = src[0];
+        const uint8_t crc = packet_checksum(src);
         size_t len = src.size();
-        for(int i=1; i<len; i++)
-            crc ^= src[i];
 
         // don't care about endianness, we don't write multi-bytes
         etl::bit_stream_writer s(dst.data(), dst.size(), etl::endian::big);
@@ -113,22 +175,46 @@ namespace dcc {
         void append_bit(uint8_t v) {
             size_t nbyte = size_bits / 8, nbit = size_bits % 8;
             if(nbit == 0) buf.push_back(0); // doesn't check for size
-            bitWrite(buf.data()[nbyte], 7-nbit, v);
+            const uint8_t mask = 1u << (7-nbit);
+            buf.data()[nbyte] = v ? (buf.data()[nbyte] | mask) : (buf.data()[nbyte] & ~mask);
             size_bits++;
         }
     };
 
+    /**
+     * A DCC packet and how many times to send it.
+     *
+     * Waveform generators turn packet bytes into symbols with a lookup table (see SymbolEncoder::fill_packet()),
+     *   which is as fast as copying pre-encoded bits, or read bits from bytes (see payload_bit_at()),
+     *   so packets are kept as bytes only and nothing is encoded in an interrupt.
+     **/
     struct PacketWithRepeats {
         Packet packet;
         uint8_t nRepeats;
-    };
 
-    struct PacketBitsWithRepeats {
-        PacketBits packet;
-        uint8_t nRepeats;
+        static PacketWithRepeats from_bytes(const etl::span<const uint8_t> bytes, uint8_t nRepeats) {
+            return {packet_from_bytes(bytes), nRepeats};
+        }
+
+        static PacketWithRepeats from_packet(const Packet &src, uint8_t nRepeats) {
+            return from_bytes(src, nRepeats);
+        }
+
+        /** Start bits, data bytes, checksum and end bit, without preamble. */
+        size_t payload_bits() const {
+            return packet.empty() ? 0 : (packet.size() + 1) * 9 + 1;
+        }
 
-        static PacketBitsWithRepeats from_packet(const PacketWithRepeats &src, size_t preamble_len) {
-            return {PacketBits::from_packet(src.packet, preamble_len), src.nRepeats};
+        /**
+         * Bit `idx` of payload (see payload_bits()), read straight from packet bytes, so that a generator
+         *   that outputs bit by bit needs no encoded copy. `checksum` is packet_checksum() of the packet.
+         */
+        uint8_t payload_bit_at(size_t idx, uint8_t checksum) const {
+            const size_t byte = idx / 9, bit = idx % 9;
+            if(byte > packet.size()) return 1; // end bit
+            if(bit == 0) return 0; // start bit
+            const uint8_t b = byte < packet.size() ? packet[byte] : checksum;
+            return (b >> (8 - bit)) & 0x1;
         }
     };
 
@@ -138,10 +224,10 @@ namespace dcc {
     constexpr inline It encode_address(const LocoAddress addr, It out) {
         uint16_t iAddr = addr.addr();
         if ( addr.isLong() ) {
-            *out++ = highByte(iAddr) | 0xC0;  // convert train number into a two-byte address
+            *out++ = static_cast<uint8_t>(iAddr >> 8) | 0xC0;  // convert train number into a two-byte address
         }
 
-        *out++ = lowByte(iAddr);
+        *out++ = static_cast<uint8_t>(iAddr & 0xFF);
         return out;
     }
 
@@ -169,6 +255,62 @@ namespace dcc {
         return make_speed_dir_packet(addr, speed.getDCCByte(mode), mode, fwd ? 1 : 0);
     }
 
+    /** Speed byte of 128 speed step packets: DSSSSSSS. */
+    inline uint8_t speed_dir_byte(LocoSpeed speed, bool fwd) {
+        return (fwd ? 0x80 : 0) | (speed.get128() & 0x7F);
+    }
+
+    /**
+     * Speed, Direction and Functions instruction (S-9.2.1 2021, 001-11100):
+     *   128-step speed, direction and F0-F15 in one packet, so a loco needs one refresh packet instead of four.
+     * Only for decoders that support it, see BasePacketList::set_loco_combined().
+     * @param speed_dir DSSSSSSS, see speed_dir_byte().
+     * @param fns function states, bit N is FN.
+     */
+    inline etl::vector<uint8_t, MAX_PACKET_LEN> make_combined_packet(LocoAddress addr, uint8_t speed_dir, uint32_t fns) {
+        etl::vector<uint8_t, MAX_PACKET_LEN> data;
+        auto it = encode_address(addr, data.begin());
+        *it++ = 0b0011'1100;
+        *it++ = speed_dir;
+        *it++ = fns & 0xFF;         // F7..F0
+        *it++ = (fns >> 8) & 0xFF;  // F15..F8
+        data.uninitialized_resize(std::distance(data.begin(), it));
+        return data;
+    }
+
+    /**
+     * Broadcast stop: basic speed packet to address 0, understood by all mobile decoders regardless of their speed mode.
+     * @param emergency if true, decoders cut power to motor immediately, otherwise they decelerate.
+     */
+    inline etl::vector<uint8_t, 4> make_broadcast_stop_packet(bool emergency) {
+        etl::vector<uint8_t, 4> data;
+        data.push_back(0x00);
+        data.push_back(emergency ? 0b0100'0001 : 0b0100'0000);
+        return data;
+    }
+
+    /**
+     * Changes speed of a packet made by make_speed_dir_packet() or make_combined_packet() to emergency stop,
+     *   keeping address, speed mode and direction.
+     * @return false if packet is not a speed-dir packet, it is not changed then.
+     */
+    inline bool set_speed_packet_emgr(Packet &p) {
+        if(p.empty()) return false;
+        const size_t i = (p[0] & 0b1100'0000) == 0b1100'0000 ? 2 : 1; // long address takes 2 bytes
+        if(p.size() <= i) return false;
+        if(p[i] == 0b0011'1111 || p[i] == 0b0011'1100) { // 128 steps or combined instruction
+            if(p.size() <= i+1) return false;
+            p[i+1] = (p[i+1] & 0x80) | DCC_SPEED_EMGR;
+            return true;
+        }
+        if((p[i] & 0b1100'0000) == 0b0100'0000) {
+            // 01DCSSSS, C=0 SSSS=0001 is e-stop
+            p[i] = (p[i] & 0b1110'0000) | 0b0001;
+            return true;
+        }
+        return false;
+    }
+
     [[deprecated("use make_fn_packet(fn_group) instead")]]
     inline auto make_fn_packet(LocoAddress addr, uint8_t fByte, uint8_t eByte) {
         etl::vector<uint8_t, 4> data;
@@ -187,74 +329,95 @@ namespace dcc {
 
     }
 
-    inline auto make_f0_f4_packet(LocoAddress addr, uint32_t fns) {
+    inline auto make_f0_f4_packet(LocoAddress addr, const FnState &fns) {
         etl::vector<uint8_t, 4> data;
         auto it = encode_address(addr, data.begin());
-        *it++ = 0b1000'0000u | (fns & 0b1u) << 4u | (fns & 0x1Fu) >> 1u;
+        const uint32_t f = fns.group(fn_group::F0_4);
+        *it++ = 0b1000'0000u | (f & 0b1u) << 4u | f >> 1u;
         data.uninitialized_resize(std::distance(data.begin(), it));
         return data;
     }
 
-    inline auto make_f5_f8_packet(LocoAddress addr, uint32_t state) {
+    inline auto make_f5_f8_packet(LocoAddress addr, const FnState &fns) {
         etl::vector<uint8_t, 4> data;
         auto it = encode_address(addr, data.begin());
-        state >>= 5;
-        *it++ = 0b1011'0000u | (state & 0b1111);
+        *it++ = 0b1011'0000u | fns.group(fn_group::F5_8);
         data.uninitialized_resize(std::distance(data.begin(), it));
         return data;
     }
 
-    inline auto make_f9_f12_packet(LocoAddress addr, uint32_t fns) {
+    inline auto make_f9_f12_packet(LocoAddress addr, const FnState &fns) {
         etl::vector<uint8_t, 4> data;
         auto it = encode_address(addr, data.begin());
-        fns >>= 9;
-        *it++ = 0b1010'0000u | (fns & 0b1111);
+        *it++ = 0b1010'0000u | fns.group(fn_group::F9_12);
         data.uninitialized_resize(std::distance(data.begin(), it));
         return data;
     }
 
-    inline auto make_f13_f20_packet(LocoAddress addr, uint32_t fns) {
+    /**
+     * Feature expansion instruction with 8 functions (F13 and above), 110-CCCCC followed by function byte.
+     * @see https://www.nmra.org/sites/default/files/standards/sandrp/pdf/s-9.2.1_dcc_extended_packet_formats.pdf
+     */
+    inline auto make_fn_byte_packet(LocoAddress addr, fn_group fg, const FnState &fns) {
+        static constexpr uint8_t INSTRUCTIONS[] = {
+            0b1101'1110, // F13-F20
+            0b1101'1111, // F21-F28
+            0b1101'1000, // F29-F36
+            0b1101'1001, // F37-F44
+            0b1101'1010, // F45-F52
+            0b1101'1011, // F53-F60
+            0b1101'1100, // F61-F68
+        };
         etl::vector<uint8_t, 4> data;
         auto it = encode_address(addr, data.begin());
-        fns >>= 13;
-        *it++ = 0b1101'1110u;
-        *it++ = fns & 0xFF;
+        *it++ = INSTRUCTIONS[fn_group_index(fg) - fn_group_index(fn_group::F13_20)];
+        *it++ = fns.group(fg);
         data.uninitialized_resize(std::distance(data.begin(), it));
         return data;
     }
 
-    inline auto make_f21_f28_packet(LocoAddress addr, uint32_t fns) {
-        etl::vector<uint8_t, 4> data;
-        auto it = encode_address(addr, data.begin());
-        fns >>= 21;
-        *it++ = 0b1101'1111u;
-        *it++ = fns & 0xFF;
-        data.uninitialized_resize(std::distance(data.begin(), it));
-        return data;
+    inline auto make_f13_f20_packet(LocoAddress addr, const FnState &fns) {
+        return make_fn_byte_packet(addr, fn_group::F13_20, fns);
     }
 
-    inline auto make_f29_f36_packet(LocoAddress addr, uint32_t fns) {
-        etl::vector<uint8_t, 4> data;
-        auto it = encode_address(addr, data.begin());
-        fns >>= 29;
-        *it++ = 0b1101'1000u;
-        *it++ = fns & 0b1111;  //!!! we have only 4 bits left in uint32_t fns, so we can only set F29-F32, F33-F36 are not supported
-        data.uninitialized_resize(std::distance(data.begin(), it));
-        return data;
+    inline auto make_f21_f28_packet(LocoAddress addr, const FnState &fns) {
+        return make_fn_byte_packet(addr, fn_group::F21_28, fns);
+    }
+
+    inline auto make_f29_f36_packet(LocoAddress addr, const FnState &fns) {
+        return make_fn_byte_packet(addr, fn_group::F29_36, fns);
     }
 
-    inline auto make_fn_packet(LocoAddress addr, fn_group fg, uint32_t fns) {
+    inline auto make_fn_packet(LocoAddress addr, fn_group fg, const FnState &fns) {
         switch(fg) {
             case fn_group::F0_4:   return make_f0_f4_packet(addr, fns);
             case fn_group::F5_8:   return make_f5_f8_packet(addr, fns);
             case fn_group::F9_12:  return make_f9_f12_packet(addr, fns);
-            case fn_group::F13_20: return make_f13_f20_packet(addr, fns);
-            case fn_group::F21_28: return make_f21_f28_packet(addr, fns);
-            case fn_group::F29_36: return make_f29_f36_packet(addr, fns);
-            default:                return make_f0_f4_packet(addr, 0); // should not happen, return something valid
+            default:               return make_fn_byte_packet(addr, fg, fns);
         }
     }
 
+    /**
+     * Binary state control instruction, for decoder states beyond function groups (up to 32767).
+     * Uses short form (110-11101) for states 1-127 and long form (110-00000) otherwise.
+     * State 0 is a broadcast: sets all binary states of the decoder.
+     */
+    inline auto make_binary_state_packet(LocoAddress addr, uint16_t state, bool on) {
+        etl::vector<uint8_t, MAX_PACKET_LEN> data;
+        auto it = encode_address(addr, data.begin());
+        const uint8_t lo = (on ? 0x80 : 0) | (state & 0x7F);
+        if(state < 128) {
+            *it++ = 0b1101'1101;
+            *it++ = lo;
+        } else {
+            *it++ = 0b1100'0000;
+            *it++ = lo;
+            *it++ = (state >> 7) & 0xFF;
+        }
+        data.uninitialized_resize(std::distance(data.begin(), it));
+        return data;
+    }
+
     inline auto make_accessory_packet(uint16_t addr9, uint8_t ch, bool thrown) {
         // DCC_LOGI("addr9=%d, ch=%d, %c", addr9, ch, thrown?'T':'C');
 
@@ -280,4 +443,89 @@ namespace dcc {
         return make_accessory_packet((addr11>>2) + 1U, addr11 & 0x3, thrown);
     }
 
+    /**
+     * Extended accessory decoder control packet (signal aspect), S-9.2.1 section 2.3.6:
+     *   10AAAAAA 0AAA0AA1 XXXXXXXX, address bits are laid out the same way as in basic accessory packet.
+     * @param aspect 0 is "absolute stop", meaning of others is decoder-specific.
+     */
+    inline auto make_ext_accessory_packet(uint16_t addr11, uint8_t aspect) {
+        const uint16_t addr9 = (addr11>>2) + 1U;
+        etl::array<uint8_t, 3> data;
+        data[0] = (addr9 & 0x3F) | 0x80;
+        data[1] = ( ((addr9>>6 & 0x7) << 4) ^ 0b0111'0000 )
+            | (addr11 & 0x3) << 1
+            | 0b0000'0001;
+        data[2] = aspect;
+        return data;
+    }
+
+    /**
+     * Service mode direct CV byte instruction, S-9.2.3 section 2.3.7.3: 0111CCAA AAAAAAAA DDDDDDDD,
+     *   where CC is 01 to verify byte and 11 to write it.
+     * @param cv is 1-based (1-1024).
+     */
+    inline auto make_service_byte_packet(uint16_t cv, uint8_t value, bool write) {
+        const uint16_t a = cv - 1;
+        etl::array<uint8_t, 3> data;
+        data[0] = (write ? 0b0111'1100 : 0b0111'0100) | (a >> 8 & 0x03);
+        data[1] = a & 0xFF;
+        data[2] = value;
+        return data;
+    }
+
+    /**
+     * Service mode direct CV bit manipulation: 011110AA AAAAAAAA 111KDBBB,
+     *   where K=1 writes D into bit BBB and K=0 verifies that bit BBB equals D.
+     * @param cv is 1-based (1-1024).
+     */
+    inline auto make_service_bit_packet(uint16_t cv, uint8_t bit, bool value, bool write) {
+        const uint16_t a = cv - 1;
+        etl::array<uint8_t, 3> data;
+        data[0] = 0b0111'1000 | (a >> 8 & 0x03);
+        data[1] = a & 0xFF;
+        data[2] = 0b1110'0000 | (write ? 0b1'0000 : 0) | (value ? 0b1000 : 0) | (bit & 0x7);
+        return data;
+    }
+
+    /**
+     * Operations mode (POM) CV byte write, long form of S-9.2.1 section 2.3.7.3:
+     *   1110CCAA AAAAAAAA DDDDDDDD after loco address, CC=11 is write byte.
+     * @param cv is 1-based (1-1024).
+     */
+    inline auto make_pom_byte_packet(LocoAddress addr, uint16_t cv, uint8_t value) {
+        const uint16_t a = cv - 1;
+        etl::vector<uint8_t, MAX_PACKET_LEN> data;
+        auto it = encode_address(addr, data.begin());
+        *it++ = 0b1110'1100 | (a >> 8 & 0x03);
+        *it++ = a & 0xFF;
+        *it++ = value;
+        data.uninitialized_resize(std::distance(data.begin(), it));
+        return data;
+    }
+
+    /** Operations mode (POM) CV bit write: CC=10 is bit manipulation, data byte is 1111DBBB as in service mode. */
+    inline auto make_pom_bit_packet(LocoAddress addr, uint16_t cv, uint8_t bit, bool value) {
+        const uint16_t a = cv - 1;
+        etl::vector<uint8_t, MAX_PACKET_LEN> data;
+        auto it = encode_address(addr, data.begin());
+        *it++ = 0b1110'1000 | (a >> 8 & 0x03);
+        *it++ = a & 0xFF;
+        *it++ = 0b1111'0000 | (value ? 0b1000 : 0) | (bit & 0x7);
+        data.uninitialized_resize(std::distance(data.begin(), it));
+        return data;
+    }
+
+    /** Address of multi-function decoder a packet is for, invalid address for broadcast, accessory or other packets. */
+    inline LocoAddress packet_loco_address(const etl::span<const uint8_t> bytes) {
+        if(bytes.empty()) return LocoAddress{};
+        if(bytes[0] >= 1 && bytes[0] <= 127) return LocoAddress::shortAddr(bytes[0]);
+        if(bytes[0] >= 0xC0 && bytes[0] <= 0xE7 && bytes.size() > 1) return LocoAddress::longAddr((bytes[0] & 0x3F) << 8 | bytes[1]);
+        return LocoAddress{};
+    }
+
+    /** Basic and extended accessory packets have first byte 10AAAAAA, no loco address falls into this range. */
+    inline bool is_accessory_packet(const etl::span<const uint8_t> bytes) {
+        return !bytes.empty() && (bytes[0] & 0b1100'0000) == 0b1000'0000;
+    }
+
 }
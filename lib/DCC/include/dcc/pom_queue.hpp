@@ -0,0 +1,122 @@
+#pragma once
+
+#include "base_channel.hpp"
+#include "mpsc_ring.hpp"
+#include "packet.hpp"
+#include "log.hpp"
+
+#include <etl/vector.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dcc {
+
+/**
+ * Ops mode (POM) programming on main track, that never blocks.
+ *
+ * Writes are submitted from any task into a queue of QUEUE_LEN, so that e.g. a sound profile of
+ *   a few dozen CVs can be submitted at once. loop() moves them into POM queue of channel's packet list
+ *   (see BasePacketList::put_pom_packet()) as it has room, and it spaces and interleaves them with refresh.
+ * Completion callback is called from loop() once all repeats of the packet are fetched for track.
+ *   There's no feedback from decoder (no RailCom here), so `sent` only tells that packet went to track.
+ *
+ * Threading: submit functions can be called from any task, loop() and callbacks run in one context.
+ */
+class PomQueue {
+public:
+    enum class Op: uint8_t { WriteByte, WriteBit };
+
+    struct Result {
+        Op op;
+        LocoAddress addr;
+        uint16_t cv;    ///< 1-based
+        uint8_t value;
+        uint8_t bit;    ///< for WriteBit
+        bool sent;      ///< false if packet list dropped it
+    };
+
+    using Callback = void(*)(const Result &r, void *ctx);
+
+    static constexpr size_t QUEUE_LEN = 64;
+
+    explicit PomQueue(BaseChannel *ch = nullptr): ch{ch} {}
+
+    /** Sets main track channel, before any write is submitted. */
+    void setChannel(BaseChannel *c) { ch = c; }
+
+    /** @return false if there is no channel or queue is full. */
+    bool writeByte(LocoAddress addr, uint16_t cv, uint8_t value, Callback cb = nullptr, void *ctx = nullptr) {
+        return submit(Job{Op::WriteByte, addr, cv, value, 0, cb, ctx});
+    }
+
+    /** @param bit is 0-7 */
+    bool writeBit(LocoAddress addr, uint16_t cv, uint8_t bit, bool value, Callback cb = nullptr, void *ctx = nullptr) {
+        return submit(Job{Op::WriteBit, addr, cv, static_cast<uint8_t>(value ? 1 : 0), static_cast<uint8_t>(bit & 0x7), cb, ctx});
+    }
+
+    /** Reports finished writes and passes queued ones on to packet list. Cheap to call often, never waits. */
+    void loop() {
+        if(ch == nullptr) return;
+        BasePacketList::PomDone d;
+        while(ch->packets.take_pom_done(d)) {
+            for(auto it = inFlight.begin(); it != inFlight.end(); ++it) {
+                if(it->token != d.token) continue;
+                const Job j = it->job;
+                inFlight.erase(it);
+                DCC_LOGI("POM %d CV%d: %s", j.addr.addr(), j.cv, d.sent ? "sent" : "dropped");
+                if(j.cb != nullptr) j.cb(Result{j.op, j.addr, j.cv, j.value, j.bit, d.sent}, j.ctx);
+                break;
+            }
+        }
+
+        while(!inFlight.full()) {
+            const Job *j = jobs.front();
+            if(j == nullptr) return;
+            if(++nextToken == 0) nextToken = 1;
+            const bool put = j->op == Op::WriteByte
+                ? ch->packets.put_pom_packet(j->addr, make_pom_byte_packet(j->addr, j->cv, j->value), nextToken)
+                : ch->packets.put_pom_packet(j->addr, make_pom_bit_packet(j->addr, j->cv, j->bit, j->value != 0), nextToken);
+            if(!put) return; // command ring is full, next time
+            inFlight.push_back(InFlight{nextToken, *j});
+            jobs.pop();
+        }
+    }
+
+    /** Writes are queued or not done yet. */
+    bool busy() const { return !inFlight.empty() || jobs.front() != nullptr; }
+
+private:
+    struct Job {
+        Op op;
+        LocoAddress addr;
+        uint16_t cv;
+        uint8_t value;
+        uint8_t bit;
+        Callback cb;
+        void *ctx;
+    };
+
+    struct InFlight {
+        uint32_t token;
+        Job job;
+    };
+
+    BaseChannel *ch;
+    MpscRing<Job, QUEUE_LEN> jobs;
+
+    // loop() context only
+    etl::vector<InFlight, BasePacketList::N_POM_PACKETS> inFlight;
+    uint32_t nextToken{0};
+
+    bool submit(const Job &j) {
+        if(ch == nullptr) return false;
+        if(!jobs.push(j)) {
+            DCC_LOGW("POM queue is full");
+            return false;
+        }
+        return true;
+    }
+};
+
+}
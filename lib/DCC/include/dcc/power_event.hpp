@@ -10,7 +10,8 @@ namespace dcc {
 
         enum class Reason: uint8_t {
             Normal,
-            Overcurrent
+            Overcurrent,
+            EmergencyStop   ///< power is unchanged, but all locos were stopped by broadcast e-stop
         };
 
         bool state;
@@ -0,0 +1,434 @@
+#pragma once
+
+#include "ack_detector.hpp"
+#include "base_channel.hpp"
+#include "cv_cache.hpp"
+#include "mpsc_ring.hpp"
+#include "packet.hpp"
+#include "log.hpp"
+
+#include <etl/array.h>
+#include <etl/span.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dcc {
+
+/**
+ * Service mode programmer (S-9.2.3) on a programming track, that never blocks.
+ *
+ * Jobs (read, verify or write a CV byte, write a CV bit) are submitted from any task into a queue,
+ *   and run one at a time by loop(), which is called periodically from main loop.
+ * A job is a sequence of steps. Each step puts RESETS reset packets, INSTRUCTIONS copies of one
+ *   service mode instruction and RECOVERY reset packets for decoder to respond, into channel's packet list.
+ * Step progress is followed by transmissions counted in BaseChannel::getTrackStats(), not by waiting:
+ *   current samples (BaseChannel::currentSamples()) during the leading resets make a baseline,
+ *   then AckDetector looks for ACK pulse in the following ones.
+ * A step ends as soon as ACK is seen; otherwise it ends with no ACK after the last recovery reset.
+ *   Resets of a step that ended early are still on their way to the track, and they serve as leading
+ *   resets of the next step, which then goes on track right after them.
+ * A step that does not make it to the track in STEP_TIMEOUT_MS (e.g. track power is off) fails its job.
+ *
+ * Read byte is 8 bit verifies and a byte verify of the result; writes are followed by a verify.
+ * A missed ACK reads as a 0 bit, while AckDetector doesn't take noise for an ACK, so when the verify of
+ *   a read fails, the bits read as 0 are verified again, and a write whose verify fails is written again,
+ *   up to `retries` times (DEFAULT_RETRIES).
+ * Read list reads a range or a list of CVs in one job, reporting each of them: its reads go back to back,
+ *   sharing baseline and leftover resets, so only the first CV waits for leading resets.
+ * With speculative reads on, a read first verifies a predicted value: the one last seen in this CV
+ *   (values read, verified and written are kept in CvCache, along with those stored for this decoder),
+ *   or a common default (see predict()).
+ *   Only if decoder doesn't acknowledge it, the CV is read bit by bit. Decoders on programming track
+ *   get replaced, so a wrong prediction costs one step, but the result is always what decoder says.
+ * Baseline current is measured once and reused by the steps that follow within BASELINE_REUSE_MS,
+ *   they start looking for ACK from their first packet.
+ * Cache is saved to its storage after CACHE_SAVE_DELAY_MS of no jobs.
+ *
+ * Threading: submit functions can be called from any task, loop() and callbacks run in one context.
+ */
+class ProgTrack {
+public:
+    enum class Op: uint8_t { ReadByte, VerifyByte, WriteByte, WriteBit, ReadList };
+
+    struct Result {
+        Op op;
+        uint16_t cv;    ///< 1-based
+        uint8_t value;  ///< value read, or value verified/written
+        uint8_t bit;    ///< for WriteBit
+        bool ok;        ///< decoder acknowledged
+        bool last;      ///< job is done; false for all but the last CV of a read list
+    };
+
+    /** Job completion (or a CV of read list), called from loop(). */
+    using Callback = void(*)(const Result &r, void *ctx);
+
+    static constexpr size_t QUEUE_LEN = 4;
+    static constexpr uint8_t RESETS = 3;
+    static constexpr uint8_t INSTRUCTIONS = 5;
+    static constexpr uint8_t RECOVERY = 6;
+    static constexpr uint32_t STEP_TIMEOUT_MS = 1000;
+    /** Counts of transmitted packets may be this much ahead of the track (idle packets already in waveform generator). */
+    static constexpr uint8_t COUNT_SLACK = 2;
+    static constexpr uint32_t BASELINE_REUSE_MS = 500;
+    static constexpr uint32_t CACHE_SAVE_DELAY_MS = 5000;
+    static constexpr uint8_t DEFAULT_RETRIES = 2;
+
+    explicit ProgTrack(BaseChannel *ch = nullptr): ch{ch} {}
+
+    /** Sets programming track channel, before any job is submitted. */
+    void setChannel(BaseChannel *c) { ch = c; }
+
+    /** See AckDetector::setThreshold(). */
+    void setAckThreshold(uint16_t mA) { detector.setThreshold(mA); }
+
+    /** See AckDetector::setWidth(). */
+    void setAckWidth(uint32_t min_us, uint32_t max_us) { detector.setWidth(min_us, max_us); }
+
+    void setSpeculativeReads(bool v) { speculative = v; }
+
+    /** Retries of a read or a write whose verify fails, 0 to report it failed right away. */
+    void setRetries(uint8_t n) { retries = n; }
+
+    /**
+     * With verify off, reads of CVs that are in cache are answered from it, without going to track.
+     * It's faster, but a decoder replaced with a similar one (same CV1/7/8) goes unnoticed.
+     */
+    void setVerifyCachedReads(bool v) { verifyCached = v; }
+
+    /** Forgets cached CV values, e.g. when another decoder is put on programming track. */
+    void clearCache() { cache.clear(); }
+
+    /** Only to be used from loop() context, e.g. in a callback. */
+    CvCache& cvCache() { return cache; }
+    const CvCache& cvCache() const { return cache; }
+
+    /**
+     * Value CV is expected to have: the one last seen by this programmer,
+     *   or a default of a common CV (short address 3, no long address, no consist, 28/128 speed steps).
+     */
+    bool predict(uint16_t cv, uint8_t &value) const {
+        if(cache.get(cv, value)) return true;
+        for(const auto &d: DEFAULTS) {
+            if(d.cv == cv) {
+                value = d.value;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** @return false if there is no channel or job queue is full. */
+    bool readByte(uint16_t cv, Callback cb, void *ctx = nullptr) {
+        return submit(Job{Op::ReadByte, cv, 0, 0, cb, ctx, nullptr, 1});
+    }
+
+    bool verifyByte(uint16_t cv, uint8_t value, Callback cb, void *ctx = nullptr) {
+        return submit(Job{Op::VerifyByte, cv, value, 0, cb, ctx, nullptr, 1});
+    }
+
+    bool writeByte(uint16_t cv, uint8_t value, Callback cb, void *ctx = nullptr) {
+        return submit(Job{Op::WriteByte, cv, value, 0, cb, ctx, nullptr, 1});
+    }
+
+    /** @param bit is 0-7 */
+    bool writeBit(uint16_t cv, uint8_t bit, bool value, Callback cb, void *ctx = nullptr) {
+        return submit(Job{Op::WriteBit, cv, static_cast<uint8_t>(value ? 1 : 0), static_cast<uint8_t>(bit & 0x7), cb, ctx, nullptr, 1});
+    }
+
+    /** Reads CVs from `first` to `last` inclusive, `cb` is called for each of them. */
+    bool readRange(uint16_t first, uint16_t last, Callback cb, void *ctx = nullptr) {
+        if(last < first) return false;
+        return submit(Job{Op::ReadList, first, 0, 0, cb, ctx, nullptr, static_cast<uint16_t>(last - first + 1)});
+    }
+
+    /**
+     * Reads CVs from `first` to `last` of decoder, identity CVs first (see decoder_read_order()),
+     *   so values stored for this decoder in CvStorage make the rest a verify per CV.
+     */
+    bool readDecoder(uint16_t first, uint16_t last, Callback cb, void *ctx = nullptr) {
+        if(last < first) return false;
+        return submit(Job{Op::ReadList, first, 0, 0, cb, ctx, nullptr, static_cast<uint16_t>(last - first + 1), true});
+    }
+
+    /**
+     * Reads `count` CVs listed in `cvs`, `cb` is called for each of them.
+     * The list must stay valid until the callback with Result::last set.
+     */
+    bool readList(const uint16_t *cvs, uint16_t count, Callback cb, void *ctx = nullptr) {
+        if(cvs == nullptr || count == 0) return false;
+        return submit(Job{Op::ReadList, cvs[0], 0, 0, cb, ctx, cvs, count});
+    }
+
+    /** Advances current job, or starts the next one. Cheap to call often, never waits. */
+    void loop(uint32_t now_ms) {
+        if(state == State::Idle) {
+            const Job *next = jobs.front();
+            if(next == nullptr) {
+                if(cache.dirty() && now_ms - stepTime >= CACHE_SAVE_DELAY_MS) cache.save();
+                return;
+            }
+            job = *next;
+            jobs.pop();
+            index = 0;
+            startCv(now_ms);
+            return;
+        }
+
+        if(now_ms - stepTime > STEP_TIMEOUT_MS) {
+            DCC_LOGW("CV%d step %d timed out", cv, phase);
+            finish(false);
+            return;
+        }
+
+        const uint32_t sent = ch->getTrackStats().packets - stepPackets;
+        etl::array<CurrentSample, 16> buf;
+        size_t n;
+        while((n = ch->currentSamples().read(samplePos, etl::span<CurrentSample>{buf})) > 0) {
+            for(size_t i=0; i<n; i++) {
+                if(state == State::Resets) {
+                    // samples read after leading resets are out may be from instruction packets
+                    if(sent < lead) {
+                        baselineSum += buf[i].mA;
+                        baselineCount++;
+                        continue;
+                    }
+                    arm(buf[i].mA);
+                }
+                if(detector.feed(buf[i])) {
+                    DCC_LOGD("CV%d step %d ACK at %u, %uus, baseline: %d", cv, phase,
+                        detector.ack().start_us, detector.ack().width_us, baseline);
+                    stepDone(true, now_ms);
+                    return;
+                }
+            }
+        }
+        if(state == State::Resets) {
+            if(sent >= lead) arm(ch->getCurrent());
+            return;
+        }
+
+        if(sent < static_cast<uint32_t>(lead + INSTRUCTIONS + RECOVERY) || detector.inPulse()) return;
+        DCC_LOGD("CV%d step %d no ACK, baseline: %d", cv, phase, baseline);
+        stepDone(false, now_ms);
+    }
+
+    /** A job is running. */
+    bool busy() const { return state != State::Idle; }
+
+private:
+    struct Job {
+        Op op;
+        uint16_t cv;
+        uint8_t value;
+        uint8_t bit;
+        Callback cb;
+        void *ctx;
+        const uint16_t *list;   ///< for ReadList, nullptr for a range from `cv`
+        uint16_t count;
+        bool decoderOrder{false}; ///< range is read in decoder_read_order()
+    };
+
+    enum class State: uint8_t {
+        Idle,
+        Resets,     ///< leading resets are sent, baseline current is measured
+        Ack,        ///< instruction and recovery resets are sent, ACK detector is fed
+    };
+
+    static constexpr CvValue DEFAULTS[] = { {1, 3}, {17, 0xC0}, {18, 0}, {19, 0}, {29, 0x06} };
+
+    BaseChannel *ch;
+    MpscRing<Job, QUEUE_LEN> jobs;
+    AckDetector detector;
+    bool speculative{true};
+    bool verifyCached{true};
+    uint8_t retries{DEFAULT_RETRIES};
+
+    // loop() context only
+    State state{State::Idle};
+    Job job{};
+    uint16_t index{0};      ///< of CV in read list
+    uint16_t cv{0};         ///< CV being accessed
+    uint8_t phase{0};
+    uint8_t readValue{0};
+    bool guessing{false};   ///< read verifies predicted value
+    uint8_t retry{0};       ///< of current CV, bits read as 1 are not read again
+    uint32_t stepTime{0};
+    uint32_t stepPackets{0};
+    uint32_t queuedEnd{0};  ///< transmission count when all queued packets are out
+    uint8_t lead{0};        ///< resets before instruction, counting those left from previous step
+    uint32_t samplePos{0};
+    uint32_t baselineSum{0};
+    uint32_t baselineCount{0};
+    uint16_t baseline{0};
+    uint32_t baselineTime{0};
+    bool haveBaseline{false};
+    CvCache cache;
+
+    bool submit(const Job &j) {
+        if(ch == nullptr) return false;
+        if(!jobs.push(j)) {
+            DCC_LOGW("Programming queue is full");
+            return false;
+        }
+        return true;
+    }
+
+    static constexpr uint8_t steps(Op op) {
+        switch(op) {
+            case Op::ReadByte:
+            case Op::ReadList: return 9;
+            case Op::VerifyByte: return 1;
+            default: return 2;
+        }
+    }
+
+    etl::array<uint8_t, 3> instruction() const {
+        switch(job.op) {
+            case Op::ReadByte:
+            case Op::ReadList:
+                return phase < 8 ? make_service_bit_packet(cv, phase, true, false)
+                                 : make_service_byte_packet(cv, readValue, false);
+            case Op::VerifyByte:
+                return make_service_byte_packet(cv, job.value, false);
+            case Op::WriteByte:
+                return make_service_byte_packet(cv, job.value, phase == 0);
+            case Op::WriteBit:
+            default:
+                return make_service_bit_packet(cv, job.bit, job.value != 0, phase == 0);
+        }
+    }
+
+    bool reads() const { return job.op == Op::ReadByte || job.op == Op::ReadList; }
+
+    /** Starts the job, or the next CV of read list. */
+    void startCv(uint32_t now_ms) {
+        for(;;) {
+            cv = job.list != nullptr ? job.list[index]
+                : job.decoderOrder ? decoder_read_order(job.cv, job.cv + job.count - 1, index)
+                : job.cv + index;
+            phase = 0;
+            readValue = 0;
+            retry = 0;
+            if(!reads() || verifyCached || !cache.get(cv, readValue)) break;
+            // answered from cache, not on track
+            if(job.op != Op::ReadList || index + 1u >= job.count) {
+                finish(true);
+                return;
+            }
+            report(true, false);
+            index++;
+        }
+        guessing = reads() && speculative && predict(cv, readValue);
+        if(guessing) phase = 8;
+        startStep(now_ms);
+    }
+
+    void startStep(uint32_t now_ms) {
+        const auto instr = instruction();
+        stepPackets = ch->getTrackStats().packets;
+        stepTime = now_ms;
+        const int32_t left = static_cast<int32_t>(queuedEnd - stepPackets);
+        const uint8_t leftover = left > 0 ? left : 0;
+        const bool reuse = leftover >= RESETS + COUNT_SLACK;
+        lead = leftover + (reuse ? 0 : RESETS);
+        queuedEnd = stepPackets + lead + INSTRUCTIONS + RECOVERY;
+        samplePos = ch->currentSamples().head();
+        baselineSum = baselineCount = 0;
+        const bool reuseBaseline = haveBaseline && now_ms - baselineTime <= BASELINE_REUSE_MS;
+        const bool queued = (reuse || ch->packets.put_generic_packet(resetPacket, RESETS))
+            && ch->packets.put_generic_packet(instr, INSTRUCTIONS)
+            && ch->packets.put_generic_packet(resetPacket, RECOVERY);
+        if(!queued) {
+            DCC_LOGW("CV%d: can't queue packets", cv);
+            finish(false);
+            return;
+        }
+        if(reuseBaseline) {
+            detector.begin(baseline);
+            state = State::Ack;
+        } else {
+            state = State::Resets;
+        }
+    }
+
+    /** Leading resets are out, baseline is known: start looking for ACK. */
+    void arm(uint16_t fallback_mA) {
+        baseline = baselineCount > 0 ? baselineSum / baselineCount : fallback_mA;
+        baselineTime = stepTime;
+        haveBaseline = true;
+        detector.begin(baseline);
+        state = State::Ack;
+    }
+
+    void stepDone(bool ack, uint32_t now_ms) {
+        if(reads() && phase < 8 && ack) readValue |= 1 << phase;
+        if(guessing && !ack) {
+            DCC_LOGD("CV%d is not %d, reading bits", cv, readValue);
+            guessing = false;
+            phase = 0;
+            readValue = 0;
+            startStep(now_ms);
+            return;
+        }
+        if(!ack && phase + 1u == steps(job.op) && job.op != Op::VerifyByte && retry < retries) {
+            retry++;
+            DCC_LOGD("CV%d verify of %d failed, retry %d", cv, reads() ? readValue : job.value, retry);
+            phase = 0;
+            skipReadBits();
+            startStep(now_ms);
+            return;
+        }
+        if(++phase < steps(job.op)) {
+            skipReadBits();
+            startStep(now_ms);
+            return;
+        }
+        cvDone(ack, now_ms);
+    }
+
+    /** On a retry of a read, bits already read as 1 are not read again. */
+    void skipReadBits() {
+        if(!reads() || retry == 0) return;
+        while(phase < 8 && (readValue >> phase & 1)) phase++;
+    }
+
+    /** A CV that does not read is no reason to stop reading a list, unlike a timeout. */
+    void cvDone(bool ok, uint32_t now_ms) {
+        if(job.op != Op::ReadList || index + 1u >= job.count) {
+            finish(ok);
+            return;
+        }
+        report(ok, false);
+        index++;
+        startCv(now_ms);
+    }
+
+    void finish(bool ok) {
+        state = State::Idle;
+        report(ok, true);
+    }
+
+    void report(bool ok, bool last) {
+        const Result r{job.op, cv, reads() ? readValue : job.value, job.bit, ok, last};
+        DCC_LOGI("CV%d op %d value %d: %s", r.cv, (int)r.op, r.value, ok ? "ok" : "failed");
+        updateCache(r);
+        if(job.cb != nullptr) job.cb(r, job.ctx);
+    }
+
+    void updateCache(const Result &r) {
+        if(!r.ok) {
+            cache.forget(r.cv);
+            return;
+        }
+        uint8_t value = r.value;
+        if(r.op == Op::WriteBit) {
+            // only the bit is known
+            if(!cache.get(r.cv, value)) return;
+            value = (value & ~(1 << r.bit)) | (r.value << r.bit);
+        }
+        cache.put(r.cv, value);
+    }
+};
+
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "host_channel.hpp"
+#include "packet.hpp"
+
+#include <etl/array.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+
+namespace dcc {
+
+/**
+ * Decoder on programming track, for host builds: follows packets a HostChannel puts on track,
+ *   and draws current that its current meter reads.
+ *
+ * Service mode (S-9.2.3) is entered with a reset packet and left with any packet that is
+ *   neither reset nor service mode instruction, so an idle packet between resets and instructions
+ *   makes decoder ignore them, as a strict decoder would.
+ * Direct mode instructions (verify byte, write byte, verify bit, write bit) are executed on the second
+ *   identical packet in a row; a write or a verify that matches is acknowledged with a current pulse.
+ *
+ * ACK pulse amplitude, width and delay are configurable, and so are jitter of its start
+ *   and noise of every current sample. Noise comes from a seeded generator, so runs are repeatable.
+ */
+class SimDecoder {
+public:
+    struct Config {
+        uint16_t idle_mA{10};   ///< drawn all the time
+        uint16_t ack_mA{90};    ///< above idle
+        uint32_t ack_us{6000};
+        uint32_t delay_us{0};   ///< from the end of the second instruction packet to ACK start
+        uint32_t jitter_us{0};  ///< ACK starts up to this much later than delay_us, uniformly
+        uint16_t noise_mA{0};   ///< every sample is off by up to this, uniformly
+        uint32_t seed{1};
+    };
+
+    static constexpr size_t NUM_CVS = 1024;
+
+    SimDecoder() { setConfig(Config{}); }
+    explicit SimDecoder(const Config &c) { setConfig(c); }
+
+    void setConfig(const Config &c) {
+        cfg = c;
+        rng.seed(c.seed);
+    }
+
+    const Config& config() const { return cfg; }
+
+    /** @param n is 1-based */
+    uint8_t cv(uint16_t n) const { return cvs[n - 1]; }
+    void setCv(uint16_t n, uint8_t v) { cvs[n - 1] = v; }
+
+    /** No decoder on track: no current, no ACK. */
+    void setPresent(bool v) { present = v; }
+
+    /** Instructions executed, whether acknowledged or not. */
+    size_t instructions() const { return executed; }
+    size_t acks() const { return ackCount; }
+
+    /** Processes packets emitted since last call. */
+    void update(const HostChannel &ch) {
+        const auto &e = ch.emittedPackets();
+        if(e.size() < seen) seen = 0; // recording was cleared
+        for(; seen < e.size(); seen++) onPacket(e[seen].packet, e[seen].end_us);
+    }
+
+    /** Current drawn at `t_us`, call with increasing times. */
+    uint16_t currentAt(uint64_t t_us) {
+        if(!present) return 0;
+        int mA = cfg.idle_mA;
+        if(t_us >= ackFrom && t_us < ackFrom + cfg.ack_us) mA += cfg.ack_mA;
+        if(cfg.noise_mA > 0) mA += std::uniform_int_distribution<int>{-cfg.noise_mA, cfg.noise_mA}(rng);
+        return static_cast<uint16_t>(std::max(mA, 0));
+    }
+
+private:
+    Config cfg;
+    std::mt19937 rng;
+    etl::array<uint8_t, NUM_CVS> cvs{};
+    bool present{true};
+    size_t executed{0};
+    size_t ackCount{0};
+
+    size_t seen{0};
+    bool serviceMode{false};
+    Packet last;
+    size_t same{0};
+    uint64_t ackFrom{UINT64_MAX / 2};
+
+    void onPacket(const Packet &p, uint64_t end_us) {
+        if(!present) return;
+        if(p == resetPacket) {
+            serviceMode = true;
+            same = 0;
+            return;
+        }
+        if(p.size() != 3 || (p[0] & 0xF0) != 0x70) {
+            serviceMode = false;
+            same = 0;
+            return;
+        }
+        if(!serviceMode) return;
+        same = (same > 0 && p == last) ? same + 1 : 1;
+        last = p;
+        if(same != 2) return;
+        executed++;
+        if(!execute(p)) return;
+        ackCount++;
+        const uint32_t jitter = cfg.jitter_us > 0 ? std::uniform_int_distribution<uint32_t>{0, cfg.jitter_us}(rng) : 0;
+        ackFrom = end_us + cfg.delay_us + jitter;
+    }
+
+    /** @return true if decoder acknowledges. */
+    bool execute(const Packet &p) {
+        uint8_t &v = cvs[(p[0] & 0x03) << 8 | p[1]];
+        switch(p[0] & 0x0C) {
+            case 0x04: return v == p[2];
+            case 0x0C: v = p[2]; return true;
+            case 0x08: {
+                const uint8_t bit = p[2] & 0x7, b = p[2] >> 3 & 1;
+                if(p[2] & 0x10) {
+                    v = (v & ~(1 << bit)) | b << bit;
+                    return true;
+                }
+                return (v >> bit & 1) == b;
+            }
+            default: return false;
+        }
+    }
+};
+
+/**
+ * Programming track with a SimDecoder on it: transmits packets of a HostChannel one by one,
+ *   and samples decoder current into the channel every 1ms, as CurrentMeter does on target.
+ */
+class SimProgTrack {
+public:
+    static constexpr uint32_t SAMPLE_US = 1000;
+
+    SimProgTrack(HostChannel &ch, SimDecoder &decoder): ch{ch}, decoder{decoder} {}
+
+    /** Transmits one packet. @return simulated time after it, in ms. */
+    uint32_t step() {
+        ch.step();
+        decoder.update(ch);
+        for(; nextSampleUs <= ch.nowUs(); nextSampleUs += SAMPLE_US) {
+            ch.setCurrent(decoder.currentAt(nextSampleUs));
+            ch.sampleCurrent(static_cast<uint32_t>(nextSampleUs));
+        }
+        return static_cast<uint32_t>(ch.nowUs() / 1000);
+    }
+
+private:
+    HostChannel &ch;
+    SimDecoder &decoder;
+    uint64_t nextSampleUs{0};
+};
+
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "LocoAddress.h"
+
+#include <etl/array.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dcc {
+
+    /**
+     * Stable reference to a row of ISlotTable.
+     *
+     * Stays valid while the row exists. After the row is erased, the handle becomes stale
+     *   (generation mismatch) and ISlotTable::get() returns nullptr for it,
+     *   even if the same storage is reused for another loco.
+     */
+    struct SlotHandle {
+        static constexpr uint16_t NONE = 0xFFFF;
+        uint16_t index{NONE};
+        uint16_t gen{0};
+        bool valid() const { return index != NONE; }
+        bool operator==(const SlotHandle &o) const { return index == o.index && gen == o.gen; }
+        bool operator!=(const SlotHandle &o) const { return !(*this == o); }
+    };
+
+    /**
+     * Fixed-capacity table of values keyed by loco address, with O(1) find/insert/erase.
+     *
+     * Rows live in a fixed array and never move, so a SlotHandle can be kept in queues.
+     * An open-addressed hash (linear probing, backward-shift deletion, load factor <= 1/2)
+     *   maps address to row.
+     * Used rows are also listed in a dense array (`order`) for round-robin iteration;
+     *   erasing swaps the last used row into the gap, so `order` has no holes.
+     * No allocations, suitable for ISR context.
+     *
+     * This is a size-agnostic interface, storage is provided by SlotTable.
+     */
+    template<typename V>
+    class ISlotTable {
+    public:
+        struct Row {
+            LocoAddress addr;
+            uint16_t gen;
+            uint16_t pos;   ///< position in `order`
+            V value;
+        };
+
+        size_t size() const { return count; }
+        size_t capacity() const { return cap; }
+        size_t available() const { return cap - count; }
+        bool empty() const { return count == 0; }
+        bool full() const { return count == cap; }
+
+        SlotHandle find(const LocoAddress addr) const {
+            const uint16_t key = addr.key();
+            for(size_t b = bucket_of(key); ; b = (b + 1) & hash_mask) {
+                const uint16_t r = buckets[b];
+                if(r == SlotHandle::NONE) return SlotHandle{};
+                if(rows[r].addr.key() == key) return SlotHandle{r, rows[r].gen};
+            }
+        }
+
+        /** @return handle of existing or newly added row, invalid handle if table is full. */
+        SlotHandle find_or_add(const LocoAddress addr) {
+            const uint16_t key = addr.key();
+            size_t b = bucket_of(key);
+            for(; ; b = (b + 1) & hash_mask) {
+                const uint16_t r = buckets[b];
+                if(r == SlotHandle::NONE) break;
+                if(rows[r].addr.key() == key) return SlotHandle{r, rows[r].gen};
+            }
+            if(full()) return SlotHandle{};
+
+            // rows that are not used are kept in order[count..cap)
+            const uint16_t r = order[count];
+            Row &row = rows[r];
+            row.addr = addr;
+            row.pos = count;
+            row.value = V{};
+            buckets[b] = r;
+            count++;
+            return SlotHandle{r, row.gen};
+        }
+
+        bool erase(const LocoAddress addr) {
+            const uint16_t key = addr.key();
+            size_t b = bucket_of(key);
+            for(; ; b = (b + 1) & hash_mask) {
+                const uint16_t r = buckets[b];
+                if(r == SlotHandle::NONE) return false;
+                if(rows[r].addr.key() == key) break;
+            }
+            const uint16_t r = buckets[b];
+            remove_bucket(b);
+
+            // move last used row into the gap in `order`, put this row after it
+            Row &row = rows[r];
+            const uint16_t last = order[count - 1];
+            order[row.pos] = last;
+            rows[last].pos = row.pos;
+            order[count - 1] = r;
+            row.pos = count - 1;
+            row.gen++;
+            count--;
+            return true;
+        }
+
+        /** @return row value or nullptr if handle is stale. */
+        V* get(const SlotHandle h) {
+            if(!h.valid() || h.index >= cap) return nullptr;
+            Row &row = rows[h.index];
+            if(row.gen != h.gen || row.pos >= count) return nullptr;
+            return &row.value;
+        }
+
+        /** Handle of i-th used row, i < size(). Order changes when rows are erased. */
+        SlotHandle at(size_t i) const {
+            const uint16_t r = order[i];
+            return SlotHandle{r, rows[r].gen};
+        }
+
+        V& value_at(size_t i) { return rows[order[i]].value; }
+        /** Value by row index (SlotHandle::index), without generation check. */
+        V& row_value(uint16_t index) { return rows[index].value; }
+        const V& row_value(uint16_t index) const { return rows[index].value; }
+        LocoAddress address_at(size_t i) const { return rows[order[i]].addr; }
+        LocoAddress address(const SlotHandle h) const { return rows[h.index].addr; }
+        /** Position of row in iteration order. */
+        size_t position(const SlotHandle h) const { return rows[h.index].pos; }
+
+    protected:
+        ISlotTable(Row *rows, uint16_t *order, size_t cap, uint16_t *buckets, size_t n_buckets)
+        : rows{rows}, order{order}, buckets{buckets}, cap{cap}, hash_mask{n_buckets - 1}
+        {
+        }
+
+        /** Called by SlotTable once its storage is constructed. */
+        void init() {
+            const size_t n_buckets = hash_mask + 1;
+            for(size_t i=0; i<cap; i++) {
+                order[i] = i;
+                rows[i].gen = 0;
+                rows[i].pos = i;
+            }
+            for(size_t i=0; i<n_buckets; i++) buckets[i] = SlotHandle::NONE;
+        }
+
+    private:
+        Row *rows;
+        uint16_t *order;
+        uint16_t *buckets;
+        const size_t cap;
+        const size_t hash_mask;
+        size_t count{0};
+
+        size_t bucket_of(uint16_t key) const {
+            // Fibonacci hashing, addresses are mostly sequential
+            return (static_cast<uint32_t>(key) * 2654435769u >> 16) & hash_mask;
+        }
+
+        /** Backward-shift deletion: keeps probe chains intact without tombstones. */
+        void remove_bucket(size_t hole) {
+            size_t b = hole;
+            for(;;) {
+                b = (b + 1) & hash_mask;
+                const uint16_t r = buckets[b];
+                if(r == SlotHandle::NONE) break;
+                const size_t home = bucket_of(rows[r].addr.key());
+                // move entry into hole if its home is not within (hole, b]
+                const bool stays = (hole < b) ? (hole < home && home <= b) : (hole < home || home <= b);
+                if(!stays) {
+                    buckets[hole] = r;
+                    hole = b;
+                }
+            }
+            buckets[hole] = SlotHandle::NONE;
+        }
+    };
+
+    /**
+     * Storage of SlotTable, it is a base class listed before ISlotTable,
+     * so arrays are constructed before their pointers are handed to ISlotTable.
+     */
+    template<typename V, size_t N>
+    struct SlotTableStorage {
+        static constexpr size_t pow2_at_least(size_t n) {
+            size_t p = 1;
+            while(p < n) p <<= 1;
+            return p;
+        }
+        static constexpr size_t N_BUCKETS = pow2_at_least(N * 2);
+
+        etl::array<typename ISlotTable<V>::Row, N> _rows;
+        etl::array<uint16_t, N> _order;
+        etl::array<uint16_t, N_BUCKETS> _buckets;
+    };
+
+    /** ISlotTable with storage for N rows. */
+    template<typename V, size_t N>
+    class SlotTable: private SlotTableStorage<V, N>, public ISlotTable<V> {
+        static_assert(N > 0 && N < SlotHandle::NONE, "Invalid SlotTable size");
+        using Storage = SlotTableStorage<V, N>;
+    public:
+        SlotTable(): Storage(), ISlotTable<V>(Storage::_rows.data(), Storage::_order.data(), N, Storage::_buckets.data(), Storage::N_BUCKETS) {
+            this->init();
+        }
+    };
+
+}
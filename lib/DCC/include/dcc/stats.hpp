@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace dcc {
+
+    /**
+     * Statistics counter written from one context (usually waveform generator ISR) and read from any task.
+     *
+     * Uses relaxed atomic load/store, no read-modify-write: single writer doesn't need it,
+     *   and readers never block the writer. 32-bit atomics are lock-free on ESP32.
+     * Counters wrap around, readers should work with differences between two snapshots.
+     */
+    class StatCounter {
+    public:
+        void inc(uint32_t d = 1) { set(get() + d); }
+        void update_max(uint32_t v) { if(v > get()) set(v); }
+        void set(uint32_t v) { value.store(v, std::memory_order_relaxed); }
+        uint32_t get() const { return value.load(std::memory_order_relaxed); }
+    private:
+        std::atomic<uint32_t> value{0};
+    };
+
+    /** Same, but for counters incremented from several tasks at once. */
+    class SharedStatCounter {
+    public:
+        void inc(uint32_t d = 1) { value.fetch_add(d, std::memory_order_relaxed); }
+        uint32_t get() const { return value.load(std::memory_order_relaxed); }
+    private:
+        std::atomic<uint32_t> value{0};
+    };
+
+}
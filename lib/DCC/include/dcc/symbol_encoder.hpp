@@ -0,0 +1,160 @@
+#pragma once
+
+#include "packet.hpp"
+
+#include <etl/span.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+namespace dcc {
+
+    /**
+     * 32-bit RMT symbol word: duration0:15, level0:1, duration1:15, level1:1.
+     *
+     * Same layout as rmt_item32_t (legacy driver) and rmt_symbol_word_t (new driver),
+     *   both have `val` member to access it as a whole.
+     * This struct is for host builds that don't have RMT headers.
+     */
+    struct SymbolWord {
+        uint32_t val;
+    };
+
+    constexpr uint32_t make_symbol(uint16_t duration0, bool level0, uint16_t duration1, bool level1) {
+        return (duration0 & 0x7FFFu)
+            | (level0 ? 1u : 0u) << 15
+            | static_cast<uint32_t>(duration1 & 0x7FFFu) << 16
+            | (level1 ? 1u : 0u) << 31;
+    }
+
+    constexpr uint32_t SYMBOL_LEVEL_BITS = 1u << 15 | 1u << 31;
+
+    /**
+     * RailCom cutout timing (S-9.3.2), relative to the end of packet end bit.
+     * Track is still driven for START_US (as if next preamble bit started), then it is not driven
+     *   (outputs shorted by H-bridge brake) until END_US. It takes place of first preamble bits.
+     */
+    struct RailcomCutout {
+        static constexpr uint16_t START_US = 29;      ///< 26..32us allowed
+        static constexpr uint16_t END_US = 464;       ///< 454..488us allowed
+        static constexpr size_t PREAMBLE_BITS = 4;    ///< 4 "1" bits are 464us
+    };
+
+    /**
+     * Converts DCC packets into RMT symbols (one symbol per DCC bit).
+     *
+     * A constexpr lookup table maps a byte to 9 symbols: start bit "0" followed by 8 data bits, MSB first.
+     * Packet is filled from its bytes directly, checksum is calculated on the fly,
+     *   so waveform generator doesn't need PacketBits at all.
+     * The table takes 9KB of flash per instantiation (i.e. per distinct timings).
+     *
+     * @tparam ONE_HALF_US duration of half of "1" bit.
+     * @tparam ZERO_HALF_US duration of half of "0" bit.
+     * @tparam HIGH_FIRST whether first half of bit is high.
+     */
+    template<uint16_t ONE_HALF_US, uint16_t ZERO_HALF_US, bool HIGH_FIRST>
+    class SymbolEncoder {
+    public:
+        static constexpr uint32_t ONE = make_symbol(ONE_HALF_US, HIGH_FIRST, ONE_HALF_US, !HIGH_FIRST);
+        static constexpr uint32_t ZERO = make_symbol(ZERO_HALF_US, HIGH_FIRST, ZERO_HALF_US, !HIGH_FIRST);
+        /** RailCom cutout symbol, see fill_cutout(). */
+        static constexpr uint32_t CUTOUT = make_symbol(RailcomCutout::START_US, HIGH_FIRST,
+            RailcomCutout::END_US - RailcomCutout::START_US, HIGH_FIRST);
+
+        static constexpr size_t SYMBOLS_PER_BYTE = 9;
+
+        /** Number of symbols fill_packet() will produce for a packet of given size (without preamble). */
+        static constexpr size_t packet_symbols(size_t nBytes) {
+            return (nBytes + 1) * SYMBOLS_PER_BYTE + 1; // data bytes, checksum, end bit
+        }
+
+        /** Puts `n` preamble ("1") symbols. */
+        template<typename Item>
+        static size_t fill_preamble(size_t n, etl::span<Item> items) {
+            if(n > items.size()) return 0;
+            for(size_t i=0; i<n; i++) items[i].val = ONE;
+            return n;
+        }
+
+        /**
+         * Puts RailCom cutout symbol: track level of next bit's first half for RailcomCutout::START_US,
+         *   then the same level until RailcomCutout::END_US (brake is on, see brake_symbol()).
+         */
+        template<typename Item>
+        static size_t fill_cutout(etl::span<Item> items) {
+            if(items.empty()) return 0;
+            items[0].val = CUTOUT;
+            return 1;
+        }
+
+        /**
+         * Symbol with same timing for H-bridge brake output, which runs in sync with data output:
+         *   brake is active (high) in the cutout part of cutout symbol, and inactive everywhere else.
+         */
+        static constexpr uint32_t brake_symbol(uint32_t val, bool cutout) {
+            return cutout ? (val & ~SYMBOL_LEVEL_BITS) | 1u << 31 : val & ~SYMBOL_LEVEL_BITS;
+        }
+
+        /**
+         * Puts symbols of packet payload: start bits, data bytes, checksum and end bit.
+         * @return number of symbols written or 0 if packet doesn't fit.
+         */
+        template<typename Item>
+        static size_t fill_packet(const etl::span<const uint8_t> bytes, etl::span<Item> items) {
+            if(bytes.size() == 0 || packet_symbols(bytes.size()) > items.size()) return 0;
+
+            Item *out = items.data();
+            uint8_t crc = 0;
+            for(const uint8_t b: bytes) {
+                crc ^= b;
+                out = put_byte(b, out);
+            }
+            out = put_byte(crc, out);
+            (out++)->val = ONE;  // end bit
+            return out - items.data();
+        }
+
+        /**
+         * Bit-by-bit conversion of pre-encoded packet bits.
+         *
+         * This is how channels filled RMT memory before the lookup table,
+         *   kept as a reference for tests and benchmarks.
+         */
+        template<typename Item>
+        static size_t fill_bits(const PacketBits &bits, etl::span<Item> items) {
+            if(bits.size_bits > items.size()) return 0;
+            for(size_t i=0; i<bits.size_bits; i++) {
+                items[i].val = bits.bit_at(i) ? ONE : ZERO;
+            }
+            return bits.size_bits;
+        }
+
+    private:
+        struct Table {
+            uint32_t symbols[256][SYMBOLS_PER_BYTE];
+        };
+
+        static constexpr Table make_table() {
+            Table t{};
+            for(size_t b=0; b<256; b++) {
+                t.symbols[b][0] = ZERO; // start bit
+                for(size_t i=0; i<8; i++) {
+                    t.symbols[b][i+1] = (b & (0x80u >> i)) ? ONE : ZERO;
+                }
+            }
+            return t;
+        }
+
+        static constexpr Table TABLE = make_table();
+
+        template<typename Item>
+        static inline Item* put_byte(uint8_t b, Item *out) {
+            const uint32_t *s = TABLE.symbols[b];
+            for(size_t i=0; i<SYMBOLS_PER_BYTE; i++) {
+                (out++)->val = s[i];
+            }
+            return out;
+        }
+    };
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "packet.hpp"
+#include "symbol_encoder.hpp"
+
+#include <etl/algorithm.h>
+#include <etl/array.h>
+#include <etl/span.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dcc {
+
+    /**
+     * Endless stream of DCC symbols for a waveform generator that is refilled a chunk at a time
+     *   (RMT "ping-pong": memory is split into two halves, threshold interrupt comes when one half is sent,
+     *   and it is refilled while the other half is being output).
+     *
+     * Every packet is encoded once, with its preamble (and RailCom cutout before it), into a buffer
+     *   that fits the longest packet, and then copied out chunk by chunk. So a packet can be longer than
+     *   the generator memory, and next preamble always follows end bit directly: there is never
+     *   an end marker in the stream.
+     *
+     * Threading: fill() is called from refill interrupt only.
+     */
+    template<typename Encoder>
+    class SymbolStream {
+    public:
+        static constexpr size_t MAX_SYMBOLS = 1 + DEF_PREAMBLE_LEN + Encoder::packet_symbols(MAX_PACKET_LEN);
+
+        /**
+         * @param preambleBits preamble length, including RailCom cutout bits.
+         * @param railcom put cutout symbol before every preamble but the first one (there is no end bit
+         *   for it to follow), it takes place of RailcomCutout::PREAMBLE_BITS preamble bits.
+         */
+        void begin(size_t preambleBits, bool railcom) {
+            preamble = railcom ? preambleBits - RailcomCutout::PREAMBLE_BITS : preambleBits;
+            cutout = railcom;
+            pos = len = 0;
+            started = false;
+        }
+
+        /**
+         * Puts next `items.size()` symbols of the stream.
+         * @param next returns `const Packet&` to transmit next; called every time a packet is finished.
+         */
+        template<typename Item, typename NextPacket>
+        void fill(etl::span<Item> items, NextPacket &&next) {
+            size_t i = 0;
+            while(i < items.size()) {
+                if(pos == len) load(next());
+                const size_t n = etl::min(len - pos, items.size() - i);
+                for(size_t k=0; k<n; k++) items[i+k].val = current[pos+k].val;
+                i += n;
+                pos += n;
+            }
+        }
+
+        /** Symbols of current packet that are not put yet. */
+        size_t pending() const { return len - pos; }
+
+    private:
+        etl::array<SymbolWord, MAX_SYMBOLS> current;
+        size_t pos{0};
+        size_t len{0};
+        size_t preamble{DEF_PREAMBLE_LEN};
+        bool cutout{false};
+        bool started{false};
+
+        void load(const Packet &packet) {
+            const etl::span<SymbolWord> out{current};
+            size_t n = 0;
+            if(cutout) {
+                n = started ? Encoder::fill_cutout(out) : 0;
+                n += Encoder::fill_preamble(started ? preamble : preamble + RailcomCutout::PREAMBLE_BITS, out.subspan(n));
+            } else {
+                n = Encoder::fill_preamble(preamble, out);
+            }
+            started = true;
+            n += Encoder::fill_packet(packet, out.subspan(n));
+            pos = 0;
+            len = n;
+        }
+    };
+
+}
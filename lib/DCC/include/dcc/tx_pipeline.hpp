@@ -0,0 +1,121 @@
+#pragma once
+
+#include "stats.hpp"
+
+#include <etl/array.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace dcc {
+
+    /**
+     * Buffer ring for a waveform generator that queues transmissions (RMT new driver: `rmt_transmit()`
+     *   with `trans_queue_depth` > 1), so that next packet is encoded while previous ones are on the wire.
+     *
+     * A queued transmission reads its symbols while it is being sent, so its buffer can't be reused until
+     *   the transmission is done. There are QUEUE_DEPTH+1 buffers: as transmit blocks while the queue is full,
+     *   at most QUEUE_DEPTH transmissions are in flight, and each buffer has at least one of them,
+     *   so the buffer after the QUEUE_DEPTH most recent ones is always free.
+     *
+     * Also measures gaps: when the last queued transmission is done before the next one is queued,
+     *   the line is idle until then (transmit task was preempted or packet list was slow).
+     *
+     * Threading: next()/submitted() are called by transmit task, done() from transmission done interrupt.
+     *
+     * @tparam Symbol rmt_symbol_word_t, or SymbolWord in host tests.
+     */
+    template<typename Symbol, size_t N_SYMBOLS, size_t QUEUE_DEPTH>
+    class TxPipeline {
+        static_assert(QUEUE_DEPTH >= 1, "Queue depth must be at least 1");
+    public:
+        static constexpr size_t N_BUFFERS = QUEUE_DEPTH + 1;
+        using Buffer = etl::array<Symbol, N_SYMBOLS>;
+
+        struct Stats {
+            uint32_t submitted;     ///< transmissions queued, repeats included
+            uint32_t completed;
+            uint32_t underruns;     ///< queue ran empty, a gap followed
+            uint32_t gap_sum_us;    ///< total length of gaps
+            uint32_t gap_max_us;
+            uint32_t buffer_busy;   ///< next() found its buffer in flight, must stay 0
+        };
+
+        /** Buffer to encode next packet into. */
+        Buffer &next() {
+            Slot &s = ring[head];
+            if(static_cast<int32_t>(done_seq.load(std::memory_order_acquire) - s.last_seq) < 0) {
+                counters.buffer_busy.inc();
+            }
+            return s.symbols;
+        }
+
+        /**
+         * Must be called after each transmission of buffer returned by next().
+         * @return for how long the line was idle before this transmission, 0 if there was no gap.
+         */
+        uint32_t submitted(uint32_t now_us) {
+            uint32_t gap = 0;
+            if(in_flight() == 0 && idle_pending.exchange(false, std::memory_order_acquire)) {
+                gap = now_us - idle_since.load(std::memory_order_relaxed);
+                counters.gap_sum.inc(gap);
+                counters.gap_max.update_max(gap);
+            }
+            ring[head].last_seq = ++submit_seq;
+            counters.submitted.inc();
+            return gap;
+        }
+
+        /** Moves to next buffer, after all repeats of a packet are submitted. */
+        void advance() {
+            head = (head + 1) % N_BUFFERS;
+        }
+
+        /** Transmission done interrupt. */
+        void done(uint32_t now_us) {
+            const uint32_t d = done_seq.load(std::memory_order_relaxed) + 1;
+            done_seq.store(d, std::memory_order_release);
+            counters.completed.inc();
+            if(d == submit_seq.load(std::memory_order_relaxed)) {
+                idle_since.store(now_us, std::memory_order_relaxed);
+                idle_pending.store(true, std::memory_order_release);
+                counters.underruns.inc();
+            }
+        }
+
+        size_t in_flight() const {
+            return submit_seq.load(std::memory_order_relaxed) - done_seq.load(std::memory_order_acquire);
+        }
+
+        Stats stats() const {
+            return Stats{
+                .submitted = counters.submitted.get(),
+                .completed = counters.completed.get(),
+                .underruns = counters.underruns.get(),
+                .gap_sum_us = counters.gap_sum.get(),
+                .gap_max_us = counters.gap_max.get(),
+                .buffer_busy = counters.buffer_busy.get()
+            };
+        }
+
+    private:
+        struct Slot {
+            Buffer symbols;
+            uint32_t last_seq{0}; ///< sequence number of last transmission from this buffer
+        };
+        etl::array<Slot, N_BUFFERS> ring;
+        size_t head{0};
+
+        std::atomic<uint32_t> submit_seq{0};
+        std::atomic<uint32_t> done_seq{0};
+        std::atomic<uint32_t> idle_since{0};
+        std::atomic<bool> idle_pending{false};
+
+        struct Counters {
+            StatCounter submitted, completed, underruns, gap_sum, gap_max, buffer_busy;
+        };
+        Counters counters;
+    };
+
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "stats.hpp"
+
+#include <etl/array.h>
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Waveform timing instrumentation (see WaveformTiming), off by default.
+ * Build with -DDCC_WAVEFORM_TIMING=1 to enable.
+ */
+#ifndef DCC_WAVEFORM_TIMING
+#define DCC_WAVEFORM_TIMING 0
+#endif
+
+namespace dcc {
+
+    /**
+     * Timing of waveform generator refills: how late refill interrupt came (latency), how long it took (refill),
+     *   and how long the line was held at a wrong level because of that (gap), as histograms.
+     * A refill that finished after its slack ran out (e.g. preamble that RMT outputs while payload is written)
+     *   is an overrun, and its lateness is a gap.
+     *
+     * Timestamps are CPU cycle counter values, so they are cheap to take in ISR; they are converted to
+     *   microseconds with `cycles_per_us` given to begin().
+     * Refill event time can't be read from hardware, it is predicted: next event is expected `next_event_us`
+     *   after current one, which is the duration of symbols RMT outputs in between. Prediction restarts after an overrun.
+     *
+     * Threading: refill_*()/gap() are called from one context (refill interrupt or transmit task),
+     *   stats() from any task.
+     *
+     * @tparam ENABLED when false, everything is a no-op and takes no memory, see WaveformTiming.
+     */
+    template<bool ENABLED>
+    class BasicWaveformTiming;
+
+    /** Histogram with power of two buckets: 0us, 1us, 2-3us, 4-7us, ... and the last one takes everything above. */
+    struct TimingHistogram {
+        static constexpr size_t N_BUCKETS = 14; ///< last bucket is 4096us and more
+
+        etl::array<uint32_t, N_BUCKETS> buckets;
+        uint32_t max_us;
+
+        static constexpr size_t bucket_of(uint32_t us) {
+            size_t b = 0;
+            while(us != 0 && b < N_BUCKETS - 1) {
+                us >>= 1;
+                b++;
+            }
+            return b;
+        }
+
+        /** Lowest value that goes to bucket `b`. */
+        static constexpr uint32_t bucket_min_us(size_t b) { return b == 0 ? 0 : 1u << (b - 1); }
+
+        uint32_t count() const {
+            uint32_t n = 0;
+            for(auto c: buckets) n += c;
+            return n;
+        }
+
+        /** Upper bound of bucket where `pct` percent of values are at or below (but not above max). */
+        uint32_t percentile_us(uint32_t pct) const {
+            const uint32_t n = count();
+            uint32_t acc = 0;
+            for(size_t b=0; b<N_BUCKETS; b++) {
+                acc += buckets[b];
+                if(n > 0 && acc * 100 >= n * pct) {
+                    const uint32_t upper = b + 1 < N_BUCKETS ? bucket_min_us(b + 1) - 1 : max_us;
+                    return upper < max_us ? upper : max_us;
+                }
+            }
+            return 0;
+        }
+    };
+
+    template<>
+    class BasicWaveformTiming<true> {
+    public:
+        static constexpr bool ENABLED = true;
+
+        struct Stats {
+            TimingHistogram latency;
+            TimingHistogram refill;
+            TimingHistogram gap;
+            uint32_t overruns;
+        };
+
+        void begin(uint32_t cycles_per_us) {
+            cpu = cycles_per_us > 0 ? cycles_per_us : 1;
+            predicted = false;
+        }
+
+        /** Refill interrupt entry. */
+        void refill_begin(uint32_t now_cycles) {
+            entry = now_cycles;
+            event = now_cycles;
+            if(predicted) {
+                const int32_t late = static_cast<int32_t>(now_cycles - expected);
+                if(late >= 0) event = expected;
+                add(latency, late > 0 ? late / cpu : 0);
+            }
+        }
+
+        /**
+         * Refill interrupt exit.
+         * @param next_event_us time from this refill event to the next one.
+         * @param slack_us how long after the event refill may take before it's an overrun, 0 if it can't overrun.
+         */
+        void refill_end(uint32_t now_cycles, uint32_t next_event_us, uint32_t slack_us) {
+            add(refill, (now_cycles - entry) / cpu);
+            const uint32_t since_event = (now_cycles - event) / cpu;
+            if(slack_us > 0 && since_event > slack_us) {
+                overruns.inc();
+                add(gap, since_event - slack_us);
+                predicted = false;
+                return;
+            }
+            add(gap, 0);
+            expected = event + next_event_us * cpu;
+            predicted = true;
+        }
+
+        /** For generators that refill from a task: refill took from `start_cycles` to `end_cycles`. */
+        void refill_done(uint32_t start_cycles, uint32_t end_cycles) {
+            add(refill, (end_cycles - start_cycles) / cpu);
+        }
+
+        /** For generators that refill from a task: line was idle for `us` before this packet, 0 if none. */
+        void packet_gap(uint32_t us) {
+            if(us > 0) overruns.inc();
+            add(gap, us);
+        }
+
+        Stats stats() const {
+            return Stats{snapshot(latency), snapshot(refill), snapshot(gap), overruns.get()};
+        }
+
+    private:
+        struct Counters {
+            etl::array<StatCounter, TimingHistogram::N_BUCKETS> buckets;
+            StatCounter max;
+        };
+        Counters latency, refill, gap;
+        StatCounter overruns;
+
+        uint32_t cpu{1};
+        uint32_t entry{0};
+        uint32_t event{0};
+        uint32_t expected{0};
+        bool predicted{false};
+
+        static void add(Counters &c, uint32_t us) {
+            c.buckets[TimingHistogram::bucket_of(us)].inc();
+            c.max.update_max(us);
+        }
+
+        static TimingHistogram snapshot(const Counters &c) {
+            TimingHistogram h{};
+            for(size_t b=0; b<TimingHistogram::N_BUCKETS; b++) h.buckets[b] = c.buckets[b].get();
+            h.max_us = c.max.get();
+            return h;
+        }
+    };
+
+    template<>
+    class BasicWaveformTiming<false> {
+    public:
+        static constexpr bool ENABLED = false;
+        using Stats = BasicWaveformTiming<true>::Stats;
+
+        void begin(uint32_t) {}
+        void refill_begin(uint32_t) {}
+        void refill_end(uint32_t, uint32_t, uint32_t) {}
+        void refill_done(uint32_t, uint32_t) {}
+        void packet_gap(uint32_t) {}
+        Stats stats() const { return Stats{}; }
+    };
+
+    using WaveformTiming = BasicWaveformTiming<DCC_WAVEFORM_TIMING != 0>;
+
+    /** Duration of RMT symbols in ticks (us with 1MHz RMT clock). */
+    template<typename Item>
+    uint32_t symbols_duration(const Item *items, size_t n) {
+        uint32_t d = 0;
+        for(size_t i=0; i<n; i++) d += (items[i].val & 0x7FFF) + (items[i].val >> 16 & 0x7FFF);
+        return d;
+    }
+
+}
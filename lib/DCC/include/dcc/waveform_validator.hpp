@@ -0,0 +1,225 @@
+#pragma once
+
+#include "packet.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include <etl/vector.h>
+
+namespace dcc {
+
+    /** One half of a DCC bit on track: polarity `level` held for `duration_us`, or a RailCom cutout. */
+    struct HalfBit {
+        uint64_t start_us;
+        uint32_t duration_us;
+        bool level;
+        bool cutout{false}; ///< track is not driven
+    };
+
+    /**
+     * Decodes a half-bit timeline back into packets and checks it against what NMRA requires
+     *   from a command station.
+     *
+     * Timing (S-9.1): "1" halves 55..61us and differing by no more than 3us,
+     *   "0" halves 95..9900us with whole bit no longer than 12000us,
+     *   consecutive halves have opposite polarity.
+     * Framing (S-9.2): at least 14 preamble bits, packet start bit "0", data bytes separated by "0",
+     *   packet end bit "1", at least 3 bytes including error detection byte, which must be XOR of other bytes.
+     *   Packets longer than this library can produce (MAX_PACKET_LEN plus error detection byte) are rejected.
+     * RailCom cutout (S-9.3.2): must follow packet end bit, starting 26..32us and ending 454..488us after it.
+     *   Track is driven with next bit's level before the cutout starts.
+     *
+     * Meant for host tests, so it uses std::vector.
+     */
+    class WaveformValidator {
+    public:
+        static constexpr uint32_t ONE_HALF_MIN_US = 55;
+        static constexpr uint32_t ONE_HALF_MAX_US = 61;
+        static constexpr uint32_t ONE_HALVES_MAX_DIFF_US = 3;
+        static constexpr uint32_t ZERO_HALF_MIN_US = 95;
+        static constexpr uint32_t ZERO_HALF_MAX_US = 9900;
+        static constexpr uint32_t ZERO_BIT_MAX_US = 12000;
+        static constexpr size_t MIN_PREAMBLE_BITS = 14;
+        /** Decoders must accept packets after this many preamble bits, fewer is treated as noise. */
+        static constexpr size_t DECODER_PREAMBLE_BITS = 10;
+        static constexpr size_t MIN_PACKET_BYTES = 3;
+        static constexpr uint32_t CUTOUT_START_MIN_US = 26;
+        static constexpr uint32_t CUTOUT_START_MAX_US = 32;
+        static constexpr uint32_t CUTOUT_END_MIN_US = 454;
+        static constexpr uint32_t CUTOUT_END_MAX_US = 488;
+
+        struct Decoded {
+            uint64_t start_us;      ///< start of packet start bit
+            uint64_t end_us;        ///< end of packet end bit, this is when decoders act on it
+            size_t preamble_bits;
+            Packet packet;          ///< without error detection byte
+        };
+
+        struct Errors {
+            size_t timing;      ///< bit durations or polarity out of spec
+            size_t preamble;    ///< packets with too short preamble (still decoded)
+            size_t framing;     ///< packets longer than allowed
+            size_t length;      ///< packets shorter than allowed
+            size_t checksum;    ///< error detection byte mismatch
+            size_t cutout;      ///< RailCom cutouts out of place
+            size_t total() const { return timing + preamble + framing + length + checksum + cutout; }
+        };
+
+        void feed(const HalfBit &h) {
+            if(h.cutout) {
+                on_cutout(h);
+                return;
+            }
+            if(!has_half) {
+                first = h;
+                has_half = true;
+                return;
+            }
+            if(first.level == h.level) {
+                // polarity did not change, halves can't be paired
+                errors.timing++;
+                resync(h);
+                return;
+            }
+            const uint32_t d0 = first.duration_us, d1 = h.duration_us;
+            const uint64_t start = first.start_us;
+            if(is_one_half(d0) && is_one_half(d1) && diff(d0, d1) <= ONE_HALVES_MAX_DIFF_US) {
+                has_half = false;
+                on_bit(true, start, start + d0 + d1);
+            } else if(is_zero_half(d0) && is_zero_half(d1) && d0 + d1 <= ZERO_BIT_MAX_US) {
+                has_half = false;
+                on_bit(false, start, start + d0 + d1);
+            } else {
+                errors.timing++;
+                resync(h);
+            }
+        }
+
+        template<typename It>
+        void feed(It begin, It end) {
+            for(; begin != end; ++begin) feed(*begin);
+        }
+
+        const std::vector<Decoded>& packets() const { return decoded; }
+        const Errors& get_errors() const { return errors; }
+        size_t bits() const { return n_bits; }
+        size_t cutouts() const { return n_cutouts; }
+
+    private:
+        enum class State { Preamble, Data };
+
+        HalfBit first{};
+        bool has_half{false};
+
+        State state{State::Preamble};
+        size_t ones{0};
+        uint64_t packet_start{0};
+        size_t preamble{0};
+        uint8_t cur_byte{0};
+        size_t byte_bits{0};
+        etl::vector<uint8_t, MAX_PACKET_LEN + 1> bytes;
+
+        std::vector<Decoded> decoded;
+        Errors errors{};
+        size_t n_bits{0};
+        size_t n_cutouts{0};
+        bool after_end_bit{false};  ///< nothing but a cutout lead-in was seen since packet end bit
+        uint64_t end_bit_us{0};
+
+        static bool is_one_half(uint32_t d) { return d >= ONE_HALF_MIN_US && d <= ONE_HALF_MAX_US; }
+        static bool is_zero_half(uint32_t d) { return d >= ZERO_HALF_MIN_US && d <= ZERO_HALF_MAX_US; }
+        static uint32_t diff(uint32_t a, uint32_t b) { return a > b ? a - b : b - a; }
+
+        /** Cutout start is the end of its lead-in half (if any), both ends are checked against packet end bit. */
+        void on_cutout(const HalfBit &h) {
+            n_cutouts++;
+            const bool lead_in = has_half && first.start_us + first.duration_us == h.start_us;
+            const uint64_t lead_start = lead_in ? first.start_us : h.start_us;
+            const uint64_t start = h.start_us - end_bit_us, end = start + h.duration_us;
+            if(!after_end_bit || lead_start != end_bit_us
+                || start < CUTOUT_START_MIN_US || start > CUTOUT_START_MAX_US
+                || end < CUTOUT_END_MIN_US || end > CUTOUT_END_MAX_US) {
+                errors.cutout++;
+            }
+            has_half = false;
+            after_end_bit = false;
+            state = State::Preamble;
+            ones = 0;
+        }
+
+        /** Drops the unpaired half and starts looking for a preamble again. */
+        void resync(const HalfBit &h) {
+            first = h;
+            has_half = true;
+            state = State::Preamble;
+            ones = 0;
+        }
+
+        void on_bit(bool bit, uint64_t start, uint64_t end) {
+            n_bits++;
+            after_end_bit = false;
+            switch(state) {
+                case State::Preamble:
+                    if(bit) {
+                        ones++;
+                    } else if(ones >= DECODER_PREAMBLE_BITS) {
+                        if(ones < MIN_PREAMBLE_BITS) errors.preamble++;
+                        state = State::Data;
+                        preamble = ones;
+                        packet_start = start;
+                        bytes.clear();
+                        cur_byte = 0;
+                        byte_bits = 0;
+                    } else {
+                        ones = 0;
+                    }
+                    break;
+
+                case State::Data:
+                    if(byte_bits < 8) {
+                        cur_byte = cur_byte << 1 | (bit ? 1 : 0);
+                        byte_bits++;
+                        if(byte_bits == 8) bytes.push_back(cur_byte);
+                        break;
+                    }
+                    // separator after a byte: "0" - next byte follows, "1" - packet end bit
+                    if(!bit) {
+                        if(bytes.full()) {
+                            errors.framing++;
+                            state = State::Preamble;
+                            ones = 0;
+                            break;
+                        }
+                        cur_byte = 0;
+                        byte_bits = 0;
+                        break;
+                    }
+                    finish_packet(end);
+                    after_end_bit = true;
+                    end_bit_us = end;
+                    state = State::Preamble;
+                    ones = 0; // end bit is not counted towards next preamble
+                    break;
+            }
+        }
+
+        void finish_packet(uint64_t end) {
+            if(bytes.size() < MIN_PACKET_BYTES) {
+                errors.length++;
+                return;
+            }
+            uint8_t x = 0;
+            for(uint8_t b: bytes) x ^= b;
+            if(x != 0) {
+                errors.checksum++;
+                return;
+            }
+            Decoded d{packet_start, end, preamble, {}};
+            d.packet.assign(bytes.begin(), bytes.end() - 1);
+            decoded.push_back(d);
+        }
+    };
+
+}
@@ -64,6 +64,7 @@ typedef struct {
     portMUX_TYPE rmt_spinlock; // Mutex lock for protecting concurrent register/unregister of RMT channels' ISR
     rmt_isr_handle_t rmt_driver_intr_handle;
     rmt_tx_end_callback_t rmt_tx_end_callback;// Event called when transmission is ended
+    rmt_tx_end_callback_t rmt_tx_thr_callback;// Event called on Tx threshold of a channel the driver doesn't feed
     uint8_t rmt_driver_channels; // Bitmask of installed drivers' channels, used to protect concurrent register/unregister of RMT channels' ISR
     bool rmt_module_enabled;
     uint32_t synchro_channel_mask; // Bitmap of channels already added in the synchronous group
@@ -104,6 +105,9 @@ static rmt_contex_t rmt_contex = {
     .rmt_tx_end_callback = {
         .function = NULL,
     },
+    .rmt_tx_thr_callback = {
+        .function = NULL,
+    },
     .rmt_driver_channels = 0,
     .rmt_module_enabled = false,
     .synchro_channel_mask = 0
@@ -749,7 +753,10 @@ static void IRAM_ATTR rmt_driver_isr_default(void *arg)
         channel = __builtin_ffs(status) - 1;
         status &= ~(1 << channel);
         rmt_obj_t *p_rmt = p_rmt_obj[channel];
-        if (p_rmt) {
+        if (p_rmt && p_rmt->tx_data == NULL && !p_rmt->translator && rmt_contex.rmt_tx_thr_callback.function) {
+            // memory was filled by the user (rmt_fill_tx_items), the user refills it
+            rmt_contex.rmt_tx_thr_callback.function(channel, rmt_contex.rmt_tx_thr_callback.arg);
+        } else if (p_rmt) {
             if (p_rmt->translator) {
                 if (p_rmt->sample_size_remain > 0) {
                     size_t translated_size = 0;
@@ -1174,6 +1181,14 @@ rmt_tx_end_callback_t rmt_register_tx_end_callback(rmt_tx_end_fn_t function, voi
     return previous;
 }
 
+rmt_tx_end_callback_t rmt_register_tx_thr_callback(rmt_tx_end_fn_t function, void *arg)
+{
+    rmt_tx_end_callback_t previous = rmt_contex.rmt_tx_thr_callback;
+    rmt_contex.rmt_tx_thr_callback.function = function;
+    rmt_contex.rmt_tx_thr_callback.arg = arg;
+    return previous;
+}
+
 esp_err_t rmt_translator_init(rmt_channel_t channel, sample_to_rmt_t fn)
 {
     ESP_RETURN_ON_FALSE(fn, ESP_ERR_INVALID_ARG, TAG, RMT_TRANSLATOR_NULL_STR);
@@ -667,6 +667,24 @@ esp_err_t rmt_write_sample(rmt_channel_t channel, const uint8_t *src, size_t src
 */
 rmt_tx_end_callback_t rmt_register_tx_end_callback(rmt_tx_end_fn_t function, void *arg);
 
+/**
+* @brief Registers a callback that will be called on Tx threshold event of a channel
+*        whose memory is filled by the user with rmt_fill_tx_items (not by rmt_write_items / rmt_write_sample).
+*
+*        Called by rmt_driver_isr_default in interrupt context. Together with wrap mode
+*        (enabled by rmt_config for Tx channels) and rmt_set_tx_thr_intr_en this allows
+*        endless ping-pong transmission: the callback refills the half of memory that has just been sent.
+*        Without this callback, the driver would put an end marker there.
+*
+* @note Requires rmt_driver_install to install the default ISR handler.
+*
+* @param function Function to be called from the default interrupt handler or NULL.
+* @param arg Argument which will be provided to the callback when it is called.
+*
+* @return the previous callback settings (members will be set to NULL if there was none)
+*/
+rmt_tx_end_callback_t rmt_register_tx_thr_callback(rmt_tx_end_fn_t function, void *arg);
+
 #if SOC_RMT_SUPPORT_RX_PINGPONG
 /**
 * @brief Set RMT RX threshold event interrupt enable
@@ -7,7 +7,10 @@
 
 
 #include "dcc/base_channel.hpp"
+#include "dcc/consist.hpp"
 #include "dcc/packet.hpp"
+#include "dcc/pom_queue.hpp"
+#include "dcc/prog_track.hpp"
 #include "dcc/LocoAddress.h"
 #include <LocoNet2.h>
 
@@ -15,6 +18,7 @@
 
 #include <etl/map.h>
 #include <etl/bitset.h>
+#include <etl/vector.h>
 
 
 #define CS_DEBUG
@@ -52,18 +56,21 @@ inline static uint8_t moveBit5to1(uint8_t dccByte) {
 class CommandStation {
 public:
 
-    static constexpr uint8_t N_FUNCTIONS = 29;
+    static constexpr uint8_t N_FUNCTIONS = dcc::FnState::N_FUNCTIONS;
 
     static constexpr uint8_t MAX_SLOTS = 10;
 
     static constexpr millis_t PURGE_DELAY = 200*1000; //200s
 
+    static constexpr uint8_t MAX_CONSISTS = 4;
+    static constexpr uint8_t MAX_CONSIST_MEMBERS = 4;
+
     CommandStation(): dccMain(nullptr), dccProg(nullptr), locoNet(nullptr) {
         loadTurnouts();
     }
 
-    void setDccMain(dcc::BaseChannel * ch) { dccMain = ch; }
-    void setDccProg(dcc::BaseChannel * ch) { dccProg = ch; }
+    void setDccMain(dcc::BaseChannel * ch) { dccMain = ch; pom.setChannel(ch); consists.setChannel(ch); }
+    void setDccProg(dcc::BaseChannel * ch) { dccProg = ch; prog.setChannel(ch); }
     void setLocoNetBus(LocoNetBus *bus) { locoNet = bus; }
 
     void setPowerState(bool v) {
@@ -76,6 +83,19 @@ public:
              : false;
     }
 
+    /**
+     * Layout-wide emergency stop: broadcast e-stop on main track, all slots get EMGR speed.
+     * Throttles learn about it through power observers (PowerEvent::Reason::EmergencyStop).
+     */
+    void emergencyStopAll() {
+        if(dccMain==nullptr) return;
+        CS_DEBUGF("Emergency stop all");
+        for(const auto &i: locoSlot) {
+            getSlot(i.second).speed = SPEED_EMGR;
+        }
+        dccMain->emergencyStop();
+    }
+
     const dcc::BaseChannel *getMainTrack() const { return dccMain; }
     const dcc::BaseChannel *getProgTrack() const { return dccProg; }
 
@@ -116,7 +136,7 @@ public:
     //const TurnoutData& getTurnout(uint16_t i) { return turnoutData[i]; }
 
     struct LocoData {
-        using Fns = etl::bitset<N_FUNCTIONS>;
+        using Fns = dcc::FnState;
         LocoAddress addr;
         //uint8_t speed128; ///< <0=stop, 1=emgr, 2..127 = speed 0..max
         LocoSpeed speed;
@@ -124,6 +144,8 @@ public:
         int8_t dir; ///< 1 = FWD, 0 = REW
         Fns fn;
         bool refreshing;
+        bool combined; ///< decoder supports combined speed/direction/functions instruction
+        uint8_t consist; ///< slot of advanced consist this loco is member of, 0 if none
         Watchdog<PURGE_DELAY, 500> wdt;
         bool allocated() const { return addr.isValid(); }
         void deallocate() { addr = LocoAddress(); }
@@ -165,6 +187,8 @@ public:
         _slot.dir = 1;
         _slot.fn = LocoData::Fns();
         _slot.refreshing = false;
+        _slot.combined = false;
+        _slot.consist = 0;
         _slot.speed = LocoSpeed{};
         _slot.speedMode = SpeedMode::S128;
         _slot.kickWatchdog();
@@ -184,6 +208,11 @@ public:
         if(slot==0) { CS_DEBUGF("invalid slot"); return; }
         uint8_t i = slot-1;
         CS_DEBUGF("releasing slot %d", slot);
+        if(consists.isConsist(slot)) {
+            releaseConsist(slot);
+            return;
+        }
+        if(getLocoConsist(slot) != 0) removeConsistMember(slot);
         setLocoSlotRefresh(slot, false);
         locoSlot.erase( slots[i].addr );
         slots[i].deallocate();
@@ -207,6 +236,7 @@ public:
         if(refresh) {
             // no need to load, it will load itself on setLocoSpeed/setLocoFn
             dd.kickWatchdog();
+            if(dd.combined && dd.consist == 0) dccMain->setCombinedInstruction(dd.addr, true);
         } else {
             // TODO: somehow send 0 speed to track
             dccMain->unloadSlot(dd.addr);
@@ -233,7 +263,7 @@ public:
         dd.kickWatchdog();
         if(dd.speedMode == mode) return;
         dd.speedMode = mode;
-        if(dd.refreshing)
+        if(dd.refreshing && dd.consist == 0)
             dccMain->sendThrottle(dd.addr, dd.speed, dd.speedMode, dd.dir > 0);
     }
 
@@ -241,60 +271,74 @@ public:
         return getSlot(slot).speedMode;
     }
 
+    /** Refresh speed and F0-F15 of this loco with one combined packet, for decoders that support it. */
+    void setLocoCombinedInstruction(uint8_t slot, bool v) {
+        LocoData &dd = getSlot(slot);
+        dd.kickWatchdog();
+        if(dd.combined == v) return;
+        dd.combined = v;
+        if(dd.refreshing)
+            dccMain->setCombinedInstruction(dd.addr, v);
+    }
+
+    bool getLocoCombinedInstruction(uint8_t slot) {
+        return getSlot(slot).combined;
+    }
+
     /** Changes one function. */
     void setLocoFn(uint8_t slot, uint8_t fn, bool val) {
+        if(fn >= N_FUNCTIONS) { CS_DEBUGF("invalid function %d", fn); return; }
         LocoData &dd = getSlot(slot);
         dd.kickWatchdog();
-        if(dd.fn[fn] == val) return;
+        if(dd.fn.get(fn) == val) return;
         // CS_DEBUGF("slot %d FN%d=%d", slot, fn, val);
 
-        dd.fn[fn] = val;
-        using dcc::fn_group;
-        fn_group fg = dcc::fn_to_group(fn);
-        uint32_t ifn = dd.fn.value<uint32_t>();
-
-        dccMain->sendFunctionGroup(dd.addr, fg, ifn);
+        dd.fn.set(fn, val);
+        dccMain->sendFunctionGroup(dd.addr, dcc::fn_to_group(fn), dd.fn);
     }
 
-    /** Changes bits of DCC function group. */
-    void setLocoFns(uint8_t slot, dcc::fn_group fg, uint32_t vals) {
+    /**
+     * Changes bits of DCC function group.
+     * @param vals function states, bit N is FN (only bits of the group are used).
+     */
+    void setLocoFns(uint8_t slot, dcc::fn_group fg, const dcc::FnState &vals) {
         LocoData &dd = getSlot(slot);
         dd.kickWatchdog();
-        uint32_t current = dd.fn.value<uint32_t>();
-        uint32_t mask = dcc::fn_group_mask(fg);
-        vals = (current & ~mask) | (vals & mask);
-        if(vals == current) return;
-        // CS_DEBUGF("slot %d FN G%d = %d", slot, (int)fg, vals);
+        const uint32_t v = vals.group(fg);
+        if(dd.fn.group(fg) == v) return;
+        // CS_DEBUGF("slot %d FN G%d = %d", slot, (int)fg, v);
 
-        dccMain->sendFunctionGroup(dd.addr, fg, vals);
-        dd.fn = LocoData::Fns( vals );
+        dd.fn.set_group(fg, v);
+        dccMain->sendFunctionGroup(dd.addr, fg, dd.fn);
     }
 
-    /** Changes bits across multiple function groups. */
-    void setLocoFns(uint8_t slot, uint32_t mask, uint32_t vals ) {
+    /** Changes bits across multiple function groups, only groups with changed bits are sent. */
+    void setLocoFns(uint8_t slot, const dcc::FnState &mask, const dcc::FnState &vals) {
         LocoData &dd = getSlot(slot);
         dd.kickWatchdog();
-        vals = vals & mask; // only take bits in mask, ignore others
-        uint32_t current = dd.fn.value<uint32_t>();
-        vals = (current & ~mask) | vals; // updated value for all bits
-        uint32_t changed = current ^ vals;
 
         for(size_t g=0; g<dcc::FN_NUMBER; g++) {
             dcc::fn_group fg = static_cast<dcc::fn_group>(g);
-            uint32_t gm = dcc::fn_group_mask(fg);
-            // if required mask intersects function group mask
-            //  and these bits differ from current value,
-            // update bits (v=) and send function group
-            if((mask & gm) != 0 && (changed & gm) != 0) {
-                dccMain->sendFunctionGroup(dd.addr, fg, vals);
+            const uint32_t gm = mask.group(fg);
+            const uint32_t current = dd.fn.group(fg);
+            // take bits of this group that are in mask, keep others
+            const uint32_t v = (current & ~gm) | (vals.group(fg) & gm);
+            if(v != current) {
+                dd.fn.set_group(fg, v);
+                dccMain->sendFunctionGroup(dd.addr, fg, dd.fn);
             }
         }
-
-        dd.fn = LocoData::Fns( vals );
     }
 
     bool getLocoFn(uint8_t slot, uint8_t fn) {
-        return  getSlot(slot).fn[fn] != 0;
+        return getSlot(slot).fn.get(fn);
+    }
+
+    /** Binary states (1-32767, 0 means all) are not stored, only sent to the decoder. */
+    void setLocoBinaryState(uint8_t slot, uint16_t state, bool on) {
+        LocoData &dd = getSlot(slot);
+        dd.kickWatchdog();
+        dccMain->sendBinaryState(dd.addr, state, on);
     }
 
     /**
@@ -306,7 +350,7 @@ public:
         dd.kickWatchdog();
         if(dd.dir==dir) return;
         dd.dir = dir;
-        if(dd.refreshing)
+        if(dd.refreshing && dd.consist == 0)
             dccMain->sendThrottle(dd.addr, dd.speed, dd.speedMode, dd.dir);
     }
 
@@ -318,6 +362,8 @@ public:
      * Updates slots that have not been used for a long time (PURGE_DELAY)
      */
     void loop() {
+        prog.loop(millis());
+        pom.loop();
         for(const auto &i: locoSlot) {
             uint8_t slot = i.second;
             LocoData &dd = getSlot(slot);
@@ -335,7 +381,7 @@ public:
         dd.kickWatchdog();
         if(dd.speed == spd) return;
         dd.speed = spd;
-        if(dd.refreshing)
+        if(dd.refreshing && dd.consist == 0)
             dccMain->sendThrottle(dd.addr, dd.speed, dd.speedMode, dd.dir);
     }
 
@@ -352,35 +398,133 @@ public:
         return getLocoSpeed(slot).getFloat();
     }
 
-    int16_t readCVProg(uint16_t cv) {
-        //IDCCChannel *dccProg = dccMain;
-        if(dccProg==nullptr) return -2;
-        return dccProg->readCVProg(cv);
+    /**
+     * Advanced consists, see dcc::ConsistTable: a consist is driven through its own slot with short consist address,
+     *   so a speed change reaches all members with one packet.
+     * Speed and direction of member slots are kept, but not sent while they are in consist.
+     */
+    using Consists = dcc::ConsistTable<MAX_CONSISTS, MAX_CONSIST_MEMBERS>;
+    using ConsistMember = Consists::Member;
+    using ConsistMembers = Consists::Members;
+
+    /**
+     * Allocates a slot for a consist with short address 1-127 (usually not used by any loco).
+     * @return consist slot, 0 if address is invalid or used, or there are no free slots.
+     */
+    uint8_t createConsist(uint8_t consistAddr) {
+        const LocoAddress addr = LocoAddress::shortAddr(consistAddr);
+        if(consistAddr == 0 || consistAddr > 127) { CS_DEBUGF("invalid consist address %d", consistAddr); return 0; }
+        if(consists.full() || isLocoAllocated(addr)) { CS_DEBUGF("can't create consist %d", consistAddr); return 0; }
+        const uint8_t slot = findOrAllocateLocoSlot(addr);
+        if(slot == 0) return 0;
+        CS_DEBUGF("consist %d in slot %d", consistAddr, slot);
+        consists.create(slot, consistAddr);
+        return slot;
+    }
+
+    /** Adds a loco to consist: programs its CV19 on main and stops refreshing its own speed (but not functions). */
+    bool addConsistMember(uint8_t consistSlot, uint8_t slot, bool reversed) {
+        if(!consists.isConsist(consistSlot)) { CS_DEBUGF("slot %d is not a consist", consistSlot); return false; }
+        if(!isSlotAllocated(slot) || consists.isConsist(slot)) { CS_DEBUGF("invalid member slot %d", slot); return false; }
+        LocoData &dd = getSlot(slot);
+        if(dd.consist != 0) removeConsistMember(slot);
+        if(!consists.add(consistSlot, slot, dd.addr, reversed)) { CS_DEBUGF("consist %d is full", consistSlot); return false; }
+        dd.consist = consistSlot;
+        return true;
     }
-    bool verifyCVProg(uint16_t cv, uint8_t val) {
-        //IDCCChannel *dccProg = dccMain;
-        if(dccProg==nullptr) return false;
-        return dccProg->verifyCVByteProg(cv, val);
+
+    /** Clears CV19 of the loco, it's stopped and gets its own speed refreshed again. */
+    void removeConsistMember(uint8_t slot) {
+        LocoData &dd = getSlot(slot);
+        if(consists.remove(slot) == 0) return;
+        dd.consist = 0;
+        dd.speed = LocoSpeed{};
+        if(dccMain==nullptr || !dd.refreshing) return;
+        dccMain->sendThrottle(dd.addr, dd.speed, dd.speedMode, dd.dir);
+        if(dd.combined) dccMain->setCombinedInstruction(dd.addr, true);
     }
-    bool writeCvProg(uint16_t cv, uint8_t val) {
-        //IDCCChannel *dccProg = dccMain;
-        if(dccProg ==nullptr) return false;
-        return dccProg->writeCVByteProg(cv, val);
+
+    /** Teardown: removes all members and releases consist slot. */
+    void releaseConsist(uint8_t consistSlot) {
+        const ConsistMembers *m = consists.members(consistSlot);
+        if(m == nullptr) return;
+        while(!m->empty()) removeConsistMember(m->back().slot);
+        consists.release(consistSlot);
+        releaseLocoSlot(consistSlot);
     }
-    bool writeCvProgBit(uint16_t cv, uint8_t bit, bool val) {
-        //IDCCChannel *dccProg = dccMain;
-        if(dccProg ==nullptr) return false;
-        return dccProg->writeCVBitProg(cv, bit, val);
+
+    const ConsistMembers *getConsistMembers(uint8_t consistSlot) const {
+        return consists.members(consistSlot);
     }
-    void writeCvMain(LocoAddress addr, uint16_t cv, uint8_t val) {
-        if(dccMain==nullptr) return;
-        dccMain->writeCVByteMain(addr, cv, val);
+
+    /** @return slot of consist the loco is member of, 0 if none */
+    uint8_t getLocoConsist(uint8_t slot) {
+        return getSlot(slot).consist;
     }
-    void writeCvMainBit(LocoAddress addr, uint16_t cv, uint8_t bit, bool val) {
-        if(dccMain==nullptr) return;
-        dccMain->writeCVBitMain(addr, cv, bit, val?1:0);
+
+    /**
+     * Service mode jobs on programming track, they run in loop() and report with `cb`, see dcc::ProgTrack.
+     * @return false if there is no programming track or its job queue is full.
+     */
+    bool readCVProg(uint16_t cv, dcc::ProgTrack::Callback cb, void *ctx) {
+        return prog.readByte(cv, cb, ctx);
+    }
+    bool verifyCVProg(uint16_t cv, uint8_t val, dcc::ProgTrack::Callback cb, void *ctx) {
+        return prog.verifyByte(cv, val, cb, ctx);
+    }
+    bool writeCvProg(uint16_t cv, uint8_t val, dcc::ProgTrack::Callback cb, void *ctx) {
+        return prog.writeByte(cv, val, cb, ctx);
+    }
+    bool writeCvProgBit(uint16_t cv, uint8_t bit, bool val, dcc::ProgTrack::Callback cb, void *ctx) {
+        return prog.writeBit(cv, bit, val, cb, ctx);
+    }
+    /** Reads CVs `first` to `last` of decoder on programming track, `cb` is called for each of them. */
+    bool readDecoderProg(uint16_t first, uint16_t last, dcc::ProgTrack::Callback cb, void *ctx) {
+        return prog.readDecoder(first, last, cb, ctx);
     }
 
+    /** Where CVs of decoders read on programming track are kept, call before any job. */
+    void setCvStorage(dcc::CvStorage *s) { prog.cvCache().setStorage(s); }
+
+    /** See dcc::ProgTrack::setVerifyCachedReads(). */
+    void setVerifyCachedReads(bool v) { prog.setVerifyCachedReads(v); }
+    /**
+     * Ops mode writes, they are queued and go to track in loop(), `cb` is called when they are sent, see dcc::PomQueue.
+     * @return false if there is no main track or POM queue is full.
+     */
+    bool writeCvMain(LocoAddress addr, uint16_t cv, uint8_t val, dcc::PomQueue::Callback cb = nullptr, void *ctx = nullptr) {
+        return pom.writeByte(addr, cv, val, cb, ctx);
+    }
+    bool writeCvMainBit(LocoAddress addr, uint16_t cv, uint8_t bit, bool val, dcc::PomQueue::Callback cb = nullptr, void *ctx = nullptr) {
+        return pom.writeBit(addr, cv, bit, val, cb, ctx);
+    }
+
+    /* Signals driven by extended accessory decoders, keyed by 11-bit accessory address */
+    static constexpr int MAX_SIGNALS = 64;
+    using SignalMap = etl::map<uint16_t, uint8_t, MAX_SIGNALS>; ///< address -> current aspect
+
+    /** Sets signal aspect, only changes are sent to track. */
+    void setSignalAspect(uint16_t addr11, uint8_t aspect) {
+        auto s = signalAspects.find(addr11);
+        if(s != signalAspects.end()) {
+            if(s->second == aspect) return;
+            s->second = aspect;
+        } else if(!signalAspects.full()) {
+            signalAspects[addr11] = aspect;
+        } else {
+            CS_DEBUGF("Signal table is full, signal %d is not stored", addr11);
+        }
+        if(dccMain!=nullptr) dccMain->sendSignalAspect(addr11, aspect);
+    }
+
+    /** @return current aspect, or -1 if aspect of signal was never set */
+    int16_t getSignalAspect(uint16_t addr11) const {
+        auto s = signalAspects.find(addr11);
+        return s != signalAspects.end() ? s->second : -1;
+    }
+
+    const SignalMap& getSignals() const { return signalAspects; }
+
     const TurnoutMap& getTurnouts() {
         return turnoutData;
     }
@@ -454,10 +598,16 @@ public:
 private:
     dcc::BaseChannel * dccMain;
     dcc::BaseChannel * dccProg;
+    dcc::ProgTrack prog;
+    dcc::PomQueue pom;
     LocoNetBus* locoNet;
 
     etl::map<LocoAddress, uint8_t, MAX_SLOTS> locoSlot;
 
+    SignalMap signalAspects;
+
+    Consists consists;
+
     LocoData slots[MAX_SLOTS]; ///< slot 1 has index 0 in this array. Slot 0 is invalid.
     inline LocoData & getSlot(uint8_t slot) { return slots[slot-1]; }
 
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <dcc/cv_cache.hpp>
+
+#include <etl/array.h>
+
+#include <Preferences.h>
+
+#include <stdio.h>
+
+/**
+ * Decoder CVs in NVS flash, a blob per decoder keyed by its dcc::DecoderId.
+ */
+class NvsCvStorage: public dcc::CvStorage {
+public:
+    bool begin() {
+        ready = prefs.begin(NAMESPACE, false);
+        if(!ready) DCC_LOGW("Can't open NVS namespace %s", NAMESPACE);
+        return ready;
+    }
+
+    bool load(const dcc::DecoderId &id, dcc::DecoderCvs &cvs) override {
+        if(!ready) return false;
+        char key[9];
+        makeKey(id, key);
+        const size_t len = prefs.getBytesLength(key);
+        if(len == 0 || len > buf.size()) return false;
+        prefs.getBytes(key, buf.data(), len);
+        unpack(etl::span<const uint8_t>{buf.data(), len}, cvs);
+        return true;
+    }
+
+    bool save(const dcc::DecoderId &id, const dcc::DecoderCvs &cvs) override {
+        if(!ready) return false;
+        char key[9];
+        makeKey(id, key);
+        const size_t len = pack(cvs, etl::span<uint8_t>{buf});
+        return prefs.putBytes(key, buf.data(), len) == len;
+    }
+
+private:
+    static constexpr const char *NAMESPACE = "cvcache";
+
+    Preferences prefs;
+    bool ready{false};
+    etl::array<uint8_t, dcc::MAX_DECODER_CVS * PACKED_SIZE> buf;
+
+    /** NVS keys are up to 15 characters. */
+    static void makeKey(const dcc::DecoderId &id, char *key) {
+        snprintf(key, 9, "%08x", (unsigned)id.key());
+    }
+};
@@ -75,7 +75,7 @@ inline uint8_t trkByte() {
             sd.id2 = 0;
         } else {
             const CommandStation::LocoData &d = CS.getSlotData(slot);
-            uint32_t fns = d.fn.value<uint32_t>();
+            uint32_t fns = d.fn.bits(0, 32);
             sd.stat = speedMode2int(d.speedMode) | STAT1_SL_BUSY;
             if(d.refreshing) sd.stat |= STAT1_SL_ACTIVE;
             sd.adr = addrLo(d.addr);
@@ -107,6 +107,9 @@ inline uint8_t trkByte() {
             case OPC_GPOFF:
                 CS.setPowerState(false);
                 break;
+            case OPC_IDLE:
+                CS.emergencyStopAll();
+                break;
             case OPC_LOCO_ADR: {
                 int slot = locateSlot( msg->la.adr_hi,  msg->la.adr_lo );
                 if(slot<=0) {
@@ -312,26 +315,51 @@ void LocoNetSlotManager::sendProgData(progTaskMsg ret, uint8_t pstat, uint8_t va
     _ln->broadcast(msg, this);
 }
 
+bool LocoNetSlotManager::startProgTask(const progTaskMsg &msg) {
+    if(progPending.exchange(true)) {
+        LOGI("Programmer is busy");
+        sendLack(PROG_LACK, 0); // busy, task aborted
+        return false;
+    }
+    progMsg = msg;
+    return true;
+}
+
+void LocoNetSlotManager::progDone(const dcc::ProgTrack::Result &r, void *ctx) {
+    auto *self = static_cast<LocoNetSlotManager*>(ctx);
+    const bool write = r.op == dcc::ProgTrack::Op::WriteByte || r.op == dcc::ProgTrack::Op::WriteBit;
+    const uint8_t pstat = r.ok ? 0 : (write ? PSTAT_WRITE_FAIL : PSTAT_READ_FAIL);
+    self->sendProgData(self->progMsg, pstat, r.ok ? r.value : 0);
+    self->progPending = false;
+}
+
 void LocoNetSlotManager::processProgMsg(const progTaskMsg &msg) {
     uint16_t cv = PROG_CV_NUM(msg)+1;
     uint8_t mode = PCMD_MODE_MASK & msg.pcmd;
     uint8_t val = PROG_DATA(msg);
     uint16_t addr = (msg.hopsa&0x7F)<<7 | (msg.lopsa & 0x7F);
     bool read = (msg.pcmd & PCMD_RW)==0;
+    // service mode jobs run in CS.loop(), reply is sent from progDone()
+    auto submitted = [&](bool ok) {
+        if(ok) {
+            sendLack(PROG_LACK, 1); // ack ok
+        } else {
+            progPending = false;
+            sendLack(PROG_LACK, 0); // no programming track, or its queue is full
+        }
+    };
     if(read) {
         switch(mode) {
             case DIR_BYTE_ON_SRVC_TRK: {
                 LOGI("Read byte on prog CV%d", cv);
-                sendLack(PROG_LACK, 1); // ack ok
-                int16_t ret = CS.readCVProg(cv);
-                sendProgData(msg, (ret>=0) ? 0 : PSTAT_READ_FAIL, ret>=0?ret:0);
+                if(!startProgTask(msg)) break;
+                submitted(CS.readCVProg(cv, progDone, this));
                 break;
             }
             case SRVC_TRK_RESERVED: {// make it a verify command.
                 LOGI("Verify byte on prog CV%d==%d", cv, val);
-                sendLack(PROG_LACK, 1); // ack ok
-                bool ret = CS.verifyCVProg(cv, val);
-                sendProgData(msg, ret?0:PSTAT_READ_FAIL, val);
+                if(!startProgTask(msg)) break;
+                submitted(CS.verifyCVProg(cv, val, progDone, this));
                 break;
             }
             default:
@@ -342,9 +370,8 @@ void LocoNetSlotManager::processProgMsg(const progTaskMsg &msg) {
         switch(mode) {
             case DIR_BYTE_ON_SRVC_TRK: {
                 LOGI("Write byte on prog CV%d=%d", cv, val);
-                sendLack(PROG_LACK, 1); // ack ok
-                bool ret = CS.writeCvProg(cv, val);
-                sendProgData(msg, ret?0:PSTAT_WRITE_FAIL, val);
+                if(!startProgTask(msg)) break;
+                submitted(CS.writeCvProg(cv, val, progDone, this));
                 break;
             }
             /*case DIR_BIT_ON_SRVC_TRK:
@@ -352,9 +379,12 @@ void LocoNetSlotManager::processProgMsg(const progTaskMsg &msg) {
                 bool ret = CS.writeCvProgBit(cv, 0, val);
                 break;*/
             case OPS_BYTE_NO_FEEDBACK:
-                LOGI("Read byte on prog CV%d", cv);
-                sendLack(PROG_LACK, 0x40); // ack ok, no reply will follow
-                CS.writeCvMain(lnAddr(addr), cv, val);
+                LOGI("Write byte on main, loco %d CV%d=%d", addr, cv, val);
+                if(CS.writeCvMain(lnAddr(addr), cv, val)) {
+                    sendLack(PROG_LACK, 0x40); // ack ok, no reply will follow
+                } else {
+                    sendLack(PROG_LACK, 0); // POM queue is full
+                }
                 break;
             /*case OPS_BIT_NO_FEEDBACK:
                 sendLack(0x7F, 0x40); // ack ok, no reply will follow
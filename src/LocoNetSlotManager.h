@@ -3,6 +3,7 @@
 #include <Arduino.h>
 #include <LocoNet2.h>
 #include <etl/map.h>
+#include <atomic>
 #include "CommandStation.h"
 #include "FastClock.hpp"
 
@@ -47,6 +48,9 @@ private:
     uint16_t clockSetterId{0}; ///< who set the clock. 0 means nobody has set it yet, 7F,7x means PC
     uint32_t clockSentTime{0};
 
+    progTaskMsg progMsg; ///< service mode request being run on programming track, answered in progDone()
+    std::atomic<bool> progPending{false};
+
     bool slotValid(uint8_t slot) {
         return (slot>=1) && (slot < CommandStation::MAX_SLOTS);
     }
@@ -74,6 +78,12 @@ private:
 
     void processProgMsg(const progTaskMsg &msg);
 
+    /** Accepts service mode request, or answers "busy" if another one is running. */
+    bool startProgTask(const progTaskMsg &msg);
+
+    /** Programming track job completion, sends reply to the request. */
+    static void progDone(const dcc::ProgTrack::Result &r, void *ctx);
+
     void fillSlotMsg(uint8_t slot, rwSlotDataMsg &msg);
 
     void processFastClockMsg(const fastClockMsg &msg);
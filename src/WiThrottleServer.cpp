@@ -380,6 +380,11 @@ void WiThrottleServer::ClientData::locoRelease(char th, LocoAddress addr) {
 
 
 void WiThrottleServer::ClientData::locosAction(char th, etl::string_view sLocoAddr, etl::string_view actionVal) {
+    if(actionVal[0]=='X') { // EMGR stop: one broadcast stops every loco, throttles get "V-1" via power observer
+        LOGI("emergency stop from thr=%c", th);
+        CS.emergencyStopAll();
+        return;
+    }
     if(sLocoAddr=="*") {
         for(const auto& slot: slots[th])
             locoAction(th, slot.first, actionVal);
@@ -434,9 +439,6 @@ void WiThrottleServer::ClientData::locoAction(char th, LocoAddress iLocoAddr, et
             //DEBUGS("Sending dir to addr "+String(dccLocoAddr) );
             CS.setLocoDir(slot, etl::to_arithmetic<uint8_t>(actionVal.substr(1)).value() );
             break;
-        case 'X': // EMGR stop
-            CS.setLocoSpeed(slot, SPEED_EMGR);
-            break;
         case 'I': // idle
             CS.setLocoSpeed(slot, SPEED_IDLE);
             break;
@@ -455,11 +457,7 @@ void WiThrottleServer::ClientData::checkHeartbeat() {
         // stop loco
         LOGI("timeout exceeded: current %ds, last updated at %ds",  millis()/1000, wdt.getLastUpdate()/1000 );
         health = ClientHealth::SoftTimeout;
-        for(const auto& throttle: slots)
-            for(const auto& slot: throttle.second) {
-                CS.setLocoSpeed(slot.second, SPEED_EMGR);
-                sendThrottleMsg(throttle.first, 'A', slot.first, "V-1" );
-            }
+        CS.emergencyStopAll(); // throttles get "V-1" through notifyEmergencyStop()
         sendMessage("Timeout exceeded, locos stopped");
     }
     if ((wdt.timedOut2() && health==ClientHealth::SoftTimeout)) {
@@ -470,6 +468,17 @@ void WiThrottleServer::ClientData::checkHeartbeat() {
 
 }
 
+void WiThrottleServer::notifyEmergencyStop() {
+    for(auto &p: clients) {
+        ClientData &cc = p.second;
+        for(const auto& throttle: cc.slots)
+            for(const auto& slot: throttle.second) {
+                cc.sendThrottleMsg(throttle.first, 'A', slot.first, "V-1");
+            }
+        cc.sendMessage("Emergency stop", true);
+    }
+}
+
 void WiThrottleServer::ClientData::sendMessage(String msg, bool alert) {
     wifiPrintln(cli, String("H")+(alert?'M':'m')+msg);
 }
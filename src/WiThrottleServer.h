@@ -54,9 +54,16 @@ public:
     }
 
     void notification(const dcc::PowerEvent &event) override {
+        if(event.reason == dcc::PowerEvent::Reason::EmergencyStop) {
+            notifyEmergencyStop();
+            return;
+        }
         notifyPowerStatus();
     }
 
+    /** Tells every throttle that its locos were stopped. */
+    void notifyEmergencyStop();
+
     void notifyPowerStatus(AsyncClient *c=nullptr) {
         bool v = CS.getPowerState();
         powerOn = v;
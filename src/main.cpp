@@ -7,6 +7,7 @@
 #include <dcc/esp32_current_meter.hpp>
 
 #include "CommandStation.h"
+#include "CvStorage.h"
 
 #include "LocoNetSlotManager.h"
 
@@ -48,6 +49,7 @@ LbServer lbServer(LBSERVER_DEFAULT_TCP_PORT, &bus);
 #define DCC_MAIN_PIN 25
 #define DCC_MAIN_PIN_EN 32
 #define DCC_MAIN_PIN_SENSE 36
+// #define DCC_MAIN_PIN_BRAKE 27 // RailCom cutout, goes to brake input of H-bridge (e.g. LMD18200)
 #define DCC_PROG_PIN 26
 #define DCC_PROG_PIN_EN 33
 #define DCC_PROG_PIN_SENSE 39
@@ -63,6 +65,8 @@ dcc::ESP32CurrentMeter currentMeter;
 
 LocoNetSlotManager slotMan(&bus);
 
+NvsCvStorage cvStorage;
+
 WiThrottleServer withrottleServer(WiThrottleServer::DEF_PORT, CS_FULL_NAME);
 
 #if USE_DISPLAY==1
@@ -176,12 +180,17 @@ void setup() {
 
     CS.setDccMain(&dccMain);
     CS.setDccProg(&dccProg);
+    cvStorage.begin();
+    CS.setCvStorage(&cvStorage);
     CS.setLocoNetBus(&bus);
 
     // dccTimer.setMainChannel(&dccMain);
     // dccTimer.setProgChannel(&dccProg);
     // dccTimer.begin();
 
+#ifdef DCC_MAIN_PIN_BRAKE
+    dccMain.setRailcomCutout(DCC_MAIN_PIN_BRAKE);
+#endif
     dccMain.begin();
     dccProg.begin();
     dccMain.setPower(true);
@@ -21,15 +21,17 @@ namespace ui {
             Locos,
             WiFi,
             LbServer,
-            WiThrottle
+            WiThrottle,
+            Dcc
         };
-        static constexpr size_t N_PAGES = 5;
+        static constexpr size_t N_PAGES = 6;
         ETL_DECLARE_ENUM_TYPE(StatusPage, uint8_t)
         ETL_ENUM_TYPE(Tracks, "Tracks")
         ETL_ENUM_TYPE(Locos, "Locos")
         ETL_ENUM_TYPE(WiFi,  "WiFi")
         ETL_ENUM_TYPE(LbServer,  "LnTCP")
         ETL_ENUM_TYPE(WiThrottle,  "WiThrottle")
+        ETL_ENUM_TYPE(Dcc,  "DCC")
         ETL_END_ENUM_TYPE
     };
 
@@ -49,6 +51,10 @@ namespace ui {
         }
 
         void loop() override {
+            if(cur_page == StatusPage::Dcc && millis()-dcc_sample_time >= DCC_SAMPLE_MS) {
+                sampleDccStats();
+                setDirty();
+            }
             if(millis()-last_page_change>4000) {
 
                 last_page_change = millis();
@@ -58,6 +64,8 @@ namespace ui {
                     if(nextPage==2 && USE_WIFI==0) continue;
                     if(nextPage==3 && (USE_WIFI==0 || lbServer==nullptr)) continue;
                     if(nextPage==4 && (USE_WIFI==0 || wtServer==nullptr)) continue;
+                    if(nextPage==5 && CS.getMainTrack()==nullptr) continue;
+                    if(nextPage==5) startDccSampling();
                     setPage(StatusPage{nextPage});
                     break;
                 }
@@ -70,6 +78,31 @@ namespace ui {
 
     protected:
 
+        /** Two snapshots of main track statistics, rates are computed from their difference. */
+        dcc::BaseChannel::TrackStats dcc_track_prev{}, dcc_track{};
+        dcc::BasePacketList::Stats dcc_packets_prev{}, dcc_packets{};
+        dcc::WaveformTiming::Stats dcc_timing{};
+        uint32_t dcc_sample_prev{0}, dcc_sample_time{0};
+        static constexpr uint32_t DCC_SAMPLE_MS = 1000;
+
+        /** First snapshot when DCC page is shown, rates are shown after the next one, see loop(). */
+        void startDccSampling() {
+            sampleDccStats();
+            dcc_sample_prev = 0;
+        }
+
+        void sampleDccStats() {
+            const dcc::BaseChannel *mainTrack = CS.getMainTrack();
+            if(mainTrack==nullptr) return;
+            dcc_track_prev = dcc_track;
+            dcc_packets_prev = dcc_packets;
+            dcc_sample_prev = dcc_sample_time;
+            dcc_track = mainTrack->getTrackStats();
+            dcc_packets = mainTrack->getPacketStats();
+            dcc_timing = mainTrack->getTimingStats();
+            dcc_sample_time = millis();
+        }
+
         void onShow() override { last_page_change = millis(); }
 
         void drawContents() override {
@@ -89,6 +122,7 @@ namespace ui {
             switch(cur_page) {
                 case StatusPage::Tracks: drawPowerPage(u8g2, x, y);  break;
                 case StatusPage::Locos: drawLocosPage(u8g2, x, y);  break;
+                case StatusPage::Dcc: drawDccPage(u8g2, x, y);  break;
             #if USE_WIFI==1
                 case StatusPage::WiFi: drawWiFiPage(u8g2, x, y);  break;
                 case StatusPage::LbServer: drawLbServerPage(u8g2, x, y); break;
@@ -214,6 +248,57 @@ namespace ui {
             }
         }
 
+        /**
+         * Packet rate and mix on main track over last second, and packet list health.
+         * Mix (Spd to Oth) is share of packets fetched from packet list, Idle and Rep are shares of transmissions.
+         */
+        void drawDccPage(U8G2 &u8g2, int x, int y) {
+            int dy = u8g2.getMaxCharHeight();
+            char v[40];
+
+            const uint32_t dt = dcc_sample_time - dcc_sample_prev;
+            const uint32_t n = dcc_track.packets - dcc_track_prev.packets;
+            // an interval far from DCC_SAMPLE_MS is not "last second": page was just shown or UI was stalled
+            if(dcc_sample_prev == 0 || dt < DCC_SAMPLE_MS / 2 || dt > DCC_SAMPLE_MS * 2 || n == 0) {
+                u8g2.drawStr(x, y, "Collecting...");
+                return;
+            }
+            const uint32_t bits = dcc_track.bits - dcc_track_prev.bits;
+            snprintf(v, sizeof(v), "%u pkt/s %u bit/s", (unsigned)(n * 1000 / dt), (unsigned)((uint64_t)bits * 1000 / dt));
+            u8g2.drawStr(x, y, v); y += dy;
+
+            // packet list counts fetches, a packet with repeats once; track counts every transmission
+            const auto &p = dcc_packets, &pp = dcc_packets_prev;
+            const uint32_t fetched = p.fetched() - pp.fetched();
+            auto pct = [](uint32_t d, uint32_t total) { return total == 0 ? 0u : (unsigned)(d * 100 / total); };
+            snprintf(v, sizeof(v), "Spd %u%% Fn %u%% Chg %u%%",
+                pct(p.speed_refresh - pp.speed_refresh, fetched),
+                pct(p.fn_refresh - pp.fn_refresh, fetched),
+                pct(p.queued_slot - pp.queued_slot, fetched));
+            u8g2.drawStr(x, y, v); y += dy;
+            snprintf(v, sizeof(v), "Acc %u%% Oth %u%% Idle %u%% Rep %u%%",
+                pct(p.queued_accessory - pp.queued_accessory, fetched),
+                pct(p.queued_generic - pp.queued_generic, fetched),
+                pct(dcc_track.idle - dcc_track_prev.idle, n),
+                pct(dcc_track.repeats - dcc_track_prev.repeats, n));
+            u8g2.drawStr(x, y, v); y += dy;
+
+            const auto &spd = p.refresh_interval[dcc::BasePacketList::REFRESH_SPEED_DIR];
+            snprintf(v, sizeof(v), "Q max %u, rej %u, spd max %u",
+                (unsigned)p.queue_high_water, (unsigned)p.put_rejected, (unsigned)spd.max);
+            u8g2.drawStr(x, y, v);
+
+            if constexpr(dcc::WaveformTiming::ENABLED) {
+                y += dy;
+                const auto &t = dcc_timing;
+                snprintf(v, sizeof(v), "Lat %u/%u Fill %u/%u Ovr %u",
+                    (unsigned)t.latency.percentile_us(99), (unsigned)t.latency.max_us,
+                    (unsigned)t.refill.percentile_us(99), (unsigned)t.refill.max_us,
+                    (unsigned)t.overruns);
+                u8g2.drawStr(x, y, v);
+            }
+        }
+
         void drawLocosPage(U8G2 &u8g2, unsigned x, unsigned y) {
             int dy = u8g2.getMaxCharHeight();
 
@@ -0,0 +1,211 @@
+#include "dcc/ack_detector.hpp"
+#include "dcc/current_samples.hpp"
+
+#include <unity.h>
+
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace dcc;
+
+static constexpr uint16_t BASE_MA = 20;
+
+/**
+ * Synthetic current trace sampled every 1ms: baseline current with uniform noise,
+ *   and pulses with linear rise and fall.
+ */
+struct Trace {
+    struct Pulse {
+        uint32_t start_us;
+        uint32_t width_us;  ///< at half amplitude
+        uint16_t mA;        ///< above baseline
+        uint32_t ramp_us;   ///< rise and fall time
+    };
+
+    std::vector<Pulse> pulses;
+    uint16_t noise_mA{0};
+    std::vector<uint32_t> dropouts; ///< times of single samples at baseline, e.g. ADC glitches
+
+    std::vector<CurrentSample> samples(uint32_t length_us, uint32_t seed = 1) const {
+        std::mt19937 rng{seed};
+        std::uniform_int_distribution<int> noise{-noise_mA, noise_mA};
+        std::vector<CurrentSample> out;
+        for(uint32_t t=0; t<length_us; t+=1000) {
+            int mA = BASE_MA;
+            for(const auto &p: pulses) mA += level(p, t);
+            for(auto d: dropouts) if(d == t) mA = BASE_MA;
+            mA += noise(rng);
+            out.push_back(CurrentSample{t, static_cast<uint16_t>(mA < 0 ? 0 : mA)});
+        }
+        return out;
+    }
+
+private:
+    static int level(const Pulse &p, uint32_t t) {
+        // trapezoid, its width at half amplitude is width_us
+        const int64_t rise0 = int64_t(p.start_us) - p.ramp_us / 2, fall1 = int64_t(p.start_us) + p.width_us + p.ramp_us / 2;
+        if(t < rise0 || t >= fall1) return 0;
+        if(p.ramp_us == 0) return p.mA;
+        const int64_t up = (int64_t(t) - rise0) * p.mA / p.ramp_us, down = (fall1 - int64_t(t)) * p.mA / p.ramp_us;
+        return static_cast<int>(std::min<int64_t>(p.mA, std::min(up, down)));
+    }
+};
+
+struct Detection {
+    size_t acks{0};
+    AckDetector::Ack ack{};
+    uint32_t rejected{0};
+};
+
+/** Feeds the trace, detector is armed with the baseline. */
+static Detection detect(const std::vector<CurrentSample> &samples) {
+    AckDetector d;
+    d.begin(BASE_MA);
+    Detection r;
+    for(const auto &s: samples) {
+        if(d.feed(s)) {
+            r.acks++;
+            r.ack = d.ack();
+        }
+    }
+    r.rejected = d.rejected();
+    return r;
+}
+
+void testCleanAck() {
+    Trace t;
+    t.pulses.push_back({20'000, 6000, 80, 0});
+    const auto r = detect(t.samples(60'000));
+    TEST_ASSERT_EQUAL(1, r.acks);
+    TEST_ASSERT_EQUAL(20'000, r.ack.start_us);
+    TEST_ASSERT_EQUAL(6000, r.ack.width_us);
+}
+
+/** Noise and a glitch inside the plateau don't split the pulse, noise alone isn't an ACK. */
+void testNoisyAck() {
+    Trace t;
+    t.noise_mA = 25;
+    t.pulses.push_back({20'000, 6000, 80, 0});
+    t.dropouts.push_back(23'000);
+    for(uint32_t seed=1; seed<=20; seed++) {
+        const auto r = detect(t.samples(60'000, seed));
+        TEST_ASSERT_EQUAL(1, r.acks);
+        TEST_ASSERT_INT_WITHIN(1000, 6000, r.ack.width_us);
+        TEST_ASSERT_EQUAL(0, r.rejected);
+    }
+
+    Trace noise;
+    noise.noise_mA = 25;
+    for(uint32_t seed=1; seed<=20; seed++) {
+        const auto r = detect(noise.samples(200'000, seed));
+        TEST_ASSERT_EQUAL(0, r.acks);
+    }
+}
+
+/**
+ * Weak ACK, its plateau is around threshold and noise is as large as its margin: first samples of the pulse
+ *   are often below threshold, pulse is still measured from its start and is not rejected as too short.
+ */
+void testWeakNoisyAck() {
+    Trace t;
+    t.noise_mA = 20;
+    t.pulses.push_back({20'000, 6000, 70, 0});
+    for(uint32_t seed=1; seed<=50; seed++) {
+        const auto r = detect(t.samples(60'000, seed));
+        TEST_ASSERT_EQUAL(1, r.acks);
+        TEST_ASSERT_EQUAL(20'000, r.ack.start_us);
+        TEST_ASSERT_INT_WITHIN(1000, 6000, r.ack.width_us);
+    }
+}
+
+/** Late decoder with slow edges: ACK is recognised whenever it comes, width is measured at threshold. */
+void testSlowAck() {
+    Trace t;
+    t.pulses.push_back({45'000, 6500, 70, 2000});
+    const auto r = detect(t.samples(80'000));
+    TEST_ASSERT_EQUAL(1, r.acks);
+    TEST_ASSERT_INT_WITHIN(1000, 45'000, r.ack.start_us);
+    TEST_ASSERT_INT_WITHIN(1500, 6500, r.ack.width_us);
+}
+
+/** No pulse, or pulses that are not 6ms: spikes and motor start are rejected, an ACK after them is not missed. */
+void testMissingAck() {
+    Trace none;
+    none.noise_mA = 10;
+    TEST_ASSERT_EQUAL(0, detect(none.samples(100'000)).acks);
+
+    Trace small;
+    small.pulses.push_back({20'000, 6000, 30, 0}); // below threshold
+    TEST_ASSERT_EQUAL(0, detect(small.samples(60'000)).acks);
+
+    Trace wrong;
+    wrong.pulses.push_back({10'000, 1000, 150, 0});  // spike
+    wrong.pulses.push_back({20'000, 2000, 80, 0});   // too short
+    wrong.pulses.push_back({40'000, 30'000, 80, 0}); // motor start
+    auto r = detect(wrong.samples(100'000));
+    TEST_ASSERT_EQUAL(0, r.acks);
+    TEST_ASSERT_EQUAL(3, r.rejected);
+
+    wrong.pulses.push_back({90'000, 6000, 80, 0});
+    r = detect(wrong.samples(120'000));
+    TEST_ASSERT_EQUAL(1, r.acks);
+    TEST_ASSERT_EQUAL(90'000, r.ack.start_us);
+}
+
+/** Reader gets samples in order, and only the latest N if it falls behind. */
+void testRingOverflow() {
+    SampleRing<8> ring;
+    uint32_t pos = ring.head();
+    etl::array<CurrentSample, 16> buf;
+    for(uint32_t i=0; i<5; i++) ring.push({i, 0});
+    TEST_ASSERT_EQUAL(5, ring.read(pos, etl::span<CurrentSample>{buf}));
+    TEST_ASSERT_EQUAL(4, buf[4].t_us);
+    TEST_ASSERT_EQUAL(0, ring.read(pos, etl::span<CurrentSample>{buf}));
+
+    for(uint32_t i=5; i<25; i++) ring.push({i, 0});
+    // the oldest of last 8 may be overwritten by writer right now, so it's skipped
+    const size_t n = ring.read(pos, etl::span<CurrentSample>{buf});
+    TEST_ASSERT_EQUAL(7, n);
+    TEST_ASSERT_EQUAL(18, buf[0].t_us);
+    TEST_ASSERT_EQUAL(24, buf[n - 1].t_us);
+    TEST_ASSERT_EQUAL(ring.head(), pos);
+}
+
+/** Concurrent writer: reader never sees a torn or reordered sample. */
+void testRingConcurrent() {
+    SampleRing<16> ring;
+    constexpr uint32_t N = 500'000;
+    std::atomic<bool> done{false};
+    std::thread writer([&]() {
+        for(uint32_t i=1; i<=N; i++) ring.push({i, static_cast<uint16_t>(i * 7)});
+        done = true;
+    });
+    uint32_t pos = 0, last = 0, got = 0;
+    etl::array<CurrentSample, 4> buf;
+    while(!done || pos != ring.head()) {
+        const size_t n = ring.read(pos, etl::span<CurrentSample>{buf});
+        for(size_t k=0; k<n; k++) {
+            TEST_ASSERT_GREATER_THAN(last, buf[k].t_us);
+            TEST_ASSERT_EQUAL(static_cast<uint16_t>(buf[k].t_us * 7), buf[k].mA);
+            last = buf[k].t_us;
+            got++;
+        }
+    }
+    writer.join();
+    TEST_ASSERT_EQUAL(N, last);
+    TEST_ASSERT_GREATER_THAN(0, got);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testCleanAck);
+    RUN_TEST(testNoisyAck);
+    RUN_TEST(testWeakNoisyAck);
+    RUN_TEST(testSlowAck);
+    RUN_TEST(testMissingAck);
+    RUN_TEST(testRingOverflow);
+    RUN_TEST(testRingConcurrent);
+    return UNITY_END();
+}
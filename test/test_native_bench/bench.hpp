@@ -0,0 +1,56 @@
+#pragma once
+
+/**
+ * Tiny benchmarking helpers for native (host) builds.
+ *
+ * Every measurement prints one line in the form
+ * ```
+ * BENCH name=<name> <key>=<number> [<key>=<number>...]
+ * ```
+ * (timings are `n=<iterations> ns_per_op=<float>`),
+ * so that results can be grepped from test output and compared between runs.
+ * Run with `pio test -e native_bench`.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstddef>
+#include <initializer_list>
+#include <utility>
+
+/** Prevents compiler from optimizing out a computed value. */
+template<typename T>
+inline void bench_keep(T const &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/** Prints one result line with arbitrary metrics. */
+inline void bench_print(const char *name, std::initializer_list<std::pair<const char*, double>> metrics) {
+    printf("BENCH name=%s", name);
+    for(const auto &m: metrics) printf(" %s=%g", m.first, m.second);
+    printf("\n");
+}
+
+/** Runs fn() n times (after a short warm-up) and prints average time per call. */
+template<typename F>
+double bench_run(const char *name, size_t n, F &&fn) {
+    for(size_t i=0; i<n/10+1; i++) fn();
+
+    auto t0 = std::chrono::steady_clock::now();
+    for(size_t i=0; i<n; i++) fn();
+    auto t1 = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / n;
+    bench_print(name, {{"n", (double)n}, {"ns_per_op", ns}});
+    return ns;
+}
+
+void bench_fetch_encoding();
+void bench_symbol_fill();
+void bench_slot_table();
+void bench_refresh_intervals();
+void bench_packet_builders();
+void bench_packet_list_throughput();
+void bench_put_to_track_latency();
+void bench_estop_latency();
+void bench_prog_track();
@@ -0,0 +1,69 @@
+#include "bench.hpp"
+
+#include "dcc/symbol_encoder.hpp"
+
+#include <etl/array.h>
+
+#include <unity.h>
+
+using namespace dcc;
+
+static constexpr size_t N_ITERATIONS = 500'000;
+
+// timings of continuous RMT channel
+using Encoder = SymbolEncoder<58, 100, false>;
+
+static constexpr size_t N_ITEMS = Encoder::packet_symbols(MAX_PACKET_LEN);
+static constexpr size_t N_PACKETS = 4;
+
+/**
+ * Compares filling RMT symbols bit by bit (from PacketBits)
+ * to table-driven filling from packet bytes, and checks that they produce same symbols.
+ */
+void bench_symbol_fill() {
+    const etl::array<Packet, N_PACKETS> packets{
+        Packet{0xFF, 0x00},                         // idle
+        Packet{0x03, 0x3F, 0x85},                   // short addr, 128 speed steps
+        Packet{0xC4, 0xD2, 0x3F, 0x85},             // long addr, 128 speed steps
+        Packet{0xC4, 0xD2, 0xEC, 0x07, 0x55},       // long addr POM
+    };
+
+    etl::array<SymbolWord, N_ITEMS> bits_items{};
+    etl::array<SymbolWord, N_ITEMS> lut_items{};
+
+    // identical output for every possible byte value, in every position
+    for(const Packet &p: packets) {
+        for(size_t pos=0; pos<p.size(); pos++) {
+            for(size_t v=0; v<256; v++) {
+                Packet q = p;
+                q[pos] = v;
+                size_t n1 = Encoder::fill_bits(PacketBits::from_packet(q, 0), etl::span<SymbolWord>{bits_items});
+                size_t n2 = Encoder::fill_packet(q, etl::span<SymbolWord>{lut_items});
+                TEST_ASSERT_EQUAL(n1, n2);
+                TEST_ASSERT_EQUAL_UINT32_ARRAY(bits_items.data(), lut_items.data(), n1);
+            }
+        }
+    }
+
+    size_t i = 0;
+    bench_run("fill_encode_then_bits", N_ITERATIONS, [&]() {
+        const Packet &p = packets[i++ % packets.size()];
+        size_t n = Encoder::fill_bits(PacketBits::from_packet(p, 0), etl::span<SymbolWord>{bits_items});
+        bench_keep(n);
+        bench_keep(bits_items);
+    });
+
+    etl::array<PacketBits, N_PACKETS> encoded;
+    for(size_t k=0; k<N_PACKETS; k++) encoded[k] = PacketBits::from_packet(packets[k], 0);
+    bench_run("fill_preencoded_bits", N_ITERATIONS, [&]() {
+        size_t n = Encoder::fill_bits(encoded[i++ % encoded.size()], etl::span<SymbolWord>{bits_items});
+        bench_keep(n);
+        bench_keep(bits_items);
+    });
+
+    bench_run("fill_lut_bytes", N_ITERATIONS, [&]() {
+        size_t n = Encoder::fill_packet(packets[i++ % packets.size()], etl::span<SymbolWord>{lut_items});
+        bench_keep(n);
+        bench_keep(lut_items);
+    });
+}
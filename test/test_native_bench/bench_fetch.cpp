@@ -0,0 +1,67 @@
+#include "bench.hpp"
+
+#include "dcc/PacketList.hpp"
+#include "dcc/symbol_encoder.hpp"
+
+#include <etl/array.h>
+
+#include <unity.h>
+
+using namespace dcc;
+
+static constexpr size_t N_ITERATIONS = 200'000;
+
+/** Fills every row of the table with speed and all refreshed function groups. */
+template<size_t N>
+static void fill_table(PacketList<N> &list) {
+    for(size_t i=0; i<N; i++) {
+        LocoAddress addr = (i%2==0) ? LocoAddress::shortAddr(i+1) : LocoAddress::longAddr(1000+i);
+        list.put_loco_speed_dir_packet(addr, LocoSpeed::from128(i+2), SpeedMode::S128, true);
+        list.put_loco_fn_packet(addr, fn_group::F0_4, 0b10101);
+        list.put_loco_fn_packet(addr, fn_group::F5_8, 0b1010'0000);
+        list.put_loco_fn_packet(addr, fn_group::F9_12, 0b1'0100'0000'0000);
+        // apply commands and drain queued entries, so that only refresh (round-robin) path is measured
+        PacketWithRepeats p;
+        for(size_t k=0; k<4; k++) list.fetch_next_packet(p);
+    }
+}
+
+/**
+ * Per-packet cost of waveform generator's refill: fetch alone, and fetch with conversion of packet bytes
+ *   into RMT symbols (RMT channels). For timer channel, fetch with encoding into PacketBits (as it was)
+ *   is compared with fetch and checksum, after which its bits are read from packet bytes.
+ */
+void bench_fetch_encoding() {
+    using Encoder = SymbolEncoder<58, 100, false>;
+    PacketList<10> list;
+    fill_table(list);
+    PacketWithRepeats p;
+    etl::array<SymbolWord, Encoder::packet_symbols(MAX_PACKET_LEN)> items;
+
+    const double fetch_ns = bench_run("fetch", N_ITERATIONS, [&]() {
+        list.fetch_next_packet(p);
+        bench_keep(p);
+    });
+
+    const double symbols_ns = bench_run("fetch_fill_symbols", N_ITERATIONS, [&]() {
+        list.fetch_next_packet(p);
+        bench_keep(Encoder::fill_packet(p.packet, etl::span<SymbolWord>{items}));
+    });
+
+    bench_run("fetch_encode_bits", N_ITERATIONS, [&]() {
+        list.fetch_next_packet(p);
+        bench_keep(PacketBits::from_packet(p.packet, 0));
+    });
+
+    bench_run("fetch_checksum", N_ITERATIONS, [&]() {
+        list.fetch_next_packet(p);
+        bench_keep(packet_checksum(p.packet));
+    });
+
+    bench_print("fetch_fill_symbols_overhead", {{"ratio", symbols_ns / fetch_ns}});
+
+    for(size_t i=0; i<100; i++) {
+        list.fetch_next_packet(p);
+        TEST_ASSERT_EQUAL(PacketBits::from_packet(p.packet, 0).size_bits, p.payload_bits());
+    }
+}
@@ -0,0 +1,236 @@
+#include "bench.hpp"
+
+#include "dcc/PacketList.hpp"
+#include "dcc/host_channel.hpp"
+
+#include <unity.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace dcc;
+
+static constexpr size_t N_ITERATIONS = 500'000;
+
+static LocoAddress loco(size_t i) {
+    return i < 100 ? LocoAddress::shortAddr(1 + i) : LocoAddress::longAddr(1000 + i);
+}
+
+/** Packet builders, encoder and PacketBits, each on its own. */
+void bench_packet_builders() {
+    const LocoAddress s = LocoAddress::shortAddr(3), l = LocoAddress::longAddr(1234);
+    uint32_t i = 0;
+
+    bench_run("make_speed_dir_short", N_ITERATIONS, [&]() {
+        bench_keep(make_speed_dir_packet(s, LocoSpeed::from128(i++ & 0x7F), SpeedMode::S128, true));
+    });
+    bench_run("make_speed_dir_long", N_ITERATIONS, [&]() {
+        bench_keep(make_speed_dir_packet(l, LocoSpeed::from128(i++ & 0x7F), SpeedMode::S128, true));
+    });
+    bench_run("make_speed_dir_s28", N_ITERATIONS, [&]() {
+        bench_keep(make_speed_dir_packet(l, LocoSpeed::from128(i++ & 0x7F), SpeedMode::S28, true));
+    });
+    bench_run("make_fn_f0_f4", N_ITERATIONS, [&]() {
+        bench_keep(make_fn_packet(l, fn_group::F0_4, i++));
+    });
+    bench_run("make_fn_f21_f28", N_ITERATIONS, [&]() {
+        bench_keep(make_fn_packet(l, fn_group::F21_28, i++));
+    });
+    bench_run("make_accessory", N_ITERATIONS, [&]() {
+        bench_keep(make_accessory_packet(i++ % 2044 + 1, true));
+    });
+
+    const auto bytes = make_fn_packet(l, fn_group::F21_28, 0xA5);
+    etl::array<uint8_t, 16> buf;
+    bench_run("encode_dcc", N_ITERATIONS, [&]() {
+        bench_keep(encode_dcc(bytes, buf, DEF_PREAMBLE_LEN));
+        bench_keep(buf);
+    });
+    const Packet packet(bytes.begin(), bytes.end());
+    bench_run("packet_bits_from_packet", N_ITERATIONS, [&]() {
+        bench_keep(PacketBits::from_packet(packet, 0));
+    });
+    bench_run("packet_with_repeats_from_packet", N_ITERATIONS, [&]() {
+        bench_keep(PacketWithRepeats::from_packet(packet, 1));
+    });
+}
+
+/**
+ * Producer and consumer side of packet list separately.
+ * Puts are measured in batches that fit into the command ring, then applied by one fetch (not measured).
+ */
+void bench_packet_list_throughput() {
+    static PacketList<64> list;
+    PacketWithRepeats p;
+    constexpr size_t BATCH = 8;
+    uint32_t i = 0;
+
+    auto put_batch = [&](const char *name, auto &&put) {
+        double total_ns = 0;
+        constexpr size_t N_BATCHES = N_ITERATIONS / BATCH;
+        for(size_t b=0; b<N_BATCHES; b++) {
+            auto t0 = std::chrono::steady_clock::now();
+            for(size_t k=0; k<BATCH; k++) put();
+            auto t1 = std::chrono::steady_clock::now();
+            total_ns += std::chrono::duration<double, std::nano>(t1 - t0).count();
+            list.fetch_next_packet(p);
+            // drain queue, so that its size does not affect next batch
+            while(list.queued_packets() > 0) list.fetch_next_packet(p);
+        }
+        bench_print(name, {{"n", (double)N_BATCHES * BATCH}, {"ns_per_op", total_ns / (N_BATCHES * BATCH)}});
+    };
+
+    put_batch("put_speed", [&]() {
+        list.put_loco_speed_dir_packet(LocoAddress::shortAddr(1 + i++ % 64), LocoSpeed::from128(10), SpeedMode::S128, true);
+    });
+    put_batch("put_fn", [&]() {
+        const auto addr = LocoAddress::shortAddr(1 + i % 64);
+        list.put_loco_fn_packet(addr, fn_group::F0_4, i);
+        i++;
+    });
+    put_batch("put_accessory", [&]() {
+        list.put_accessory_packet(i++ % 2044 + 1, true);
+    });
+
+    bench_run("fetch_refresh_64", N_ITERATIONS, [&]() {
+        list.fetch_next_packet(p);
+        bench_keep(p);
+    });
+    bench_run("put_and_fetch_64", N_ITERATIONS, [&]() {
+        list.put_loco_speed_dir_packet(LocoAddress::shortAddr(1 + i++ % 64), LocoSpeed::from128(10), SpeedMode::S128, true);
+        list.fetch_next_packet(p);
+        bench_keep(p);
+    });
+}
+
+/**
+ * End-to-end latency from put_* to the moment the packet is completely on the (virtual) track,
+ *   in track packets and simulated microseconds, with the table being refreshed in background.
+ */
+template<size_t N>
+static void latency_n() {
+    static PacketList<N> list;
+    HostChannel ch{list};
+    ch.begin();
+    ch.setRecordHalfBits(false);
+    for(size_t i=0; i<N; i++) {
+        list.put_loco_speed_dir_packet(loco(i), LocoSpeed::from128(10), SpeedMode::S128, true);
+        list.put_loco_fn_packet(loco(i), fn_group::F0_4, 0);
+        ch.runPackets(2);
+    }
+    ch.runPackets(100);
+
+    std::vector<uint32_t> packets, us;
+    for(size_t k=0; k<500; k++) {
+        const LocoAddress addr = loco(k % N);
+        const uint8_t spd = 20 + k % 100;
+        const auto expected = make_speed_dir_packet(addr, LocoSpeed::from128(spd), SpeedMode::S128, true);
+
+        // throttle command arrives while a packet is on track, it can only be fetched after that
+        ch.step();
+        const uint64_t t0 = ch.nowUs();
+        list.put_loco_speed_dir_packet(addr, LocoSpeed::from128(spd), SpeedMode::S128, true);
+        for(size_t n=1; ; n++) {
+            ch.step();
+            const auto &e = ch.emittedPackets().back();
+            if(std::equal(e.packet.begin(), e.packet.end(), expected.begin(), expected.end())) {
+                packets.push_back(n);
+                us.push_back(e.end_us - t0);
+                break;
+            }
+            TEST_ASSERT_LESS_THAN(100, n);
+        }
+        ch.runPackets(k % 7); // let refresh run for a while
+    }
+
+    auto mean_max = [](const std::vector<uint32_t> &v) {
+        double mean = 0;
+        for(auto x: v) mean += x;
+        return std::make_pair(mean / v.size(), (double)*std::max_element(v.begin(), v.end()));
+    };
+    auto [mean_p, max_p] = mean_max(packets);
+    auto [mean_us, max_us] = mean_max(us);
+    char name[48];
+    snprintf(name, sizeof(name), "latency_put_to_track_%zu", N);
+    bench_print(name, {{"mean_packets", mean_p}, {"max_packets", max_p}, {"mean_us", mean_us}, {"max_us", max_us}});
+
+    // speed change always jumps the refresh table
+    TEST_ASSERT_LESS_OR_EQUAL(1, max_p);
+}
+
+void bench_put_to_track_latency() {
+    latency_n<10>();
+    latency_n<128>();
+}
+
+/**
+ * Time from e-stop request to the first stop packet on track, and until every loco has got a stop packet,
+ *   for broadcast e-stop and for the per-loco way (EMGR speed put for every loco, as throttles do).
+ * Table has 128 refreshing locos and queue is busy with accessory packets.
+ */
+void bench_estop_latency() {
+    constexpr size_t N = 128;
+    const auto broadcast = make_broadcast_stop_packet(true);
+
+    for(bool use_broadcast: {true, false}) {
+        static PacketList<N> list;
+        list.emergency_stop_all(); // park locos of previous run, so that all of them are refreshed below
+        HostChannel ch{list};
+        ch.begin();
+        ch.setRecordHalfBits(false);
+        for(size_t i=0; i<N; i++) {
+            list.put_loco_speed_dir_packet(loco(i), LocoSpeed::from128(10), SpeedMode::S128, true);
+            ch.runPackets(1);
+        }
+        ch.runPackets(50);
+        for(size_t i=0; i<8; i++) list.put_accessory_packet(i + 1, true);
+
+        ch.step();
+        ch.clearRecording();
+        const uint64_t t0 = ch.nowUs();
+        if(use_broadcast) {
+            list.emergency_stop_all();
+        } else {
+            for(size_t i=0; i<N; i++) {
+                while(!list.put_loco_speed_dir_packet(loco(i), SPEED_EMGR, SpeedMode::S128, true)) ch.step();
+            }
+        }
+
+        uint64_t first_us = 0, all_us = 0;
+        std::vector<bool> stopped(N);
+        size_t n_stopped = 0;
+        while(n_stopped < N) {
+            ch.step();
+            const auto &e = ch.emittedPackets().back();
+            const bool is_broadcast = std::equal(e.packet.begin(), e.packet.end(), broadcast.begin(), broadcast.end());
+            for(size_t i=0; i<N; i++) {
+                if(stopped[i]) continue;
+                const auto stop = make_speed_dir_packet(loco(i), SPEED_EMGR, SpeedMode::S128, true);
+                if(is_broadcast || std::equal(e.packet.begin(), e.packet.end(), stop.begin(), stop.end())) {
+                    stopped[i] = true;
+                    n_stopped++;
+                }
+            }
+            if(first_us == 0 && n_stopped > 0) first_us = e.end_us - t0;
+            TEST_ASSERT_LESS_THAN(100'000'000, ch.nowUs() - t0);
+        }
+        all_us = ch.emittedPackets().back().end_us - t0;
+        bench_print(use_broadcast ? "estop_broadcast_128" : "estop_per_loco_128",
+            {{"first_stop_us", (double)first_us}, {"all_stopped_us", (double)all_us}});
+        if(use_broadcast) {
+            // packet that was on track when e-stop came is finished, then broadcast goes first
+            TEST_ASSERT_LESS_THAN(2 * 7000, first_us);
+        }
+    }
+
+    // fetch that sends e-stop only counts it, locos are parked when they are next refreshed
+    static PacketList<N> full;
+    PacketWithRepeats p;
+    for(size_t i=0; i<N; i++) full.put_loco_speed_dir_packet(loco(i), LocoSpeed::from128(10), SpeedMode::S128, true);
+    for(size_t i=0; i<2*N; i++) full.fetch_next_packet(p);
+    bench_run("estop_fetch_128", 100'000, [&]() {
+        full.emergency_stop_all();
+        full.fetch_next_packet(p);
+        bench_keep(p);
+    });
+}
@@ -0,0 +1,81 @@
+#include "bench.hpp"
+
+#include "dcc/prog_track.hpp"
+#include "dcc/sim_decoder.hpp"
+
+#include <unity.h>
+
+#include <vector>
+
+using namespace dcc;
+
+static constexpr size_t N_SEEDS = 5;
+static constexpr uint16_t CVS[] = {1, 2, 3, 4, 5, 29, 47, 112};
+
+struct Profile {
+    const char *name;
+    SimDecoder::Config cfg;
+};
+
+static void done(const ProgTrack::Result &r, void *ctx) {
+    static_cast<std::vector<ProgTrack::Result>*>(ctx)->push_back(r);
+}
+
+/**
+ * Reads CVS from a simulated decoder; with `write`, writes them first.
+ * @return mean simulated time per job, in ms.
+ */
+static double run_jobs(const SimDecoder::Config &cfg, bool speculative, bool write, size_t &failed) {
+    PacketList<2> list;
+    HostChannel ch{list};
+    ch.setRecordHalfBits(false);
+    ch.begin();
+    SimDecoder decoder{cfg};
+    SimProgTrack track{ch, decoder};
+    ProgTrack prog{&ch};
+    prog.setSpeculativeReads(speculative);
+    std::vector<ProgTrack::Result> results;
+
+    size_t jobs = 0;
+    for(auto cv: CVS) {
+        const uint8_t value = static_cast<uint8_t>(cv * 29 + 5);
+        if(write) prog.writeByte(cv, value, done, &results);
+        else decoder.setCv(cv, value);
+        prog.readByte(cv, done, &results);
+        jobs += write ? 2 : 1;
+        for(size_t i=0; i<100'000 && results.size() < jobs; i++) prog.loop(track.step());
+        TEST_ASSERT_EQUAL(jobs, results.size());
+        if(!results.back().ok || results.back().value != value) failed++;
+    }
+    return ch.nowUs() / 1000.0 / jobs;
+}
+
+/**
+ * Simulated time of service mode jobs with decoders that ACK late, with jitter, or with a weak and noisy pulse.
+ * Times are of the simulated track (not of the host), so they are comparable between hosts.
+ */
+void bench_prog_track() {
+    const Profile profiles[] = {
+        {"ideal", {}},
+        {"late", {10, 90, 6000, 2000, 3000, 0, 1}},
+        {"noisy", {40, 80, 6000, 500, 1000, 10, 1}},
+        // ACK just above threshold, noise larger than the margin: some ACKs are missed, retries make up for them
+        {"weak", {40, 65, 6000, 500, 1000, 30, 1}},
+    };
+    char name[48];
+    for(const auto &p: profiles) {
+        for(int mode=0; mode<3; mode++) {
+            const char *mode_name = mode == 0 ? "read_bitwise" : mode == 1 ? "read_speculative" : "write_read";
+            double ms = 0;
+            size_t failed = 0;
+            for(uint32_t seed=1; seed<=N_SEEDS; seed++) {
+                auto cfg = p.cfg;
+                cfg.seed = seed;
+                ms += run_jobs(cfg, mode != 0, mode == 2, failed);
+            }
+            snprintf(name, sizeof(name), "prog_%s_%s", mode_name, p.name);
+            bench_print(name, {{"ms_per_job", ms / N_SEEDS}, {"failed", (double)failed}});
+            TEST_ASSERT_EQUAL(0, failed);
+        }
+    }
+}
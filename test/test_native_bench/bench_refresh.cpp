@@ -0,0 +1,116 @@
+#include "bench.hpp"
+
+#include "dcc/PacketList.hpp"
+
+#include <unity.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace dcc;
+
+static constexpr size_t N_FETCHES = 50'000;
+// classes by table packet index, settled function packets are reported in their own class
+static constexpr size_t N_CLASSES = BasePacketList::REFRESH_FN_SETTLED;
+static const char * const CLASS_NAMES[N_CLASSES] = {"speed", "f0_f4", "f5_f12"};
+
+static LocoAddress loco(size_t i) {
+    return i < 100 ? LocoAddress::shortAddr(1 + i) : LocoAddress::longAddr(1000 + i);
+}
+
+/** Decodes loco number and table packet index from a fetched packet, -1 if it is not a loco packet. */
+static int decode(const Packet &p, size_t &loco_out) {
+    size_t pos;
+    uint16_t a;
+    if(p[0] >= 0xC0) { a = (p[0] & 0x3F) << 8 | p[1]; pos = 2; loco_out = a - 1000; }
+    else { a = p[0]; pos = 1; loco_out = a - 1; }
+    const uint8_t instr = p[pos];
+    if(instr == 0b0011'1111) return 0;
+    if((instr & 0xE0) == 0x80) return 1;
+    if((instr & 0xF0) == 0xB0) return 2;
+    if((instr & 0xF0) == 0xA0) return 3;
+    return -1;
+}
+
+/**
+ * Simulates track refresh with N locos, each having speed and 3 function group packets,
+ *   with throttles changing speed of random locos now and then. Functions never change,
+ *   so with `settle` they are refreshed with REFRESH_FN_SETTLED period after a while.
+ * Reports max and mean interval (in packets) between two sendings of the same packet, per class.
+ * For comparison, `rr` is the interval that the former fixed round-robin (speed every other packet
+ *   of a row, one fn group in between) gives for the same table.
+ * @return mean speed interval.
+ */
+template<size_t N>
+static double simulate_refresh(etl::array<uint32_t, N_CLASSES> &max_out, bool settle = false) {
+    static PacketList<N> list;
+    list.set_fn_settle_time(settle ? 3000 : 0);
+    PacketWithRepeats p;
+    for(size_t i=0; i<N; i++) {
+        list.put_loco_speed_dir_packet(loco(i), LocoSpeed::from128(10), SpeedMode::S128, true);
+        list.put_loco_fn_packet(loco(i), fn_group::F0_4, 0b10101);
+        list.put_loco_fn_packet(loco(i), fn_group::F5_8, 0b1010'0000);
+        list.put_loco_fn_packet(loco(i), fn_group::F9_12, 0b1'0100'0000'0000);
+        for(size_t k=0; k<4; k++) list.fetch_next_packet(p);
+    }
+
+    std::vector<etl::array<int64_t, 4>> last(N);
+    for(auto &l: last) l.fill(-1);
+    etl::array<uint64_t, N_CLASSES> sum{}, cnt{};
+    max_out.fill(0);
+    std::mt19937 rnd(N);
+
+    for(size_t t=0; t<N_FETCHES; t++) {
+        if(rnd() % 8 == 0) {
+            list.put_loco_speed_dir_packet(loco(rnd() % N), LocoSpeed::from128(rnd() % 100 + 2), SpeedMode::S128, true);
+        }
+        TEST_ASSERT_TRUE(list.fetch_next_packet(p));
+        size_t l;
+        int idx = decode(p.packet, l);
+        TEST_ASSERT_TRUE(idx >= 0 && l < N);
+        if(last[l][idx] >= 0 && t > N_FETCHES / 10) {
+            const uint32_t interval = t - last[l][idx];
+            const size_t c = BasePacketList::refresh_class(idx);
+            sum[c] += interval;
+            cnt[c]++;
+            max_out[c] = std::max(max_out[c], interval);
+        }
+        last[l][idx] = t;
+    }
+
+    const uint32_t rr[N_CLASSES] = {2 * N, 6 * N, 6 * N};
+    char name[48];
+    for(size_t c=0; c<N_CLASSES; c++) {
+        snprintf(name, sizeof(name), "refresh_%s_%zu%s", CLASS_NAMES[c], N, settle ? "_settled" : "");
+        bench_print(name, {
+            {"max", (double)max_out[c]},
+            {"mean", cnt[c] ? (double)sum[c] / cnt[c] : 0.0},
+            {"rr", (double)rr[c]} });
+    }
+    return (double)sum[0] / cnt[0];
+}
+
+void bench_refresh_intervals() {
+    etl::array<uint32_t, N_CLASSES> max;
+
+    // 10 locos fit into default periods (20/60/200): nothing may be much later than its period
+    simulate_refresh<10>(max);
+    TEST_ASSERT_LESS_OR_EQUAL(20 + 5, max[0]);
+    TEST_ASSERT_LESS_OR_EQUAL(60 + 5, max[1]);
+    TEST_ASSERT_LESS_OR_EQUAL(200 + 5, max[2]);
+
+    // overloaded tables: periods are stretched proportionally.
+    // 128 locos need 128*(1/20 + 1/60 + 2/200) = ~9.8 times more packets than track can take,
+    // and throttles take 1/8 of track time on top of that
+    simulate_refresh<32>(max);
+    simulate_refresh<64>(max);
+    const double speed = simulate_refresh<128>(max);
+    TEST_ASSERT_LESS_OR_EQUAL(20 * 13, max[0]);
+    TEST_ASSERT_LESS_OR_EQUAL(60 * 13, max[1]);
+    TEST_ASSERT_LESS_OR_EQUAL(200 * 13, max[2]);
+
+    // same table with unchanged functions settled: track time they free goes to speed packets
+    const double speed_settled = simulate_refresh<128>(max, true);
+    TEST_ASSERT_LESS_THAN(speed * 3 / 4, speed_settled);
+}
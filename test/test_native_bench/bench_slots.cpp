@@ -0,0 +1,82 @@
+#include "bench.hpp"
+
+#include "dcc/PacketList.hpp"
+
+#include <unity.h>
+
+#include <algorithm>
+
+using namespace dcc;
+
+static constexpr size_t N_ITERATIONS = 200'000;
+
+static LocoAddress loco(size_t i) {
+    return (i%2==0) ? LocoAddress::shortAddr(1 + i/2 % 127) : LocoAddress::longAddr(1000 + i);
+}
+
+/**
+ * Measures slot table operations with the table holding N locos.
+ * A put is only applied to the table by the next fetch, so put numbers include one fetch.
+ */
+template<size_t N>
+static void bench_slots_n() {
+    static PacketList<N> list;
+    PacketWithRepeats p;
+    char name[64];
+
+    for(size_t i=0; i<N; i++) {
+        LocoAddress addr = loco(i);
+        list.put_loco_speed_dir_packet(addr, LocoSpeed::from128(i%120 + 2), SpeedMode::S128, true);
+        list.put_loco_fn_packet(addr, fn_group::F0_4, 0b10101);
+        list.put_loco_fn_packet(addr, fn_group::F5_8, 0b1010'0000);
+        list.put_loco_fn_packet(addr, fn_group::F9_12, 0b1'0100'0000'0000);
+        // apply commands and drain queue
+        for(size_t k=0; k<4; k++) list.fetch_next_packet(p);
+    }
+    for(size_t i=0; i<N; i++) TEST_ASSERT_TRUE(list.has_loco(loco(i)));
+
+    size_t i = 0;
+    snprintf(name, sizeof(name), "slots_put_speed_%zu", N);
+    bench_run(name, N_ITERATIONS, [&]() {
+        list.put_loco_speed_dir_packet(loco(i++ % N), LocoSpeed::from128(10), SpeedMode::S128, true);
+        list.fetch_next_packet(p);
+        bench_keep(p);
+    });
+
+    snprintf(name, sizeof(name), "slots_fetch_refresh_%zu", N);
+    bench_run(name, N_ITERATIONS, [&]() {
+        list.fetch_next_packet(p);
+        bench_keep(p);
+    });
+
+    snprintf(name, sizeof(name), "slots_clear_readd_%zu", N);
+    bench_run(name, N_ITERATIONS, [&]() {
+        LocoAddress addr = loco(i++ % N);
+        list.clear_loco(addr);
+        list.put_loco_speed_dir_packet(addr, LocoSpeed::from128(10), SpeedMode::S128, true);
+        list.fetch_next_packet(p);
+        bench_keep(p);
+    });
+
+    // worst single fetch while table is churned: fetch time must not depend on N
+    double worst_ns = 0;
+    for(size_t k=0; k<N_ITERATIONS/10; k++) {
+        if(k % 4 == 0) list.clear_loco(loco(k % N));
+        if(k % 4 == 1) list.put_loco_speed_dir_packet(loco((k-1) % N), LocoSpeed::from128(10), SpeedMode::S128, true);
+        auto t0 = std::chrono::steady_clock::now();
+        list.fetch_next_packet(p);
+        auto t1 = std::chrono::steady_clock::now();
+        bench_keep(p);
+        worst_ns = std::max(worst_ns, std::chrono::duration<double, std::nano>(t1 - t0).count());
+    }
+    snprintf(name, sizeof(name), "slots_fetch_worst_%zu", N);
+    bench_print(name, {{"ns", worst_ns}});
+
+    TEST_ASSERT_LESS_OR_EQUAL(1, list.free_loco_slots());
+}
+
+void bench_slot_table() {
+    bench_slots_n<10>();
+    bench_slots_n<64>();
+    bench_slots_n<128>();
+}
@@ -0,0 +1,17 @@
+#include "bench.hpp"
+
+#include <unity.h>
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(bench_fetch_encoding);
+    RUN_TEST(bench_symbol_fill);
+    RUN_TEST(bench_slot_table);
+    RUN_TEST(bench_refresh_intervals);
+    RUN_TEST(bench_packet_builders);
+    RUN_TEST(bench_packet_list_throughput);
+    RUN_TEST(bench_put_to_track_latency);
+    RUN_TEST(bench_estop_latency);
+    RUN_TEST(bench_prog_track);
+    return UNITY_END();
+}
@@ -0,0 +1,176 @@
+#include "dcc/consist.hpp"
+#include "dcc/host_channel.hpp"
+
+#include <unity.h>
+
+#include <vector>
+
+using namespace dcc;
+
+using Consists = ConsistTable<2, 2>;
+
+static const LocoAddress LOCO_A = LocoAddress::shortAddr(3);
+static const LocoAddress LOCO_B = LocoAddress::longAddr(1234);
+static const LocoAddress LOCO_C = LocoAddress::shortAddr(5);
+
+struct Rig {
+    PacketList<8> list;
+    HostChannel ch{list};
+    Consists consists;
+
+    Rig() {
+        ch.setRecordHalfBits(false);
+        ch.begin();
+        consists.setChannel(&ch);
+        FnState fns;
+        fns.set(0, true);
+        for(auto addr: {LOCO_A, LOCO_B, LOCO_C}) {
+            ch.sendThrottle(addr, LocoSpeed::from128(40), SpeedMode::S128, true);
+            ch.sendFunctionGroup(addr, fn_group::F0_4, fns);
+        }
+        ch.runPackets(10);
+    }
+
+    /** Runs track for a while and returns what went out. */
+    std::vector<Packet> run(size_t n = 300) {
+        ch.clearRecording();
+        ch.runPackets(n);
+        std::vector<Packet> ret;
+        for(const auto &e: ch.emittedPackets()) ret.push_back(e.packet);
+        return ret;
+    }
+};
+
+/** Instruction byte of a multi-function decoder packet to `addr`, 0 if packet is for another address. */
+static uint8_t instruction(const Packet &p, LocoAddress addr) {
+    if(packet_loco_address(p) != addr) return 0;
+    return p[addr.isLong() ? 2 : 1];
+}
+
+static size_t count_speed(const std::vector<Packet> &packets, LocoAddress addr) {
+    size_t n = 0;
+    for(const auto &p: packets) {
+        const uint8_t i = instruction(p, addr);
+        if(i == 0x3F || i == 0x3C) n++; // 128 speed steps, combined instruction
+    }
+    return n;
+}
+
+static size_t count_f0_f4(const std::vector<Packet> &packets, LocoAddress addr) {
+    size_t n = 0;
+    for(const auto &p: packets) n += (instruction(p, addr) & 0xE0) == 0x80;
+    return n;
+}
+
+static bool has_packet(const std::vector<Packet> &packets, const Packet &p) {
+    for(const auto &q: packets) if(q == p) return true;
+    return false;
+}
+
+static Packet cv19_packet(LocoAddress addr, uint8_t value) {
+    const auto bytes = make_pom_byte_packet(addr, CV_CONSIST_ADDR, value);
+    return Packet{bytes.begin(), bytes.end()};
+}
+
+void testCv19Value() {
+    TEST_ASSERT_EQUAL_HEX8(0x0A, consist_cv19(10, false));
+    TEST_ASSERT_EQUAL_HEX8(0x8A, consist_cv19(10, true));
+    TEST_ASSERT_EQUAL_HEX8(0xFF, consist_cv19(127, true));
+}
+
+void testCreate() {
+    Consists c;
+    TEST_ASSERT_FALSE(c.create(1, 0));
+    TEST_ASSERT_FALSE(c.create(1, 128));
+    TEST_ASSERT_TRUE(c.create(1, 10));
+    TEST_ASSERT_FALSE(c.create(1, 11)); // slot is a consist already
+    TEST_ASSERT_TRUE(c.create(2, 11));
+    TEST_ASSERT_TRUE(c.full());
+    TEST_ASSERT_FALSE(c.create(3, 12));
+    TEST_ASSERT_TRUE(c.isConsist(1));
+    TEST_ASSERT_EQUAL(11, c.address(2));
+    TEST_ASSERT_EQUAL(0, c.address(3));
+    TEST_ASSERT_EQUAL(0, c.members(1)->size());
+    TEST_ASSERT_NULL(c.members(3));
+}
+
+/**
+ * Members get CV19 with consist address and reversed bit. Their own speed is not refreshed anymore,
+ *   but their functions are, and a loco outside of consist is not affected.
+ */
+void testAddMembers() {
+    Rig r;
+    TEST_ASSERT_TRUE(r.consists.create(10, 10));
+    TEST_ASSERT_FALSE(r.consists.add(11, 1, LOCO_A, false)); // not a consist
+    TEST_ASSERT_FALSE(r.consists.add(10, 10, LOCO_A, false)); // consist into itself
+    TEST_ASSERT_TRUE(r.consists.add(10, 1, LOCO_A, true));
+    TEST_ASSERT_TRUE(r.consists.add(10, 2, LOCO_B, false));
+    TEST_ASSERT_FALSE(r.consists.add(10, 3, LOCO_C, false)); // full
+    TEST_ASSERT_EQUAL(10, r.consists.consistOf(1));
+    TEST_ASSERT_EQUAL(0, r.consists.consistOf(3));
+
+    auto packets = r.run();
+    TEST_ASSERT_TRUE(has_packet(packets, cv19_packet(LOCO_A, 0x8A)));
+    TEST_ASSERT_TRUE(has_packet(packets, cv19_packet(LOCO_B, 0x0A)));
+
+    packets = r.run();
+    for(auto addr: {LOCO_A, LOCO_B}) {
+        TEST_ASSERT_EQUAL(0, count_speed(packets, addr));
+        TEST_ASSERT_GREATER_THAN(2, count_f0_f4(packets, addr));
+    }
+    TEST_ASSERT_GREATER_THAN(2, count_speed(packets, LOCO_C));
+}
+
+/** Member in combined instruction mode gets its functions refreshed in separate packets. */
+void testCombinedMember() {
+    Rig r;
+    r.ch.setCombinedInstruction(LOCO_A, true);
+    auto packets = r.run();
+    TEST_ASSERT_EQUAL(0, count_f0_f4(packets, LOCO_A));
+
+    r.consists.create(10, 10);
+    r.consists.add(10, 1, LOCO_A, false);
+    r.run();
+    packets = r.run();
+    TEST_ASSERT_EQUAL(0, count_speed(packets, LOCO_A));
+    TEST_ASSERT_GREATER_THAN(2, count_f0_f4(packets, LOCO_A));
+}
+
+/** Leaving member gets CV19 cleared, and it's back to its own speed once owner sends it. */
+void testRemoveAndRelease() {
+    Rig r;
+    r.consists.create(10, 10);
+    r.consists.add(10, 1, LOCO_A, true);
+    r.consists.add(10, 2, LOCO_B, false);
+    r.run();
+
+    TEST_ASSERT_EQUAL(10, r.consists.remove(1));
+    TEST_ASSERT_EQUAL(0, r.consists.remove(1));
+    TEST_ASSERT_EQUAL(1, r.consists.members(10)->size());
+    r.ch.sendThrottle(LOCO_A, LocoSpeed{}, SpeedMode::S128, true);
+    auto packets = r.run();
+    TEST_ASSERT_TRUE(has_packet(packets, cv19_packet(LOCO_A, 0)));
+    TEST_ASSERT_GREATER_THAN(2, count_speed(packets, LOCO_A));
+
+    // a member moves to another consist
+    TEST_ASSERT_TRUE(r.consists.create(20, 20));
+    TEST_ASSERT_TRUE(r.consists.add(20, 2, LOCO_B, true));
+    TEST_ASSERT_EQUAL(0, r.consists.members(10)->size());
+    TEST_ASSERT_TRUE(has_packet(r.run(), cv19_packet(LOCO_B, 0x94)));
+
+    r.consists.release(20);
+    TEST_ASSERT_FALSE(r.consists.isConsist(20));
+    TEST_ASSERT_EQUAL(0, r.consists.consistOf(2));
+    TEST_ASSERT_TRUE(has_packet(r.run(), cv19_packet(LOCO_B, 0)));
+    TEST_ASSERT_TRUE(r.consists.create(30, 30)); // its place is free
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testCv19Value);
+    RUN_TEST(testCreate);
+    RUN_TEST(testAddMembers);
+    RUN_TEST(testCombinedMember);
+    RUN_TEST(testRemoveAndRelease);
+    return UNITY_END();
+}
@@ -0,0 +1,157 @@
+#include "dcc/cv_cache.hpp"
+
+#include <etl/array.h>
+
+#include <unity.h>
+
+#include <map>
+#include <vector>
+
+using namespace dcc;
+
+struct MemStorage: CvStorage {
+    std::map<uint32_t, std::vector<uint8_t>> records;
+    size_t loads{0};
+    size_t saves{0};
+
+    bool load(const DecoderId &id, DecoderCvs &cvs) override {
+        loads++;
+        auto it = records.find(id.key());
+        if(it == records.end()) return false;
+        unpack(etl::span<const uint8_t>{it->second.data(), it->second.size()}, cvs);
+        return true;
+    }
+
+    bool save(const DecoderId &id, const DecoderCvs &cvs) override {
+        std::vector<uint8_t> data(cvs.size() * PACKED_SIZE);
+        data.resize(pack(cvs, etl::span<uint8_t>{data.data(), data.size()}));
+        records[id.key()] = data;
+        saves++;
+        return true;
+    }
+};
+
+static void put_identity(CvCache &c, uint8_t cv1, uint8_t cv7, uint8_t cv8, uint8_t cv29 = 0x06) {
+    c.put(CV_SHORT_ADDR, cv1);
+    c.put(CV_VERSION, cv7);
+    c.put(CV_MANUFACTURER, cv8);
+    c.put(CV_CONFIG, cv29);
+}
+
+/** Values are kept sorted by CV, identity is known once CV1/7/8/29 (or CV17/18 for long address) are. */
+void testIdentity() {
+    CvCache c;
+    DecoderId id{};
+    c.put(30, 1);
+    c.put(2, 5);
+    c.put(CV_CONFIG, 0x26);
+    TEST_ASSERT_FALSE(c.id(id));
+    c.put(CV_VERSION, 4);
+    c.put(CV_MANUFACTURER, 97);
+    c.put(CV_SHORT_ADDR, 3);
+    TEST_ASSERT_FALSE(c.id(id)); // long address is in use
+    c.put(CV_LONG_ADDR_HI, 0xC0 | 0x12);
+    c.put(CV_LONG_ADDR_LO, 0x34);
+    TEST_ASSERT_TRUE(c.id(id));
+    TEST_ASSERT_EQUAL(97, id.manufacturer);
+    TEST_ASSERT_EQUAL(4, id.version);
+    TEST_ASSERT_TRUE(id.address == LocoAddress::longAddr(0x1234));
+
+    uint16_t prev = 0;
+    for(const auto &v: c.values()) {
+        TEST_ASSERT_GREATER_THAN(prev, v.cv);
+        prev = v.cv;
+    }
+    uint8_t v = 0;
+    TEST_ASSERT_TRUE(c.get(2, v));
+    TEST_ASSERT_EQUAL(5, v);
+    c.forget(2);
+    TEST_ASSERT_FALSE(c.get(2, v));
+}
+
+/** Stored values are merged when decoder is identified, and saved back only if something changed. */
+void testStorage() {
+    MemStorage s;
+    {
+        CvCache c;
+        c.setStorage(&s);
+        put_identity(c, 3, 1, 13);
+        c.put(40, 7);
+        TEST_ASSERT_TRUE(c.dirty());
+        TEST_ASSERT_TRUE(c.save());
+        TEST_ASSERT_FALSE(c.dirty());
+        TEST_ASSERT_FALSE(c.save());
+    }
+    CvCache c;
+    c.setStorage(&s);
+    c.put(40, 8); // seen in this session, takes precedence
+    put_identity(c, 3, 1, 13);
+    TEST_ASSERT_EQUAL(2, s.loads);
+    uint8_t v = 0;
+    TEST_ASSERT_TRUE(c.get(40, v));
+    TEST_ASSERT_EQUAL(8, v);
+
+    // another address is another record
+    CvCache other;
+    other.setStorage(&s);
+    put_identity(other, 4, 1, 13);
+    TEST_ASSERT_FALSE(other.get(40, v));
+}
+
+/** A changed CV7 or CV8 is another decoder: values of the previous one are saved and forgotten. */
+void testDecoderChange() {
+    MemStorage s;
+    CvCache c;
+    c.setStorage(&s);
+    put_identity(c, 3, 1, 13);
+    c.put(50, 9);
+    c.put(CV_MANUFACTURER, 99);
+    TEST_ASSERT_EQUAL(1, s.saves);
+    DecoderId id{};
+    TEST_ASSERT_FALSE(c.id(id));
+    uint8_t v = 0;
+    TEST_ASSERT_FALSE(c.get(50, v));
+    TEST_ASSERT_TRUE(c.get(CV_MANUFACTURER, v));
+    TEST_ASSERT_EQUAL(99, v);
+
+    // same value is no change
+    c.put(CV_MANUFACTURER, 99);
+    TEST_ASSERT_TRUE(c.get(CV_MANUFACTURER, v));
+}
+
+void testPack() {
+    DecoderCvs cvs;
+    cvs.push_back({1, 3});
+    cvs.push_back({513, 0xAB});
+    etl::array<uint8_t, 8> buf{};
+    TEST_ASSERT_EQUAL(6, CvStorage::pack(cvs, etl::span<uint8_t>{buf}));
+    TEST_ASSERT_EQUAL(3, CvStorage::pack(cvs, etl::span<uint8_t>{buf.data(), 5}));
+
+    DecoderCvs out;
+    CvStorage::unpack(etl::span<const uint8_t>{buf.data(), 7}, out); // trailing byte is ignored
+    TEST_ASSERT_EQUAL(2, out.size());
+    TEST_ASSERT_EQUAL(513, out[1].cv);
+    TEST_ASSERT_EQUAL(0xAB, out[1].value);
+}
+
+void testReadOrder() {
+    const uint16_t head[] = {1, 7, 8, 29, 17, 18, 2, 3, 4, 5, 6, 9};
+    for(uint16_t i=0; i<12; i++) TEST_ASSERT_EQUAL(head[i], decoder_read_order(1, 30, i));
+    TEST_ASSERT_EQUAL(30, decoder_read_order(1, 30, 29));
+    TEST_ASSERT_EQUAL(0, decoder_read_order(1, 30, 30));
+
+    TEST_ASSERT_EQUAL(29, decoder_read_order(20, 40, 0));
+    TEST_ASSERT_EQUAL(20, decoder_read_order(20, 40, 1));
+    TEST_ASSERT_EQUAL(30, decoder_read_order(20, 40, 10));
+    TEST_ASSERT_EQUAL(40, decoder_read_order(20, 40, 20));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testIdentity);
+    RUN_TEST(testStorage);
+    RUN_TEST(testDecoderChange);
+    RUN_TEST(testPack);
+    RUN_TEST(testReadOrder);
+    return UNITY_END();
+}
@@ -0,0 +1,369 @@
+#include "dcc/PacketList.hpp"
+
+#include <unity.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace dcc;
+
+/** Exposes queue internals to tests. */
+template<size_t N>
+struct TestPacketList: public PacketList<N> {
+    using BasePacketList::N_QUEUE_PACKETS;
+};
+
+static bool is_speed_packet(const PacketWithRepeats &p, LocoAddress addr) {
+    return p.packet.size() == 3 && p.packet[0] == addr.addr() && p.packet[1] == 0b0011'1111;
+}
+
+/**
+ * Throttle sliders of several locos send speed changes much faster than the track can take them.
+ * Queue must hold at most one entry per loco, and accessory packets must still get through.
+ */
+void testSpeedFloodIsCoalesced() {
+    constexpr size_t N_LOCOS = 4;
+    TestPacketList<N_LOCOS> list;
+    PacketWithRepeats p;
+    size_t accessories_put = 0, accessories_fetched = 0;
+
+    for(int step=0; step<1000; step++) {
+        for(size_t l=0; l<N_LOCOS; l++) {
+            TEST_ASSERT_TRUE(list.put_loco_speed_dir_packet(
+                LocoAddress::shortAddr(3 + l), LocoSpeed::from128(2 + step % 100), SpeedMode::S128, true));
+        }
+        if(step % 10 == 0) {
+            TEST_ASSERT_TRUE(list.put_accessory_packet(step % 2000, true));
+            accessories_put++;
+        }
+        // track takes one packet per 4 speed changes
+        list.fetch_next_packet(p);
+        if(p.packet[0] & 0x80) accessories_fetched++;
+        TEST_ASSERT_LESS_OR_EQUAL(N_LOCOS + 1, list.queued_packets());
+    }
+    for(size_t i=0; i<TestPacketList<N_LOCOS>::N_QUEUE_PACKETS; i++) {
+        list.fetch_next_packet(p);
+        if(p.packet[0] & 0x80) accessories_fetched++;
+    }
+
+    auto stats = list.stats();
+    TEST_ASSERT_EQUAL(accessories_put, accessories_fetched);
+    TEST_ASSERT_EQUAL(0, stats.dropped);
+    TEST_ASSERT_GREATER_THAN(N_LOCOS * 1000 / 2, stats.coalesced);
+
+    // last put speed is what is refreshed
+    for(size_t i=0; i<N_LOCOS*4; i++) {
+        list.fetch_next_packet(p);
+        TEST_ASSERT_EQUAL(LocoSpeed::from128(2 + 999 % 100).getDCCByte(SpeedMode::S128) | 0x80, p.packet[2]);
+    }
+}
+
+/** Emergency stop for a loco whose speed is already queued is sent before other queued packets. */
+void testPriorityUpgrade() {
+    TestPacketList<4> list;
+    PacketWithRepeats p;
+    const LocoAddress a = LocoAddress::shortAddr(3), b = LocoAddress::shortAddr(4);
+
+    list.put_loco_speed_dir_packet(a, LocoSpeed::from128(50), SpeedMode::S128, true);
+    list.put_loco_speed_dir_packet(b, LocoSpeed::from128(50), SpeedMode::S128, true);
+    list.put_loco_speed_dir_packet(a, SPEED_EMGR, SpeedMode::S128, true);
+
+    list.fetch_next_packet(p);
+    TEST_ASSERT_TRUE(is_speed_packet(p, a));
+    TEST_ASSERT_EQUAL(0x80 | SPEED_EMGR.getDCCByte(SpeedMode::S128), p.packet[2]);
+    TEST_ASSERT_EQUAL(1, list.queued_packets());
+    TEST_ASSERT_EQUAL(1, list.stats().coalesced);
+
+    list.fetch_next_packet(p);
+    TEST_ASSERT_TRUE(is_speed_packet(p, b));
+    TEST_ASSERT_EQUAL(0, list.queued_packets());
+}
+
+/** Queue full of slot locations gives way to one-off packets, which are not stored anywhere else. */
+void testGenericPacketEvictsLocation() {
+    constexpr size_t N_LOCOS = 12;
+    TestPacketList<N_LOCOS> list;
+    PacketWithRepeats p;
+
+    for(size_t l=0; l<N_LOCOS; l++) {
+        list.put_loco_speed_dir_packet(LocoAddress::shortAddr(3 + l), LocoSpeed::from128(10), SpeedMode::S128, true);
+    }
+    const uint8_t reset[] = {0, 0};
+    list.put_generic_packet(reset, 1, BasePacketList::PRIORITY_NORMAL);
+    list.fetch_next_packet(p); // applies everything
+
+    // 12 locations for a 10 entries queue, and generic packet evicted one more
+    TEST_ASSERT_EQUAL(3, list.stats().dropped);
+    size_t generic = 0;
+    for(size_t i=0; i<TestPacketList<N_LOCOS>::N_QUEUE_PACKETS; i++) {
+        if(p.packet.size() == 2 && p.packet[0] == 0) generic++;
+        list.fetch_next_packet(p);
+    }
+    TEST_ASSERT_EQUAL(1, generic);
+}
+
+/** A packet that finds priority queue full is rejected by put_*, it must not hold up commands put after it. */
+void testFullQueueRejectsPacket() {
+    using List = TestPacketList<4>;
+    List list;
+    PacketWithRepeats p;
+    const LocoAddress a = LocoAddress::shortAddr(3);
+
+    for(size_t i=0; i<List::N_QUEUE_PACKETS; i++) TEST_ASSERT_TRUE(list.put_accessory_packet(i + 1, true));
+    TEST_ASSERT_FALSE(list.put_accessory_packet(100, true));
+    TEST_ASSERT_EQUAL(1, list.stats().put_rejected);
+
+    TEST_ASSERT_TRUE(list.put_loco_speed_dir_packet(a, LocoSpeed::from128(20), SpeedMode::S128, true));
+    list.fetch_next_packet(p); // applies everything
+    // speed is in the table, its location found the queue full of accessories
+    TEST_ASSERT_EQUAL(1, list.stats().dropped);
+    // a sent packet frees its place
+    TEST_ASSERT_TRUE(list.put_accessory_packet(100, true));
+
+    size_t accessories = 1;
+    bool speed_seen = false;
+    for(size_t i=0; i<List::N_QUEUE_PACKETS + 4; i++) {
+        list.fetch_next_packet(p);
+        if(p.packet[0] & 0x80) accessories++;
+        if(is_speed_packet(p, a)) speed_seen = true;
+    }
+    TEST_ASSERT_EQUAL(List::N_QUEUE_PACKETS + 1, accessories);
+    TEST_ASSERT_TRUE(speed_seen);
+}
+
+/** Broadcast e-stop jumps a full queue, and refresh keeps every loco stopped in its own speed mode and direction. */
+void testEmergencyStopAll() {
+    TestPacketList<4> list;
+    PacketWithRepeats p;
+    const LocoAddress s = LocoAddress::shortAddr(3), l = LocoAddress::longAddr(1234);
+
+    list.put_loco_speed_dir_packet(s, LocoSpeed::from128(50), SpeedMode::S128, true);
+    list.put_loco_speed_dir_packet(l, LocoSpeed::from128(50), SpeedMode::S28, false);
+    list.fetch_next_packet(p);
+    for(size_t i=0; i<TestPacketList<4>::N_QUEUE_PACKETS; i++) list.put_accessory_packet(i, true);
+    list.fetch_next_packet(p);
+
+    list.emergency_stop_all();
+    list.fetch_next_packet(p);
+    const auto estop = make_broadcast_stop_packet(true);
+    TEST_ASSERT_EQUAL(ESTOP_PACKET_REPEATS, p.nRepeats);
+    TEST_ASSERT_EQUAL(estop.size(), p.packet.size());
+    TEST_ASSERT_TRUE(std::equal(estop.begin(), estop.end(), p.packet.begin()));
+
+    const auto s_stop = make_speed_dir_packet(s, SPEED_EMGR, SpeedMode::S128, true);
+    const uint8_t l_stop[] = {0xC4, 0xD2, 0b0100'0001}; // 01DCSSSS, reverse, C=0, SSSS=0001 is e-stop
+    bool s_seen = false, l_seen = false;
+    for(size_t i=0; i<100; i++) {
+        list.fetch_next_packet(p);
+        if(std::equal(s_stop.begin(), s_stop.end(), p.packet.begin(), p.packet.end())) s_seen = true;
+        if(std::equal(std::begin(l_stop), std::end(l_stop), p.packet.begin(), p.packet.end())) l_seen = true;
+        // no running speed is ever sent again
+        if(p.packet[0] == s.addr()) TEST_ASSERT_TRUE(std::equal(s_stop.begin(), s_stop.end(), p.packet.begin(), p.packet.end()));
+    }
+    TEST_ASSERT_TRUE(s_seen);
+    TEST_ASSERT_TRUE(l_seen);
+
+    // speed set after e-stop is sent and refreshed, a loco added after e-stop is not stopped
+    const LocoAddress n = LocoAddress::shortAddr(5);
+    list.put_loco_speed_dir_packet(s, LocoSpeed::from128(20), SpeedMode::S128, true);
+    list.put_loco_speed_dir_packet(n, LocoSpeed::from128(30), SpeedMode::S128, true);
+    const auto s_run = make_speed_dir_packet(s, LocoSpeed::from128(20), SpeedMode::S128, true);
+    const auto n_run = make_speed_dir_packet(n, LocoSpeed::from128(30), SpeedMode::S128, true);
+    size_t s_runs = 0, n_runs = 0;
+    for(size_t i=0; i<100; i++) {
+        list.fetch_next_packet(p);
+        if(std::equal(s_run.begin(), s_run.end(), p.packet.begin(), p.packet.end())) s_runs++;
+        if(std::equal(n_run.begin(), n_run.end(), p.packet.begin(), p.packet.end())) n_runs++;
+        if(p.packet[0] == n.addr()) TEST_ASSERT_TRUE(std::equal(n_run.begin(), n_run.end(), p.packet.begin(), p.packet.end()));
+    }
+    TEST_ASSERT_GREATER_THAN(1, s_runs);
+    TEST_ASSERT_GREATER_THAN(1, n_runs);
+}
+
+/** Combined instruction carries speed and F0-F15 of a loco, which then has only this packet in the table. */
+void testCombinedInstruction() {
+    TestPacketList<4> list;
+    PacketWithRepeats p;
+    const LocoAddress l = LocoAddress::longAddr(1234);
+
+    list.put_loco_speed_dir_packet(l, LocoSpeed::from128(50), SpeedMode::S28, true);
+    list.put_loco_fn_packet(l, fn_group::F0_4, 0b1'0001);
+    list.put_loco_fn_packet(l, fn_group::F9_12, 1 << 12);
+    list.set_loco_combined(l, true);
+    list.put_loco_fn_packet(l, fn_group::F13_20, 1 << 15 | 1 << 16);
+    for(int i=0; i<20; i++) list.fetch_next_packet(p);
+
+    // address, 001-11100, DSSSSSSS, F7..F0, F15..F8
+    const uint8_t expected[] = {0xC4, 0xD2, 0b0011'1100, 0x80 | 50, 0b0001'0001, 0b1001'0000};
+    for(int i=0; i<50; i++) {
+        list.fetch_next_packet(p);
+        TEST_ASSERT_TRUE(std::equal(std::begin(expected), std::end(expected), p.packet.begin(), p.packet.end()));
+    }
+
+    // back to separate packets, state is kept
+    list.set_loco_combined(l, false);
+    const auto speed = make_speed_dir_packet(l, LocoSpeed::from128(50), SpeedMode::S128, true);
+    const auto f9 = make_fn_packet(l, fn_group::F9_12, 1 << 12);
+    bool speed_seen = false, f9_seen = false;
+    for(int i=0; i<300; i++) {
+        list.fetch_next_packet(p);
+        TEST_ASSERT_NOT_EQUAL(0b0011'1100, p.packet[2]);
+        if(std::equal(speed.begin(), speed.end(), p.packet.begin(), p.packet.end())) speed_seen = true;
+        if(std::equal(f9.begin(), f9.end(), p.packet.begin(), p.packet.end())) f9_seen = true;
+    }
+    TEST_ASSERT_TRUE(speed_seen);
+    TEST_ASSERT_TRUE(f9_seen);
+}
+
+/**
+ * Function packets that don't change are refreshed less often, leaving more track time for speed.
+ * Changed function group is refreshed at its normal rate again.
+ */
+void testUnchangedFunctionsSettle() {
+    constexpr size_t N = 32;
+    static TestPacketList<N> list;
+    list.set_fn_settle_time(500);
+    PacketWithRepeats p;
+    auto loco = [](size_t i) { return LocoAddress::longAddr(1000 + i); };
+    for(size_t i=0; i<N; i++) {
+        list.put_loco_speed_dir_packet(loco(i), LocoSpeed::from128(10), SpeedMode::S128, true);
+        list.put_loco_fn_packet(loco(i), fn_group::F0_4, 1);
+        list.put_loco_fn_packet(loco(i), fn_group::F5_8, 1 << 5);
+        list.put_loco_fn_packet(loco(i), fn_group::F9_12, 1 << 9);
+        for(int k=0; k<4; k++) list.fetch_next_packet(p);
+    }
+
+    auto mean_speed_interval = [&](size_t n_fetches) {
+        const auto before = list.stats().refresh_interval[BasePacketList::REFRESH_SPEED_DIR];
+        for(size_t k=0; k<n_fetches; k++) list.fetch_next_packet(p);
+        const auto after = list.stats().refresh_interval[BasePacketList::REFRESH_SPEED_DIR];
+        return double(after.sum - before.sum) / (after.count - before.count);
+    };
+    const double fresh = mean_speed_interval(300);
+    TEST_ASSERT_EQUAL(0, list.stats().refresh_interval[BasePacketList::REFRESH_FN_SETTLED].count);
+    for(int k=0; k<3000; k++) list.fetch_next_packet(p);
+    const double settled = mean_speed_interval(1000);
+    TEST_ASSERT_GREATER_THAN(0, list.stats().refresh_interval[BasePacketList::REFRESH_FN_SETTLED].count);
+    TEST_ASSERT_LESS_THAN(fresh * 3 / 4, settled);
+
+    // F0-F4 of loco 0 is changed, F0-F4 of loco 1 stays settled
+    list.put_loco_fn_packet(loco(0), fn_group::F0_4, 0);
+    const auto changed = make_fn_packet(loco(0), fn_group::F0_4, 0);
+    const auto unchanged = make_fn_packet(loco(1), fn_group::F0_4, 1);
+    size_t n_changed = 0, n_unchanged = 0;
+    for(int k=0; k<400; k++) {
+        list.fetch_next_packet(p);
+        if(std::equal(changed.begin(), changed.end(), p.packet.begin(), p.packet.end())) n_changed++;
+        if(std::equal(unchanged.begin(), unchanged.end(), p.packet.begin(), p.packet.end())) n_unchanged++;
+    }
+    TEST_ASSERT_GREATER_THAN(n_unchanged + 1, n_changed);
+}
+
+/**
+ * A route change flips many signals at once and then flips them again.
+ * Only the latest aspect of each signal is sent, with all its repeats, and signal packets
+ *   never take more than every 4th fetch while loco packets are waiting.
+ */
+void testSignalQueueIsPaced() {
+    constexpr size_t N_SIGNALS = 12;
+    TestPacketList<4> list;
+    list.set_signal_pacing(4);
+    PacketWithRepeats p;
+    for(size_t i=0; i<4; i++) {
+        list.put_loco_speed_dir_packet(LocoAddress::shortAddr(3 + i), LocoSpeed::from128(10), SpeedMode::S128, true);
+        list.fetch_next_packet(p);
+    }
+
+    for(size_t i=0; i<N_SIGNALS; i++) list.put_signal_aspect_packet(100 + i, 1);
+    list.fetch_next_packet(p);
+    for(size_t i=0; i<N_SIGNALS; i++) list.put_signal_aspect_packet(100 + i, 2);
+    list.put_loco_speed_dir_packet(LocoAddress::shortAddr(3), LocoSpeed::from128(20), SpeedMode::S128, true);
+
+    // queued loco packet goes first
+    list.fetch_next_packet(p);
+    TEST_ASSERT_TRUE(is_speed_packet(p, LocoAddress::shortAddr(3)));
+
+    size_t n_old = 0, n_new = 0;
+    int last_signal = -100;
+    for(int i=0; i<500; i++) {
+        list.fetch_next_packet(p);
+        if(!is_accessory_packet(p.packet)) continue;
+        TEST_ASSERT_EQUAL(3, p.packet.size());
+        if(p.packet[2] == 1) n_old++;
+        if(p.packet[2] == 2) n_new++;
+        TEST_ASSERT_GREATER_OR_EQUAL(4, i - last_signal);
+        last_signal = i;
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(1, n_old);
+    TEST_ASSERT_EQUAL(N_SIGNALS * ACCESSORY_PACKET_REPEATS, n_new);
+    TEST_ASSERT_EQUAL(0, list.queued_signals());
+    TEST_ASSERT_EQUAL(N_SIGNALS, list.stats().signal_superseded);
+}
+
+/**
+ * POM packets to one decoder go one after another, each with all its repeats; packets to another decoder are
+ *   interleaved with them. None follows a packet to the same decoder, and they take at most every other fetch.
+ */
+void testPomQueueIsSpaced() {
+    TestPacketList<4> list;
+    PacketWithRepeats p;
+    const LocoAddress a = LocoAddress::shortAddr(3), b = LocoAddress::longAddr(1234);
+    list.put_loco_speed_dir_packet(a, LocoSpeed::from128(10), SpeedMode::S128, true);
+    list.put_loco_speed_dir_packet(b, LocoSpeed::from128(10), SpeedMode::S128, true);
+    for(int i=0; i<2; i++) list.fetch_next_packet(p);
+
+    TEST_ASSERT_TRUE(list.put_pom_packet(a, make_pom_byte_packet(a, 1, 10), 1));
+    TEST_ASSERT_TRUE(list.put_pom_packet(a, make_pom_byte_packet(a, 2, 20), 2));
+    TEST_ASSERT_TRUE(list.put_pom_packet(b, make_pom_byte_packet(b, 3, 30), 3));
+
+    LocoAddress prev;
+    std::vector<uint8_t> cvs_a, cvs_b;
+    int last_pom = -100;
+    for(int i=0; i<100; i++) {
+        list.fetch_next_packet(p);
+        const LocoAddress addr = packet_loco_address(p.packet);
+        const uint8_t instr = p.packet[addr.isLong() ? 2 : 1];
+        if((instr & 0xF0) == 0xE0) {
+            TEST_ASSERT_TRUE(addr != prev);
+            TEST_ASSERT_GREATER_OR_EQUAL(2, i - last_pom);
+            last_pom = i;
+            (addr == a ? cvs_a : cvs_b).push_back(p.packet[addr.isLong() ? 3 : 2] + 1);
+        }
+        prev = addr;
+    }
+    const std::vector<uint8_t> expect_a = {1, 1, 1, 1, 2, 2, 2, 2}, expect_b = {3, 3, 3, 3};
+    TEST_ASSERT_TRUE(cvs_a == expect_a);
+    TEST_ASSERT_TRUE(cvs_b == expect_b);
+    TEST_ASSERT_EQUAL(0, list.queued_pom());
+
+    uint32_t tokens = 0;
+    BasePacketList::PomDone d{};
+    while(list.take_pom_done(d)) {
+        TEST_ASSERT_TRUE(d.sent);
+        tokens |= 1 << d.token;
+    }
+    TEST_ASSERT_EQUAL(0b1110, tokens);
+
+    // full POM queue drops the packet and says so, command ring is not held up
+    for(uint32_t t=1; t<=BasePacketList::N_POM_PACKETS + 1; t++) list.put_pom_packet(a, make_pom_byte_packet(a, t, 0), t);
+    list.put_loco_speed_dir_packet(b, LocoSpeed::from128(20), SpeedMode::S128, true);
+    list.fetch_next_packet(p);
+    TEST_ASSERT_TRUE(is_speed_packet(p, b) || packet_loco_address(p.packet) == b);
+    TEST_ASSERT_TRUE(list.take_pom_done(d));
+    TEST_ASSERT_FALSE(d.sent);
+    TEST_ASSERT_EQUAL(BasePacketList::N_POM_PACKETS + 1, d.token);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testSpeedFloodIsCoalesced);
+    RUN_TEST(testPriorityUpgrade);
+    RUN_TEST(testGenericPacketEvictsLocation);
+    RUN_TEST(testFullQueueRejectsPacket);
+    RUN_TEST(testEmergencyStopAll);
+    RUN_TEST(testCombinedInstruction);
+    RUN_TEST(testUnchangedFunctionsSettle);
+    RUN_TEST(testSignalQueueIsPaced);
+    RUN_TEST(testPomQueueIsSpaced);
+    return UNITY_END();
+}
@@ -0,0 +1,172 @@
+#include "dcc/PacketList.hpp"
+
+#include <unity.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <random>
+
+using namespace dcc;
+
+constexpr size_t N_PRODUCERS = 4;
+constexpr size_t LOCOS_PER_PRODUCER = 2;
+constexpr auto RUN_TIME = std::chrono::milliseconds(1000);
+// real track does one packet per ~5ms; run consumer 50x faster to stress it
+constexpr auto PACKET_PERIOD = std::chrono::microseconds(100);
+
+constexpr uint8_t GENERIC_MARK = 0b1011'0000; ///< first byte of generic packets is MARK|producer
+
+static LocoAddress producer_loco(size_t producer, size_t k) {
+    return LocoAddress::shortAddr(10 + producer*LOCOS_PER_PRODUCER + k);
+}
+
+struct ProducerStats {
+    uint32_t generic_accepted{0};
+    uint32_t rejected{0};
+};
+
+static void producer(BasePacketList &list, size_t id, std::atomic<bool> &stop, ProducerStats &stats) {
+    std::mt19937 rnd(id);
+    uint16_t seq = 0;
+    while(!stop.load()) {
+        LocoAddress addr = producer_loco(id, rnd() % LOCOS_PER_PRODUCER);
+        bool ok = true;
+        switch(rnd() % 5) {
+            case 0: case 1:
+                ok = list.put_loco_speed_dir_packet(addr, LocoSpeed::from128(rnd()%128), SpeedMode::S128, rnd()%2);
+                break;
+            case 2:
+                ok = list.put_loco_fn_packet(addr, static_cast<fn_group>(rnd()%3), rnd());
+                break;
+            case 3: {
+                const uint8_t bytes[] = {
+                    static_cast<uint8_t>(GENERIC_MARK | id),
+                    static_cast<uint8_t>(seq >> 8),
+                    static_cast<uint8_t>(seq & 0xFF) };
+                if(list.put_generic_packet(bytes, 1)) {
+                    seq++;
+                    stats.generic_accepted++;
+                } else ok = false;
+                break;
+            }
+            case 4:
+                ok = list.clear_loco(addr);
+                break;
+        }
+        if(!ok) {
+            stats.rejected++;
+            std::this_thread::yield();
+        }
+    }
+}
+
+/** Packet has the size and instruction of one that producers put: generic, 128-step speed, or F0-F12. */
+static bool well_formed(const Packet &p) {
+    if((p[0] & 0xF0) == GENERIC_MARK) return p.size() == 3;
+    if(p.size() < 2) return false;
+    if(p[1] == 0b0011'1111) return p.size() == 3;
+    return (p[1] & 0b1100'0000) == 0b1000'0000 && p.size() == 2;
+}
+
+void testConcurrentProducers() {
+    PacketList<N_PRODUCERS * LOCOS_PER_PRODUCER> list;
+    std::atomic<bool> stop{false};
+    etl::array<ProducerStats, N_PRODUCERS> stats{};
+
+    std::vector<std::thread> threads;
+    for(size_t i=0; i<N_PRODUCERS; i++) {
+        threads.emplace_back(producer, std::ref(list), i, std::ref(stop), std::ref(stats[i]));
+    }
+
+    etl::array<uint32_t, N_PRODUCERS> generic_received{};
+    etl::array<int32_t, N_PRODUCERS> last_seq;
+    last_seq.fill(-1);
+    size_t torn = 0, foreign = 0, reordered = 0;
+
+    auto check = [&](const PacketWithRepeats &p) {
+        if(!well_formed(p.packet)) torn++;
+
+        if((p.packet[0] & 0xF0) == GENERIC_MARK) {
+            size_t id = p.packet[0] & 0x0F;
+            int32_t seq = p.packet[1] << 8 | p.packet[2];
+            if(seq != last_seq[id]+1) reordered++;
+            last_seq[id] = seq;
+            generic_received[id]++;
+        } else {
+            uint8_t a = p.packet[0];
+            if(a < 10 || a >= 10 + N_PRODUCERS*LOCOS_PER_PRODUCER) foreign++;
+        }
+    };
+
+    auto deadline = std::chrono::steady_clock::now() + RUN_TIME;
+    PacketWithRepeats p;
+    while(std::chrono::steady_clock::now() < deadline) {
+        if(list.fetch_next_packet(p)) check(p);
+        std::this_thread::sleep_for(PACKET_PERIOD);
+    }
+
+    stop = true;
+    for(auto &t: threads) t.join();
+
+    // drain whatever is left in ring and queue
+    for(size_t i=0; i<1000; i++) {
+        if(list.fetch_next_packet(p)) check(p);
+    }
+
+    uint32_t accepted = 0, rejected = 0;
+    for(size_t i=0; i<N_PRODUCERS; i++) {
+        accepted += stats[i].generic_accepted;
+        rejected += stats[i].rejected;
+        TEST_ASSERT_EQUAL_MESSAGE(stats[i].generic_accepted, generic_received[i], "generic packets lost");
+    }
+    TEST_ASSERT_EQUAL(rejected, list.stats().put_rejected);
+
+    TEST_ASSERT_GREATER_THAN(0, accepted);
+    TEST_ASSERT_EQUAL_MESSAGE(0, torn, "packet is not one that producers put");
+    TEST_ASSERT_EQUAL_MESSAGE(0, foreign, "packet for unknown loco");
+    TEST_ASSERT_EQUAL_MESSAGE(0, reordered, "packets of one producer reordered");
+}
+
+/** Ring alone: several producers, one consumer, every element delivered exactly once and in per-producer order. */
+void testMpscRing() {
+    constexpr size_t N_PER_PRODUCER = 200'000;
+    MpscRing<uint32_t, 64> ring;
+
+    std::vector<std::thread> threads;
+    for(uint32_t id=0; id<N_PRODUCERS; id++) {
+        threads.emplace_back([&ring, id]() {
+            for(uint32_t i=0; i<N_PER_PRODUCER; ) {
+                if(ring.push(id << 24 | i)) i++;
+                else std::this_thread::yield();
+            }
+        });
+    }
+
+    etl::array<uint32_t, N_PRODUCERS> next{};
+    size_t received = 0, errors = 0;
+    while(received < N_PRODUCERS * N_PER_PRODUCER) {
+        const uint32_t *v = ring.front();
+        if(v == nullptr) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint32_t id = *v >> 24, i = *v & 0xFFFFFF;
+        if(id >= N_PRODUCERS || i != next[id]) errors++;
+        else next[id]++;
+        ring.pop();
+        received++;
+    }
+    for(auto &t: threads) t.join();
+
+    TEST_ASSERT_EQUAL(0, errors);
+    TEST_ASSERT_TRUE(ring.front() == nullptr);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testMpscRing);
+    RUN_TEST(testConcurrentProducers);
+    return UNITY_END();
+}
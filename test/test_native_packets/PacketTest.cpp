@@ -0,0 +1,151 @@
+#include "dcc/packet.hpp"
+
+#include <etl/array.h>
+
+#include <unity.h>
+
+#include <algorithm>
+#include <initializer_list>
+
+using namespace dcc;
+
+template<typename P>
+static void assert_bytes(std::initializer_list<uint8_t> expected, const P &p) {
+    TEST_ASSERT_EQUAL(expected.size(), p.size());
+    TEST_ASSERT_TRUE(std::equal(expected.begin(), expected.end(), p.begin()));
+}
+
+void testFnState() {
+    FnState f;
+    f.set(0, true);
+    f.set(31, true);
+    f.set(32, true);
+    f.set(68, true);
+    f.set(69, true); // out of range, ignored
+    TEST_ASSERT_TRUE(f.get(0));
+    TEST_ASSERT_TRUE(f.get(31));
+    TEST_ASSERT_TRUE(f.get(32));
+    TEST_ASSERT_TRUE(f.get(68));
+    TEST_ASSERT_FALSE(f.get(69));
+    TEST_ASSERT_EQUAL(0b11, f.bits(31, 2));
+    TEST_ASSERT_EQUAL(0x80, f.group(fn_group::F61_68));
+
+    f.set_group(fn_group::F29_36, 0xA5);
+    TEST_ASSERT_EQUAL(0xA5, f.group(fn_group::F29_36));
+    TEST_ASSERT_TRUE(f.get(29));
+    TEST_ASSERT_FALSE(f.get(30));
+    TEST_ASSERT_TRUE(f.get(36));
+    f.set(31, false);
+    TEST_ASSERT_EQUAL(0xA1, f.group(fn_group::F29_36));
+
+    TEST_ASSERT_TRUE(FnState{0b101} == FnState{0b101});
+    TEST_ASSERT_TRUE(FnState{0b101} != FnState{0b100});
+}
+
+void testFnGroups() {
+    for(size_t fn=0; fn<FnState::N_FUNCTIONS; fn++) {
+        const fn_group fg = fn_to_group(fn);
+        TEST_ASSERT_LESS_OR_EQUAL(fn, fn_group_first(fg));
+        TEST_ASSERT_LESS_THAN(fn_group_first(fg) + fn_group_size(fg), fn);
+    }
+    TEST_ASSERT_EQUAL(61, fn_group_first(fn_group::F61_68));
+    TEST_ASSERT_TRUE(fn_to_group(68) == fn_group::F61_68);
+}
+
+/** Every function group packet, checked against S-9.2.1 byte by byte. */
+void testFnPacketBytes() {
+    const LocoAddress s = LocoAddress::shortAddr(3), l = LocoAddress::longAddr(1234);
+    FnState f;
+    // every group gets a different pattern: lowest and highest function of the group on
+    for(size_t g=0; g<FN_NUMBER; g++) {
+        const fn_group fg = static_cast<fn_group>(g);
+        f.set(fn_group_first(fg), true);
+        f.set(fn_group_first(fg) + fn_group_size(fg) - 1, true);
+    }
+
+    // 100-DDDDD, FL (F0) is bit 4
+    assert_bytes({0x03, 0b1001'1000}, make_fn_packet(s, fn_group::F0_4, f));
+    // 1011-DDDD, F5 is bit 0
+    assert_bytes({0x03, 0b1011'1001}, make_fn_packet(s, fn_group::F5_8, f));
+    // 1010-DDDD, F9 is bit 0
+    assert_bytes({0x03, 0b1010'1001}, make_fn_packet(s, fn_group::F9_12, f));
+    // feature expansion: 110-CCCCC, then function byte with lowest function in bit 0
+    assert_bytes({0x03, 0xDE, 0x81}, make_fn_packet(s, fn_group::F13_20, f));
+    assert_bytes({0x03, 0xDF, 0x81}, make_fn_packet(s, fn_group::F21_28, f));
+    assert_bytes({0x03, 0xD8, 0x81}, make_fn_packet(s, fn_group::F29_36, f));
+    assert_bytes({0x03, 0xD9, 0x81}, make_fn_packet(s, fn_group::F37_44, f));
+    assert_bytes({0x03, 0xDA, 0x81}, make_fn_packet(s, fn_group::F45_52, f));
+    assert_bytes({0x03, 0xDB, 0x81}, make_fn_packet(s, fn_group::F53_60, f));
+    assert_bytes({0x03, 0xDC, 0x81}, make_fn_packet(s, fn_group::F61_68, f));
+
+    assert_bytes({0xC4, 0xD2, 0b1001'1000}, make_fn_packet(l, fn_group::F0_4, f));
+    assert_bytes({0xC4, 0xD2, 0xDC, 0x81}, make_fn_packet(l, fn_group::F61_68, f));
+
+    // one function only, to catch bit order errors
+    FnState f44;
+    f44.set(44, true);
+    assert_bytes({0x03, 0xD9, 0x80}, make_fn_packet(s, fn_group::F37_44, f44));
+    assert_bytes({0x03, 0xDA, 0x00}, make_fn_packet(s, fn_group::F45_52, f44));
+}
+
+void testBinaryStatePacketBytes() {
+    const LocoAddress s = LocoAddress::shortAddr(3), l = LocoAddress::longAddr(1234);
+    // short form: 110-11101 DLLLLLLL
+    assert_bytes({0x03, 0xDD, 0x80 | 5}, make_binary_state_packet(s, 5, true));
+    assert_bytes({0x03, 0xDD, 127}, make_binary_state_packet(s, 127, false));
+    // long form: 110-00000 DLLLLLLL HHHHHHHH
+    assert_bytes({0x03, 0xC0, 0x80 | 0x00, 0x01}, make_binary_state_packet(s, 128, true));
+    assert_bytes({0xC4, 0xD2, 0xC0, 0x7F, 0xFF}, make_binary_state_packet(l, 32767, false));
+}
+
+void testExtAccessoryPacketBytes() {
+    // 10AAAAAA 0AAA0AA1 XXXXXXXX, high address bits inverted, same address layout as basic packet
+    assert_bytes({0x81, 0x71, 0}, make_ext_accessory_packet(0, 0));
+    assert_bytes({0x85, 0x73, 0x12}, make_ext_accessory_packet(17, 0x12));
+    assert_bytes({0xBB, 0x41, 0xFF}, make_ext_accessory_packet(1000, 0xFF));
+    const auto basic = make_accessory_packet(1000, true);
+    const auto ext = make_ext_accessory_packet(1000, 1);
+    TEST_ASSERT_EQUAL(basic[0], ext[0]);
+    TEST_ASSERT_EQUAL(basic[1] & 0b0111'0110, ext[1] & 0b0111'0110);
+    TEST_ASSERT_TRUE(is_accessory_packet(ext));
+}
+
+void testCvAccessPacketBytes() {
+    // service mode direct: 0111CCAA AAAAAAAA DDDDDDDD, CV address is 0-based
+    assert_bytes({0x74, 0x1C, 0x06}, make_service_byte_packet(29, 0x06, false));
+    assert_bytes({0x7F, 0xFF, 0x00}, make_service_byte_packet(1024, 0, true));
+    // bit manipulation: 011110AA AAAAAAAA 111KDBBB
+    assert_bytes({0x78, 0x00, 0xEF}, make_service_bit_packet(1, 7, true, false));
+    assert_bytes({0x78, 0x00, 0xF2}, make_service_bit_packet(1, 2, false, true));
+    // POM: address, then 1110CCAA AAAAAAAA DDDDDDDD
+    assert_bytes({0xC4, 0xD2, 0xEC, 0x12, 0x85}, make_pom_byte_packet(LocoAddress::longAddr(1234), 19, 0x85));
+    assert_bytes({0x03, 0xE8, 0x1C, 0xFD}, make_pom_bit_packet(LocoAddress::shortAddr(3), 29, 5, true));
+}
+
+/** Bits read from packet bytes are the bits that encode_dcc() produces. */
+void testPayloadBitAt() {
+    const PacketWithRepeats packets[] = {
+        PacketWithRepeats::from_bytes(make_speed_dir_packet(LocoAddress::longAddr(1234), LocoSpeed::from128(50), SpeedMode::S128, true), 1),
+        PacketWithRepeats::from_bytes(make_pom_byte_packet(LocoAddress::longAddr(1234), 19, 0x85), 1),
+        PacketWithRepeats::from_bytes(make_accessory_packet(1000, true), 1),
+        PacketWithRepeats::from_bytes(etl::array<uint8_t, 2>{0xFF, 0x00}, 1), // idle
+    };
+    for(const auto &p: packets) {
+        const PacketBits bits = PacketBits::from_packet(p.packet, 0);
+        const uint8_t checksum = packet_checksum(p.packet);
+        TEST_ASSERT_EQUAL(bits.size_bits, p.payload_bits());
+        for(size_t i=0; i<bits.size_bits; i++) TEST_ASSERT_EQUAL(bits.bit_at(i), p.payload_bit_at(i, checksum));
+    }
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testFnState);
+    RUN_TEST(testFnGroups);
+    RUN_TEST(testFnPacketBytes);
+    RUN_TEST(testBinaryStatePacketBytes);
+    RUN_TEST(testExtAccessoryPacketBytes);
+    RUN_TEST(testCvAccessPacketBytes);
+    RUN_TEST(testPayloadBitAt);
+    return UNITY_END();
+}
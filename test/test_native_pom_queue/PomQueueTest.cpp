@@ -0,0 +1,118 @@
+#include "dcc/pom_queue.hpp"
+#include "dcc/host_channel.hpp"
+
+#include <unity.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+using namespace dcc;
+
+struct Rig {
+    PacketList<8> list;
+    HostChannel ch{list};
+    PomQueue pom{&ch};
+    std::vector<PomQueue::Result> results;
+
+    Rig() {
+        ch.setRecordHalfBits(false);
+        ch.begin();
+    }
+
+    static void done(const PomQueue::Result &r, void *ctx) {
+        static_cast<Rig*>(ctx)->results.push_back(r);
+    }
+
+    /** Transmits packet by packet and calls loop() in between, until `n` writes are done. */
+    void run(size_t n, size_t max_packets = 5000) {
+        for(size_t i=0; i<max_packets && results.size() < n; i++) {
+            pom.loop();
+            ch.step();
+        }
+        pom.loop();
+        TEST_ASSERT_EQUAL(n, results.size());
+    }
+};
+
+static bool is_pom(const Packet &p) {
+    const LocoAddress addr = packet_loco_address(p);
+    return addr.isValid() && (p[addr.isLong() ? 2 : 1] & 0xF0) == 0xE0;
+}
+
+/**
+ * A sound profile written to one loco while others run: all writes go out in order, none right after another packet
+ *   to the same decoder, and speed of every loco is still refreshed.
+ */
+void testBulkWrite() {
+    Rig r;
+    const LocoAddress target = LocoAddress::longAddr(3000);
+    for(uint8_t a=3; a<=6; a++) r.list.put_loco_speed_dir_packet(LocoAddress::shortAddr(a), LocoSpeed::from128(40), SpeedMode::S128, true);
+    r.list.put_loco_speed_dir_packet(target, LocoSpeed::from128(40), SpeedMode::S128, true);
+    r.ch.runPackets(10);
+    r.ch.clearRecording();
+
+    constexpr uint16_t N = 50;
+    for(uint16_t cv=1; cv<=N; cv++) {
+        TEST_ASSERT_TRUE(r.pom.writeByte(target, 100 + cv, static_cast<uint8_t>(cv), Rig::done, &r));
+    }
+    TEST_ASSERT_TRUE(r.pom.busy());
+    r.run(N);
+    TEST_ASSERT_FALSE(r.pom.busy());
+    for(uint16_t i=0; i<N; i++) {
+        TEST_ASSERT_TRUE(r.results[i].sent);
+        TEST_ASSERT_EQUAL(101 + i, r.results[i].cv);
+    }
+
+    std::map<uint16_t, uint64_t> last_end, last_speed, max_speed_gap;
+    std::vector<uint16_t> cvs;
+    for(const auto &e: r.ch.emittedPackets()) {
+        const LocoAddress addr = packet_loco_address(e.packet);
+        if(!addr.isValid()) continue;
+        const uint16_t key = addr.isLong() ? 10000 + addr.addr() : addr.addr();
+        if(is_pom(e.packet)) {
+            const uint16_t cv = ((e.packet[2] & 0x03) << 8 | e.packet[3]) + 1;
+            if(cvs.empty() || cvs.back() != cv) cvs.push_back(cv);
+            auto it = last_end.find(key);
+            // decoder gets at least 5ms between packets addressed to it
+            if(it != last_end.end()) TEST_ASSERT_GREATER_OR_EQUAL(5000, e.start_us - it->second);
+        } else if(e.packet[addr.isLong() ? 2 : 1] == 0x3F) {
+            if(last_speed.count(key)) max_speed_gap[key] = std::max(max_speed_gap[key], e.start_us - last_speed[key]);
+            last_speed[key] = e.start_us;
+        }
+        last_end[key] = e.end_us;
+    }
+    TEST_ASSERT_EQUAL(N, cvs.size());
+    for(uint16_t i=0; i<N; i++) TEST_ASSERT_EQUAL(101 + i, cvs[i]);
+    TEST_ASSERT_EQUAL(5, max_speed_gap.size());
+    for(const auto &g: max_speed_gap) TEST_ASSERT_LESS_THAN(200'000, g.second);
+}
+
+/** Bit writes, and a submit to a full queue fails instead of waiting. */
+void testBitWriteAndFullQueue() {
+    Rig r;
+    const LocoAddress addr = LocoAddress::shortAddr(5);
+    TEST_ASSERT_TRUE(r.pom.writeBit(addr, 29, 5, true, Rig::done, &r));
+    r.run(1);
+    TEST_ASSERT_TRUE(r.results[0].op == PomQueue::Op::WriteBit);
+    TEST_ASSERT_EQUAL(5, r.results[0].bit);
+    bool found = false;
+    for(const auto &e: r.ch.emittedPackets()) {
+        if(e.packet == make_pom_bit_packet(addr, 29, 5, true)) found = true;
+    }
+    TEST_ASSERT_TRUE(found);
+
+    size_t n = 0;
+    while(r.pom.writeByte(addr, 1, 3)) n++;
+    TEST_ASSERT_EQUAL(PomQueue::QUEUE_LEN, n);
+
+    PomQueue none;
+    TEST_ASSERT_FALSE(none.writeByte(addr, 1, 3));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testBulkWrite);
+    RUN_TEST(testBitWriteAndFullQueue);
+    return UNITY_END();
+}
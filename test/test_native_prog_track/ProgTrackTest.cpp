@@ -0,0 +1,413 @@
+#include "dcc/prog_track.hpp"
+#include "dcc/host_channel.hpp"
+#include "dcc/sim_decoder.hpp"
+
+#include <unity.h>
+
+#include <algorithm>
+#include <initializer_list>
+#include <map>
+#include <vector>
+
+using namespace dcc;
+
+struct Rig {
+    PacketList<8> list;
+    HostChannel ch{list};
+    SimDecoder decoder;
+    SimProgTrack track{ch, decoder};
+    ProgTrack prog{&ch};
+    std::vector<ProgTrack::Result> results;
+
+    Rig() { ch.begin(); }
+
+    static void done(const ProgTrack::Result &r, void *ctx) {
+        static_cast<Rig*>(ctx)->results.push_back(r);
+    }
+
+    /** Runs track packet by packet, with current sampled every 1ms, and calls loop() in between, until `n` jobs are done. */
+    void run(size_t n, size_t max_packets = 1000) {
+        for(size_t i=0; i<max_packets && results.size() < n; i++) {
+            prog.loop(track.step());
+        }
+        TEST_ASSERT_EQUAL(n, results.size());
+    }
+};
+
+/** Read is 8 bit verifies and a byte verify, each step is resets, instructions and recovery resets on track. */
+void testReadByte() {
+    Rig r;
+    r.decoder.setCv(29, 0xA5);
+    r.prog.setSpeculativeReads(false);
+    TEST_ASSERT_TRUE(r.prog.readByte(29, Rig::done, &r));
+    TEST_ASSERT_FALSE(r.prog.busy());
+    r.run(1);
+
+    TEST_ASSERT_TRUE(r.results[0].ok);
+    TEST_ASSERT_EQUAL(ProgTrack::Op::ReadByte, r.results[0].op);
+    TEST_ASSERT_EQUAL(29, r.results[0].cv);
+    TEST_ASSERT_EQUAL_HEX8(0xA5, r.results[0].value);
+    TEST_ASSERT_FALSE(r.prog.busy());
+    TEST_ASSERT_EQUAL(9, r.decoder.instructions());
+
+    // every instruction has at least 3 resets before it
+    const auto &e = r.ch.emittedPackets();
+    size_t resets = 0;
+    for(const auto &p: e) {
+        if(p.packet == resetPacket) {
+            resets++;
+        } else if(p.packet[0] != idlePacket[0]) {
+            if(resets > 0) TEST_ASSERT_GREATER_OR_EQUAL(ProgTrack::RESETS, resets);
+            resets = 0;
+        }
+    }
+    TEST_ASSERT_EQUAL(0, r.ch.validate().get_errors().total());
+}
+
+/** @return time a read of `value` takes, in ms. */
+static uint32_t read_time(uint8_t value) {
+    Rig r;
+    r.decoder.setCv(1, value);
+    r.prog.setSpeculativeReads(false);
+    r.prog.readByte(1, Rig::done, &r);
+    r.run(1);
+    TEST_ASSERT_TRUE(r.results[0].ok);
+    TEST_ASSERT_EQUAL(value, r.results[0].value);
+    return r.ch.nowUs() / 1000;
+}
+
+/**
+ * A step ends as soon as ACK is seen, so bits that are 1 are read faster than those that are 0:
+ *   resets that follow the instruction are already queued, but they are leading resets of the next step.
+ */
+void testAckEndsStepEarly() {
+    const uint32_t zeros = read_time(0), ones = read_time(0xFF);
+    TEST_ASSERT_LESS_THAN(zeros * 9 / 10, ones);
+}
+
+/** Mean time of reading `cvs`, in ms. Decoder has defaults in common CVs, and some manufacturer id and version. */
+static uint32_t mean_read_time(Rig &r, std::initializer_list<uint16_t> cvs) {
+    const uint64_t t0 = r.ch.nowUs();
+    const size_t n0 = r.results.size();
+    for(auto cv: cvs) {
+        r.prog.readByte(cv, Rig::done, &r);
+        r.run(r.results.size() + 1);
+        TEST_ASSERT_TRUE(r.results.back().ok);
+        TEST_ASSERT_EQUAL(r.decoder.cv(cv), r.results.back().value);
+    }
+    return (r.ch.nowUs() - t0) / 1000 / (r.results.size() - n0);
+}
+
+/** A predicted value is verified first, wrong predictions fall back to bitwise read. */
+void testSpeculativeRead() {
+    const std::initializer_list<uint16_t> cvs = {1, 7, 8, 29, 17, 18};
+    uint32_t mean[3];
+    for(int speculative=0; speculative<2; speculative++) {
+        Rig r;
+        r.prog.setSpeculativeReads(speculative != 0);
+        r.decoder.setCv(1, 3);
+        r.decoder.setCv(7, 42);
+        r.decoder.setCv(8, 13);
+        r.decoder.setCv(17, 0xC0);
+        r.decoder.setCv(29, 0x06);
+        mean[speculative] = mean_read_time(r, cvs);
+        if(speculative) mean[2] = mean_read_time(r, cvs); // CV7 and CV8 are cached now
+
+        // another decoder: cached values are wrong, but reads are right; a new CV7 drops the cache
+        r.decoder.setCv(1, 5);
+        r.decoder.setCv(7, 7);
+        mean_read_time(r, {7, 1});
+        uint8_t v;
+        TEST_ASSERT_TRUE(r.prog.predict(1, v));
+        TEST_ASSERT_EQUAL(5, v);
+    }
+    TEST_ASSERT_LESS_THAN(mean[0] / 2, mean[1]);
+    TEST_ASSERT_LESS_THAN(mean[1], mean[2]);
+}
+
+/** Writes go into cache, so a read that follows is a single verify. */
+void testWriteThenRead() {
+    Rig r;
+    r.prog.writeByte(3, 25, Rig::done, &r);
+    r.prog.writeBit(3, 7, true, Rig::done, &r);
+    r.run(2);
+    const size_t before = r.decoder.instructions();
+    r.prog.readByte(3, Rig::done, &r);
+    r.run(3);
+    TEST_ASSERT_EQUAL(25 | 0x80, r.results[2].value);
+    TEST_ASSERT_EQUAL(before + 1, r.decoder.instructions());
+}
+
+struct MemStorage: CvStorage {
+    std::map<uint32_t, std::vector<uint8_t>> records;
+    size_t saves{0};
+
+    bool load(const DecoderId &id, DecoderCvs &cvs) override {
+        auto it = records.find(id.key());
+        if(it == records.end()) return false;
+        unpack(etl::span<const uint8_t>{it->second.data(), it->second.size()}, cvs);
+        return true;
+    }
+
+    bool save(const DecoderId &id, const DecoderCvs &cvs) override {
+        std::vector<uint8_t> data(cvs.size() * PACKED_SIZE);
+        data.resize(pack(cvs, etl::span<uint8_t>{data.data(), data.size()}));
+        records[id.key()] = data;
+        saves++;
+        return true;
+    }
+};
+
+/** A range is read in one job, with a result for every CV; a list goes in its order. */
+void testReadList() {
+    Rig r;
+    for(int i=0; i<8; i++) r.decoder.setCv(i + 1, i * 17);
+    TEST_ASSERT_TRUE(r.prog.readRange(2, 5, Rig::done, &r));
+    static const uint16_t list[] = {8, 1};
+    TEST_ASSERT_TRUE(r.prog.readList(list, 2, Rig::done, &r));
+    TEST_ASSERT_FALSE(r.prog.readRange(5, 4, Rig::done, &r));
+    r.run(6, 10'000);
+    const uint16_t cvs[] = {2, 3, 4, 5, 8, 1};
+    for(size_t i=0; i<6; i++) {
+        TEST_ASSERT_EQUAL(ProgTrack::Op::ReadList, r.results[i].op);
+        TEST_ASSERT_EQUAL(cvs[i], r.results[i].cv);
+        TEST_ASSERT_EQUAL(r.decoder.cv(cvs[i]), r.results[i].value);
+        TEST_ASSERT_TRUE(r.results[i].ok);
+        TEST_ASSERT_EQUAL(i == 3 || i == 5, r.results[i].last);
+    }
+
+    // a CV that doesn't read doesn't stop the list, but a timeout does
+    r.results.clear();
+    r.decoder.setPresent(false);
+    r.prog.readRange(1, 2, Rig::done, &r);
+    r.run(2, 10'000);
+    TEST_ASSERT_FALSE(r.results[0].ok);
+    TEST_ASSERT_FALSE(r.results[0].last);
+    TEST_ASSERT_TRUE(r.results[1].last);
+
+    r.results.clear();
+    r.prog.readRange(1, 10, Rig::done, &r);
+    r.prog.loop(0);
+    r.prog.loop(ProgTrack::STEP_TIMEOUT_MS + 1);
+    TEST_ASSERT_EQUAL(1, r.results.size());
+    TEST_ASSERT_TRUE(r.results[0].last);
+    TEST_ASSERT_FALSE(r.prog.busy());
+}
+
+/** Fills CV1-64 of decoder with values that are mostly not defaults. */
+static void set_decoder(SimDecoder &d) {
+    for(int i=0; i<64; i++) d.setCv(i + 1, static_cast<uint8_t>(i * 37 + 11));
+    d.setCv(CV_SHORT_ADDR, 3);
+    d.setCv(CV_VERSION, 42);
+    d.setCv(CV_MANUFACTURER, 13);
+    d.setCv(CV_CONFIG, 0x06);
+}
+
+/** @return time of reading CV1-64 of decoder, in ms. */
+static uint32_t dump_time(Rig &r) {
+    const uint64_t t0 = r.ch.nowUs();
+    TEST_ASSERT_TRUE(r.prog.readDecoder(1, 64, Rig::done, &r));
+    r.run(64, 100'000);
+    TEST_ASSERT_EQUAL(CV_SHORT_ADDR, r.results[0].cv);
+    TEST_ASSERT_EQUAL(CV_VERSION, r.results[1].cv);
+    TEST_ASSERT_TRUE(r.results[63].last);
+    for(const auto &res: r.results) {
+        TEST_ASSERT_TRUE(res.ok);
+        TEST_ASSERT_EQUAL(r.decoder.cv(res.cv), res.value);
+    }
+    return (r.ch.nowUs() - t0) / 1000;
+}
+
+/**
+ * Decoder dump is saved once programmer is idle; in a later session, as soon as identity CVs are read,
+ *   stored values are loaded and the rest of the dump is a verify per CV.
+ */
+void testDecoderDump() {
+    MemStorage storage;
+    uint32_t first, second;
+    {
+        Rig r;
+        r.prog.cvCache().setStorage(&storage);
+        set_decoder(r.decoder);
+        first = dump_time(r);
+        const uint32_t now = r.ch.nowUs() / 1000;
+        r.prog.loop(now + 1);
+        TEST_ASSERT_EQUAL(0, storage.saves);
+        r.prog.loop(now + ProgTrack::CACHE_SAVE_DELAY_MS + 1);
+        TEST_ASSERT_EQUAL(1, storage.saves);
+        DecoderId id{};
+        TEST_ASSERT_TRUE(r.prog.cvCache().id(id));
+        TEST_ASSERT_EQUAL(13, id.manufacturer);
+        TEST_ASSERT_EQUAL(64 * CvStorage::PACKED_SIZE, storage.records[id.key()].size());
+    }
+    {
+        Rig r;
+        r.prog.cvCache().setStorage(&storage);
+        set_decoder(r.decoder);
+        second = dump_time(r);
+    }
+    TEST_ASSERT_LESS_THAN(first / 4, second);
+}
+
+/** With verify of cached reads off, a cached CV is answered without going to track. */
+void testCachedReadNoVerify() {
+    Rig r;
+    r.prog.writeByte(3, 25, Rig::done, &r);
+    r.run(1);
+    r.prog.setVerifyCachedReads(false);
+    const size_t before = r.decoder.instructions();
+    r.prog.readByte(3, Rig::done, &r);
+    r.prog.loop(r.ch.nowUs() / 1000);
+    TEST_ASSERT_EQUAL(2, r.results.size());
+    TEST_ASSERT_TRUE(r.results[1].ok);
+    TEST_ASSERT_EQUAL(25, r.results[1].value);
+    TEST_ASSERT_EQUAL(before, r.decoder.instructions());
+}
+
+void testVerifyAndWrite() {
+    Rig r;
+    r.decoder.setCv(1, 3);
+    r.prog.verifyByte(1, 3, Rig::done, &r);
+    r.prog.verifyByte(1, 4, Rig::done, &r);
+    r.prog.writeByte(8, 0x42, Rig::done, &r);
+    r.prog.writeBit(29, 5, true, Rig::done, &r);
+    r.run(4);
+
+    TEST_ASSERT_TRUE(r.results[0].ok);
+    TEST_ASSERT_FALSE(r.results[1].ok);
+    TEST_ASSERT_EQUAL(4, r.results[1].value);
+    TEST_ASSERT_TRUE(r.results[2].ok);
+    TEST_ASSERT_EQUAL(ProgTrack::Op::WriteByte, r.results[2].op);
+    TEST_ASSERT_EQUAL(0x42, r.decoder.cv(8));
+    TEST_ASSERT_TRUE(r.results[3].ok);
+    TEST_ASSERT_EQUAL(5, r.results[3].bit);
+    TEST_ASSERT_EQUAL_HEX8(0x20, r.decoder.cv(29));
+}
+
+/** Decoder takes instructions only in service mode, which a reset starts and anything else but a reset ends. */
+void testServiceModeEntry() {
+    Rig r;
+    const auto write = make_service_byte_packet(1, 5, true);
+    r.list.put_generic_packet(resetPacket, 3);
+    r.list.put_generic_packet(idlePacket, 1);
+    r.list.put_generic_packet(write, 5);
+    for(int i=0; i<20; i++) r.track.step();
+    TEST_ASSERT_EQUAL(0, r.decoder.instructions());
+    TEST_ASSERT_EQUAL(0, r.decoder.cv(1));
+
+    r.list.put_generic_packet(resetPacket, 3);
+    r.list.put_generic_packet(write, 5);
+    for(int i=0; i<20; i++) r.track.step();
+    TEST_ASSERT_EQUAL(1, r.decoder.instructions());
+    TEST_ASSERT_EQUAL(1, r.decoder.acks());
+    TEST_ASSERT_EQUAL(5, r.decoder.cv(1));
+}
+
+/** Late, jittery ACKs on a noisy track: reads and writes still get the right values. */
+void testNoisyDecoder() {
+    for(uint32_t seed=1; seed<=5; seed++) {
+        Rig r;
+        r.decoder.setConfig(SimDecoder::Config{40, 80, 6000, 2000, 3000, 10, seed});
+        r.decoder.setCv(3, 0x5A);
+        r.prog.setSpeculativeReads(false);
+        r.prog.readByte(3, Rig::done, &r);
+        r.prog.writeByte(4, 0xC3, Rig::done, &r);
+        r.prog.writeBit(4, 2, true, Rig::done, &r);
+        r.run(3, 2000);
+        TEST_ASSERT_TRUE(r.results[0].ok);
+        TEST_ASSERT_EQUAL_HEX8(0x5A, r.results[0].value);
+        TEST_ASSERT_TRUE(r.results[1].ok);
+        TEST_ASSERT_TRUE(r.results[2].ok);
+        TEST_ASSERT_EQUAL_HEX8(0xC7, r.decoder.cv(4));
+    }
+}
+
+/**
+ * Weak ACK in noise: some ACKs are missed. Without retries reads come out wrong, with them every read and
+ *   write succeeds.
+ */
+void testWeakDecoderRetries() {
+    const uint16_t cvs[] = {1, 2, 3, 4, 5, 29, 47, 112};
+    size_t failed[2] = {0, 0};
+    for(int retries=0; retries<2; retries++) {
+        for(uint32_t seed=1; seed<=10; seed++) {
+            Rig r;
+            r.decoder.setConfig(SimDecoder::Config{40, 65, 6000, 500, 1000, 30, seed});
+            r.prog.setSpeculativeReads(false);
+            if(retries == 0) r.prog.setRetries(0);
+            for(auto cv: cvs) {
+                r.decoder.setCv(cv, static_cast<uint8_t>(cv * 29 + 5));
+                r.prog.readByte(cv, Rig::done, &r);
+                r.run(r.results.size() + 1, 5000);
+                const auto &res = r.results.back();
+                if(!res.ok || res.value != r.decoder.cv(cv)) failed[retries]++;
+            }
+            r.prog.writeByte(200, 0xA5, Rig::done, &r);
+            r.run(r.results.size() + 1, 5000);
+            if(!r.results.back().ok || r.decoder.cv(200) != 0xA5) failed[retries]++;
+        }
+    }
+    TEST_ASSERT_GREATER_THAN(0, failed[0]);
+    TEST_ASSERT_EQUAL(0, failed[1]);
+}
+
+/** Without a decoder there is no ACK, all jobs fail. */
+void testNoDecoder() {
+    Rig r;
+    r.decoder.setPresent(false);
+    r.prog.readByte(1, Rig::done, &r);
+    r.prog.writeByte(1, 5, Rig::done, &r);
+    r.run(2);
+    TEST_ASSERT_FALSE(r.results[0].ok);
+    TEST_ASSERT_EQUAL(0, r.results[0].value);
+    TEST_ASSERT_FALSE(r.results[1].ok);
+}
+
+/** loop() never waits: if nothing goes to track, the job times out and queue moves on. */
+void testStepTimeout() {
+    Rig r;
+    r.prog.verifyByte(1, 0, Rig::done, &r);
+    r.prog.loop(0);
+    TEST_ASSERT_TRUE(r.prog.busy());
+    r.prog.loop(ProgTrack::STEP_TIMEOUT_MS);
+    TEST_ASSERT_EQUAL(0, r.results.size());
+    r.prog.loop(ProgTrack::STEP_TIMEOUT_MS + 1);
+    TEST_ASSERT_EQUAL(1, r.results.size());
+    TEST_ASSERT_FALSE(r.results[0].ok);
+    TEST_ASSERT_FALSE(r.prog.busy());
+}
+
+void testQueue() {
+    Rig r;
+    for(size_t i=0; i<ProgTrack::QUEUE_LEN; i++) {
+        TEST_ASSERT_TRUE(r.prog.verifyByte(i + 1, 0, Rig::done, &r));
+    }
+    TEST_ASSERT_FALSE(r.prog.verifyByte(10, 0, Rig::done, &r));
+    r.run(ProgTrack::QUEUE_LEN);
+    for(size_t i=0; i<ProgTrack::QUEUE_LEN; i++) {
+        TEST_ASSERT_EQUAL(i + 1, r.results[i].cv);
+        TEST_ASSERT_TRUE(r.results[i].ok);
+    }
+
+    ProgTrack none;
+    TEST_ASSERT_FALSE(none.readByte(1, Rig::done, &r));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testReadByte);
+    RUN_TEST(testAckEndsStepEarly);
+    RUN_TEST(testSpeculativeRead);
+    RUN_TEST(testWriteThenRead);
+    RUN_TEST(testReadList);
+    RUN_TEST(testDecoderDump);
+    RUN_TEST(testCachedReadNoVerify);
+    RUN_TEST(testVerifyAndWrite);
+    RUN_TEST(testServiceModeEntry);
+    RUN_TEST(testNoisyDecoder);
+    RUN_TEST(testWeakDecoderRetries);
+    RUN_TEST(testNoDecoder);
+    RUN_TEST(testStepTimeout);
+    RUN_TEST(testQueue);
+    return UNITY_END();
+}
@@ -0,0 +1,181 @@
+#include "dcc/symbol_stream.hpp"
+#include "dcc/waveform_validator.hpp"
+#include "dcc/PacketList.hpp"
+#include "dcc/base_channel.hpp"
+
+#include <unity.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+using namespace dcc;
+
+// same timings as ESP32RMTChannel
+using Encoder = SymbolEncoder<58, 100, false>;
+
+/**
+ * Host model of an RMT TX channel in wrap mode: memory of MEM symbols is output endlessly,
+ *   TX threshold event comes every MEM/2 symbols, and its handler runs `latency` symbols later.
+ * Output is recorded as half-bits for WaveformValidator. An end marker (0 symbol) would stop the channel.
+ */
+template<size_t MEM>
+struct EmulatedRmt {
+    static constexpr size_t HALF = MEM / 2;
+
+    etl::array<SymbolWord, MEM> mem{};
+    size_t rd{0};
+    uint64_t sent{0};
+    uint64_t now{0};
+    size_t end_markers{0};
+    std::vector<HalfBit> timeline;
+
+    /** rmt_fill_tx_items() */
+    void write(const SymbolWord *items, size_t n, size_t offset) {
+        std::copy(items, items + n, mem.begin() + offset);
+    }
+
+    template<typename OnThreshold>
+    void run(size_t n, size_t latency, OnThreshold &&on_threshold) {
+        std::deque<uint64_t> events;
+        for(size_t i=0; i<n; i++) {
+            const uint32_t val = mem[rd].val;
+            if(val == 0) {
+                end_markers++;
+                return;
+            }
+            const uint32_t d0 = val & 0x7FFF, d1 = val >> 16 & 0x7FFF;
+            timeline.push_back(HalfBit{now, d0, (val & 0x8000) != 0});
+            timeline.push_back(HalfBit{now + d0, d1, (val & 0x80000000u) != 0, val == Encoder::CUTOUT});
+            now += d0 + d1;
+            rd = (rd + 1) % MEM;
+            if(++sent % HALF == 0) events.push_back(sent + latency);
+            while(!events.empty() && events.front() <= sent) {
+                on_threshold();
+                events.pop_front();
+            }
+        }
+    }
+};
+
+/** Packet source with repeats, the way ESP32RMTChannel::advancePacket() does it. Remembers what was sent. */
+struct Source {
+    PacketList<8> list;
+    PacketWithRepeats packet;
+    uint8_t repeatsLeft{0};
+    std::vector<Packet> sent;
+
+    const Packet &next() {
+        if(repeatsLeft > 0) {
+            repeatsLeft--;
+        } else {
+            if(!list.fetch_next_packet(packet)) packet = idle_packet_with_repeats;
+            repeatsLeft = packet.nRepeats > 0 ? packet.nRepeats - 1 : 0;
+        }
+        sent.push_back(packet.packet);
+        return packet.packet;
+    }
+};
+
+/** Streams `n_symbols` through emulated memory, refilling it the same way ESP32RMTChannel::rmtTxThrCallback() does. */
+template<size_t MEM>
+static WaveformValidator stream(Source &src, size_t n_symbols, size_t latency, bool railcom = false, size_t *end_markers = nullptr) {
+    EmulatedRmt<MEM> rmt;
+    SymbolStream<Encoder> s;
+    etl::array<SymbolWord, MEM> items;
+    auto next = [&]() -> const Packet& { return src.next(); };
+
+    s.begin(DEF_PREAMBLE_LEN, railcom);
+    s.fill(etl::span<SymbolWord>{items}, next);
+    rmt.write(items.data(), MEM, 0);
+    size_t offset = 0;
+    rmt.run(n_symbols, latency, [&]() {
+        s.fill(etl::span<SymbolWord>{items.data(), MEM / 2}, next);
+        rmt.write(items.data(), MEM / 2, offset);
+        offset = offset == 0 ? MEM / 2 : 0;
+    });
+    if(end_markers) *end_markers = rmt.end_markers;
+
+    WaveformValidator v;
+    v.feed(rmt.timeline.begin(), rmt.timeline.end());
+    return v;
+}
+
+static bool same(const Packet &a, const Packet &b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+}
+
+/** Decoded packets are those taken from the source, in order; a packet or two can still be in memory. */
+static void assert_round_trip(const Source &src, const WaveformValidator &v) {
+    TEST_ASSERT_GREATER_THAN(0, v.packets().size());
+    TEST_ASSERT_LESS_OR_EQUAL(v.packets().size() + 2, src.sent.size());
+    for(size_t i=0; i<v.packets().size(); i++) {
+        TEST_ASSERT_TRUE(same(src.sent[i], v.packets()[i].packet));
+    }
+}
+
+static void put_long_packets(Source &src) {
+    // 6 bytes: 72 symbols with preamble, more than a whole ESP32-S3 block
+    const uint8_t longPom[] = {0xC4, 0xD2, 0xEC, 0x12, 0x34, 0x56};
+    src.list.put_generic_packet(longPom, 2);
+    src.list.put_signal_aspect_packet(1234, 5);
+    src.list.put_loco_speed_dir_packet(LocoAddress::longAddr(1234), LocoSpeed::from128(50), SpeedMode::S128, true);
+    src.list.put_accessory_packet(17, true);
+}
+
+/** Packets longer than the whole memory go through 48-symbol memory (one ESP32-S2/S3/C3 block) without errors. */
+void testLongPacketsStreamThroughOneBlock() {
+    Source src;
+    put_long_packets(src);
+    size_t end_markers = 0;
+    const auto v = stream<48>(src, 3000, 0, false, &end_markers);
+
+    TEST_ASSERT_EQUAL(0, end_markers);
+    TEST_ASSERT_EQUAL(0, v.get_errors().total());
+    assert_round_trip(src, v);
+    const size_t n_long = std::count_if(v.packets().begin(), v.packets().end(),
+        [](const auto &d) { return d.packet.size() == 6; });
+    TEST_ASSERT_EQUAL(2, n_long);
+    for(const auto &d: v.packets()) TEST_ASSERT_EQUAL(DEF_PREAMBLE_LEN, d.preamble_bits);
+}
+
+/** Cutout symbol goes with the packet it precedes, and may end up in any half of memory. */
+void testRailcomCutoutStream() {
+    Source src;
+    put_long_packets(src);
+    const auto v = stream<64>(src, 3000, 0, true);
+
+    TEST_ASSERT_EQUAL(0, v.get_errors().total());
+    assert_round_trip(src, v);
+    // every packet end bit is followed by a cutout, the last one may still be in memory
+    TEST_ASSERT_LESS_OR_EQUAL(v.packets().size(), v.cutouts());
+    TEST_ASSERT_GREATER_OR_EQUAL(v.packets().size() - 1, v.cutouts());
+    for(size_t i=1; i<v.packets().size(); i++) {
+        TEST_ASSERT_EQUAL(DEF_PREAMBLE_LEN - RailcomCutout::PREAMBLE_BITS, v.packets()[i].preamble_bits);
+    }
+}
+
+/** Refill has half a block of time; later than that, RMT outputs stale symbols and waveform breaks. */
+void testLateRefill() {
+    {
+        Source src;
+        put_long_packets(src);
+        const auto v = stream<48>(src, 3000, 23);
+        TEST_ASSERT_EQUAL(0, v.get_errors().total());
+        assert_round_trip(src, v);
+    }
+    {
+        Source src;
+        put_long_packets(src);
+        const auto v = stream<48>(src, 3000, 30);
+        TEST_ASSERT_GREATER_THAN(0, v.get_errors().total());
+    }
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testLongPacketsStreamThroughOneBlock);
+    RUN_TEST(testRailcomCutoutStream);
+    RUN_TEST(testLateRefill);
+    return UNITY_END();
+}
@@ -0,0 +1,74 @@
+#include "dcc/slot_table.hpp"
+
+#include <unity.h>
+
+#include <map>
+#include <random>
+
+using namespace dcc;
+
+static LocoAddress random_addr(std::mt19937 &rnd) {
+    // mix of short and long addresses, including long ones numerically equal to short ones
+    return rnd() % 2 ? LocoAddress::shortAddr(1 + rnd() % 40) : LocoAddress::longAddr(1 + rnd() % 40);
+}
+
+/** Random insert/erase sequence checked against std::map. */
+void testAgainstMap() {
+    constexpr size_t N = 32;
+    SlotTable<int, N> table;
+    std::map<uint16_t, int> ref;
+    std::mt19937 rnd(1);
+
+    for(int i=0; i<100'000; i++) {
+        LocoAddress a = random_addr(rnd);
+        if(rnd() % 3 == 0) {
+            TEST_ASSERT_EQUAL(ref.erase(a.key()) == 1, table.erase(a));
+        } else {
+            SlotHandle h = table.find_or_add(a);
+            if(ref.count(a.key()) == 0 && ref.size() == N) {
+                TEST_ASSERT_FALSE(h.valid());
+                continue;
+            }
+            TEST_ASSERT_TRUE(h.valid());
+            *table.get(h) = i;
+            ref[a.key()] = i;
+        }
+
+        TEST_ASSERT_EQUAL(ref.size(), table.size());
+        for(size_t k=0; k<table.size(); k++) {
+            // dense iteration covers exactly the stored rows
+            LocoAddress ka = table.address_at(k);
+            TEST_ASSERT_EQUAL(1, ref.count(ka.key()));
+            TEST_ASSERT_EQUAL(ref[ka.key()], table.value_at(k));
+            TEST_ASSERT_EQUAL(k, table.position(table.at(k)));
+        }
+        LocoAddress probe = random_addr(rnd);
+        TEST_ASSERT_EQUAL(ref.count(probe.key()) == 1, table.find(probe).valid());
+    }
+}
+
+/** Handle of an erased row must not resolve, even when its storage is reused. */
+void testStaleHandle() {
+    SlotTable<int, 2> table;
+    SlotHandle h1 = table.find_or_add(LocoAddress::shortAddr(3));
+    SlotHandle h2 = table.find_or_add(LocoAddress::longAddr(3));
+    TEST_ASSERT_TRUE(h1 != h2);
+    TEST_ASSERT_FALSE(table.find_or_add(LocoAddress::shortAddr(4)).valid());
+
+    TEST_ASSERT_TRUE(table.erase(LocoAddress::shortAddr(3)));
+    TEST_ASSERT_NULL(table.get(h1));
+    TEST_ASSERT_NOT_NULL(table.get(h2));
+
+    SlotHandle h3 = table.find_or_add(LocoAddress::shortAddr(4));
+    TEST_ASSERT_EQUAL(h1.index, h3.index);
+    TEST_ASSERT_NULL(table.get(h1));
+    TEST_ASSERT_NOT_NULL(table.get(h3));
+    TEST_ASSERT_TRUE(table.find(LocoAddress::shortAddr(4)) == h3);
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testAgainstMap);
+    RUN_TEST(testStaleHandle);
+    return UNITY_END();
+}
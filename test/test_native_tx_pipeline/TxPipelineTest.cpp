@@ -0,0 +1,193 @@
+#include "dcc/tx_pipeline.hpp"
+#include "dcc/waveform_timing.hpp"
+#include "dcc/symbol_encoder.hpp"
+#include "dcc/base_channel.hpp"
+
+#include <unity.h>
+
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <vector>
+
+using namespace dcc;
+
+using Encoder = SymbolEncoder<58, 116, true>;
+static constexpr size_t N_SYMBOLS = DEF_PREAMBLE_LEN + Encoder::packet_symbols(MAX_PACKET_LEN);
+
+/**
+ * Host model of RMT new driver transmit queue: rmt_transmit() blocks while `depth` transactions
+ *   are in flight, queued transactions go back to back, done callback fires at the end of each one.
+ * Transaction reads its buffer while it is sent, so buffer contents are checked against
+ *   a snapshot taken when it was queued.
+ */
+template<typename Pipeline>
+struct SimRmt {
+    struct Transaction {
+        const SymbolWord *symbols;
+        std::vector<uint32_t> snapshot;
+        uint64_t end_us;
+    };
+
+    Pipeline &pipeline;
+    size_t depth;
+    std::deque<Transaction> queue;
+    uint64_t now{0};
+    uint64_t line_free{0};
+    size_t gaps{0};
+    uint64_t gap_sum{0};
+    size_t overwritten{0};
+
+    static uint32_t duration(const SymbolWord *s, size_t n) {
+        uint32_t d = 0;
+        for(size_t i=0; i<n; i++) d += (s[i].val & 0x7FFF) + (s[i].val >> 16 & 0x7FFF);
+        return d;
+    }
+
+    void complete_front() {
+        const Transaction &t = queue.front();
+        if(!std::equal(t.snapshot.begin(), t.snapshot.end(), t.symbols,
+            [](uint32_t a, const SymbolWord &b) { return a == b.val; })) overwritten++;
+        pipeline.done(t.end_us);
+        queue.pop_front();
+    }
+
+    /** Task does something else (encoding, preempted) for `us`. */
+    void advance(uint64_t us) {
+        const uint64_t until = now + us;
+        while(!queue.empty() && queue.front().end_us <= until) complete_front();
+        now = until;
+    }
+
+    void transmit(const SymbolWord *symbols, size_t n) {
+        while(queue.size() >= depth) {
+            now = std::max(now, queue.front().end_us);
+            complete_front();
+        }
+        uint64_t start = now;
+        if(!queue.empty()) {
+            start = queue.back().end_us;
+        } else if(line_free > 0 && now > line_free) {
+            gaps++;
+            gap_sum += now - line_free;
+        }
+        Transaction t{symbols, {}, start + duration(symbols, n)};
+        for(size_t i=0; i<n; i++) t.snapshot.push_back(symbols[i].val);
+        line_free = t.end_us;
+        queue.push_back(t);
+    }
+};
+
+/**
+ * Runs transmit task loop the same way ESP32RMTChannel::packetTaskLoop() does, with task
+ *   being preempted for up to `max_preempt_us` now and then.
+ */
+template<size_t DEPTH>
+static SimRmt<TxPipeline<SymbolWord, N_SYMBOLS, DEPTH>> run(uint32_t max_preempt_us) {
+    using Pipeline = TxPipeline<SymbolWord, N_SYMBOLS, DEPTH>;
+    static Pipeline pipeline; // each depth is run once
+    SimRmt<Pipeline> sim{pipeline, DEPTH};
+
+    PacketList<4> list;
+    PacketWithRepeats packet;
+    std::mt19937 rnd(DEPTH);
+    for(int k=0; k<2000; k++) {
+        if(k % 50 == 0) list.put_accessory_packet(k % 2044, true);
+        if(k % 7 == 0) list.put_loco_speed_dir_packet(LocoAddress::shortAddr(3 + k % 4), LocoSpeed::from128(k % 100 + 2), SpeedMode::S128, true);
+
+        auto &buf = pipeline.next();
+        if(!list.fetch_next_packet(packet)) packet = idle_packet_with_repeats;
+        sim.advance(50); // fetching and encoding
+        size_t n = Encoder::fill_preamble(DEF_PREAMBLE_LEN, etl::span<SymbolWord>{buf});
+        n += Encoder::fill_packet(packet.packet, etl::span<SymbolWord>{buf}.subspan(n));
+        TEST_ASSERT_GREATER_THAN(DEF_PREAMBLE_LEN, n);
+        for(size_t i=0; i<packet.nRepeats; i++) {
+            pipeline.submitted(sim.now);
+            sim.transmit(buf.data(), n);
+        }
+        pipeline.advance();
+        if(rnd() % 10 == 0) sim.advance(rnd() % max_preempt_us);
+    }
+    while(!sim.queue.empty()) sim.complete_front();
+    return sim;
+}
+
+/** With 3 packets queued, the task can be preempted for two packet times without any gap on track. */
+void testQueuedPipelineHasNoGaps() {
+    const auto sim = run<3>(2 * 5000);
+    const auto s = sim.pipeline.stats();
+    TEST_ASSERT_EQUAL(0, sim.gaps);
+    TEST_ASSERT_EQUAL(0, sim.overwritten);
+    TEST_ASSERT_EQUAL(0, s.buffer_busy);
+    TEST_ASSERT_EQUAL(s.submitted, s.completed);
+    // the last transmission leaves the queue empty
+    TEST_ASSERT_EQUAL(1, s.underruns);
+    TEST_ASSERT_EQUAL(0, s.gap_max_us);
+}
+
+/** Single transaction in flight (as before): preemption longer than the packet on the wire is a gap, and it's measured. */
+void testSingleTransactionHasGaps() {
+    const auto sim = run<1>(2 * 5000);
+    const auto s = sim.pipeline.stats();
+    TEST_ASSERT_GREATER_THAN(0, sim.gaps);
+    TEST_ASSERT_EQUAL(sim.gaps + 1, s.underruns);
+    TEST_ASSERT_EQUAL(0, sim.overwritten);
+    TEST_ASSERT_EQUAL(0, s.buffer_busy);
+    TEST_ASSERT_EQUAL(sim.gap_sum, s.gap_sum_us);
+    TEST_ASSERT_LESS_OR_EQUAL(2 * 5000 + 50, s.gap_max_us);
+}
+
+/** Refill timing: latency against predicted event time, overruns when refill takes longer than its slack. */
+void testWaveformTiming() {
+    constexpr uint32_t C = 240; // cycles per us
+    BasicWaveformTiming<true> t;
+    t.begin(C);
+    uint32_t now = 0xFFFFF000u; // cycle counter wraps around in 18s
+
+    // no prediction yet, no latency
+    t.refill_begin(now);
+    t.refill_end(now + 10*C, 5000, 1000);
+    // 3us late
+    now += 5000*C;
+    t.refill_begin(now + 3*C);
+    t.refill_end(now + 23*C, 5000, 1000);
+    // on time, but refill takes longer than 1000us slack
+    now += 5000*C;
+    t.refill_begin(now);
+    t.refill_end(now + 1500*C, 5000, 1000);
+    // prediction restarts after overrun
+    now += 5100*C;
+    t.refill_begin(now);
+    t.refill_end(now + C, 5000, 1000);
+
+    const auto s = t.stats();
+    TEST_ASSERT_EQUAL(2, s.latency.count()); // 3us late and on time
+    TEST_ASSERT_EQUAL(1, s.latency.buckets[0]);
+    TEST_ASSERT_EQUAL(1, s.latency.buckets[TimingHistogram::bucket_of(3)]);
+    TEST_ASSERT_EQUAL(3, s.latency.max_us);
+    TEST_ASSERT_EQUAL(4, s.refill.count());
+    TEST_ASSERT_EQUAL(1500, s.refill.max_us);
+    TEST_ASSERT_EQUAL(15, s.refill.percentile_us(50)); // 1, 10 | 20, 1500
+    TEST_ASSERT_EQUAL(1500, s.refill.percentile_us(100));
+    TEST_ASSERT_EQUAL(1, s.overruns);
+    TEST_ASSERT_EQUAL(4, s.gap.count());
+    TEST_ASSERT_EQUAL(3, s.gap.buckets[0]);
+    TEST_ASSERT_EQUAL(500, s.gap.max_us);
+
+    TEST_ASSERT_EQUAL(0, TimingHistogram::bucket_of(0));
+    TEST_ASSERT_EQUAL(1, TimingHistogram::bucket_of(1));
+    TEST_ASSERT_EQUAL(2, TimingHistogram::bucket_of(2));
+    TEST_ASSERT_EQUAL(2, TimingHistogram::bucket_of(3));
+    TEST_ASSERT_EQUAL(TimingHistogram::N_BUCKETS - 1, TimingHistogram::bucket_of(1'000'000));
+
+    // disabled timing takes no memory
+    TEST_ASSERT_EQUAL(1, sizeof(BasicWaveformTiming<false>));
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testQueuedPipelineHasNoGaps);
+    RUN_TEST(testSingleTransactionHasGaps);
+    RUN_TEST(testWaveformTiming);
+    return UNITY_END();
+}
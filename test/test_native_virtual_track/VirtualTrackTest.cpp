@@ -0,0 +1,246 @@
+#include "dcc/host_channel.hpp"
+
+#include <unity.h>
+
+#include <algorithm>
+
+using namespace dcc;
+
+static bool same(const Packet &a, const Packet &b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+}
+
+/** With nothing to send, track gets valid idle packets back to back. */
+void testIdleStream() {
+    PacketList<4> list;
+    HostChannel ch{list};
+    ch.begin();
+    ch.runPackets(100);
+
+    WaveformValidator v = ch.validate();
+    TEST_ASSERT_EQUAL(0, v.get_errors().total());
+    TEST_ASSERT_EQUAL(100, v.packets().size());
+    for(const auto &d: v.packets()) {
+        TEST_ASSERT_TRUE(same(idlePacket, d.packet));
+        TEST_ASSERT_GREATER_OR_EQUAL(WaveformValidator::MIN_PREAMBLE_BITS, d.preamble_bits);
+    }
+    // idle packet is FF 00 FF: "1" are preamble, two FF bytes and end bit, "0" are 3 start bits and 00 byte
+    const uint32_t idle_bits_us = (DEF_PREAMBLE_LEN + 8 + 8 + 1) * 116 + (3 + 8) * 200;
+    TEST_ASSERT_EQUAL(100 * idle_bits_us, ch.nowUs());
+}
+
+/** Packets decoded from the waveform are exactly those put into list, with their repeats. */
+void testPacketsRoundTrip() {
+    PacketList<4> list;
+    HostChannel ch{list};
+    ch.begin();
+
+    const LocoAddress s = LocoAddress::shortAddr(3), l = LocoAddress::longAddr(1234);
+    list.put_loco_speed_dir_packet(s, LocoSpeed::from128(50), SpeedMode::S128, true);
+    list.put_loco_fn_packet(l, fn_group::F0_4, 0b10001);
+    list.put_accessory_packet(17, true);
+    const uint8_t reset[] = {0, 0};
+    list.put_generic_packet(reset, 3);
+    ch.runPackets(50);
+
+    WaveformValidator v = ch.validate();
+    TEST_ASSERT_EQUAL(0, v.get_errors().total());
+    TEST_ASSERT_EQUAL(ch.emittedPackets().size(), v.packets().size());
+    for(size_t i=0; i<v.packets().size(); i++) {
+        const auto &d = v.packets()[i];
+        const auto &e = ch.emittedPackets()[i];
+        TEST_ASSERT_TRUE(same(e.packet, d.packet));
+        TEST_ASSERT_EQUAL(e.end_us, d.end_us);
+    }
+
+    const auto speed = make_speed_dir_packet(s, LocoSpeed::from128(50), SpeedMode::S128, true);
+    const auto fn = make_fn_packet(l, fn_group::F0_4, 0b10001);
+    const auto acc = make_accessory_packet(17, true);
+    size_t n_speed = 0, n_fn = 0, n_acc = 0, n_reset = 0;
+    for(const auto &d: v.packets()) {
+        if(same(d.packet, Packet(speed.begin(), speed.end()))) n_speed++;
+        if(same(d.packet, Packet(fn.begin(), fn.end()))) n_fn++;
+        if(same(d.packet, Packet(acc.begin(), acc.end()))) n_acc++;
+        if(same(d.packet, resetPacket)) n_reset++;
+    }
+    TEST_ASSERT_GREATER_THAN(1, n_speed); // refreshed
+    TEST_ASSERT_GREATER_THAN(1, n_fn);
+    TEST_ASSERT_EQUAL(ACCESSORY_PACKET_REPEATS, n_acc);
+    TEST_ASSERT_EQUAL(3, n_reset);
+}
+
+/** Channel and packet list counters agree with what was actually put on track. */
+void testStatsMatchTrack() {
+    PacketList<4> list;
+    HostChannel ch{list};
+    ch.begin();
+    ch.runPackets(5); // idle only
+
+    list.put_loco_speed_dir_packet(LocoAddress::shortAddr(3), LocoSpeed::from128(50), SpeedMode::S128, true);
+    list.put_loco_fn_packet(LocoAddress::shortAddr(3), fn_group::F0_4, 1);
+    list.put_accessory_packet(17, true);
+    const uint8_t reset[] = {0, 0};
+    list.put_generic_packet(reset, 3);
+    ch.runPackets(200);
+
+    const auto t = ch.getTrackStats();
+    const auto p = ch.getPacketStats();
+    const WaveformValidator v = ch.validate();
+    TEST_ASSERT_EQUAL(ch.emittedPackets().size(), t.packets);
+    TEST_ASSERT_EQUAL(v.bits(), t.bits);
+    TEST_ASSERT_EQUAL(5, t.idle);
+    TEST_ASSERT_EQUAL(ACCESSORY_PACKET_REPEATS - 1 + 3 - 1, t.repeats);
+    TEST_ASSERT_EQUAL(t.packets - t.repeats - t.idle, p.fetched());
+
+    TEST_ASSERT_EQUAL(1, p.queued_accessory);
+    TEST_ASSERT_EQUAL(1, p.queued_generic);
+    TEST_ASSERT_EQUAL(2, p.queued_slot);
+    TEST_ASSERT_GREATER_THAN(p.fn_refresh, p.speed_refresh);
+    TEST_ASSERT_EQUAL(4, p.queue_high_water);
+    TEST_ASSERT_EQUAL(0, p.put_rejected);
+
+    const auto &spd = p.refresh_interval[BasePacketList::REFRESH_SPEED_DIR];
+    TEST_ASSERT_EQUAL(p.speed_refresh + 1, spd.count);
+    TEST_ASSERT_LESS_OR_EQUAL(20, spd.max);
+
+    list.reset_stats_max();
+    ch.step();
+    TEST_ASSERT_EQUAL(0, ch.getPacketStats().queue_high_water);
+}
+
+/**
+ * With many locos, refresh periods get stretched. Combined instruction puts speed and F0-F12
+ *   of a loco into one packet, so the whole state of a loco is refreshed much more often.
+ * @return mean number of packets between two refreshes of loco speed and of F5-F12.
+ */
+static std::pair<double, double> mean_refresh(bool combined) {
+    constexpr size_t N = 40;
+    static PacketList<N> list;
+    HostChannel ch{list};
+    ch.begin();
+    for(size_t i=0; i<N; i++) {
+        const LocoAddress addr = LocoAddress::longAddr(1000 + i);
+        list.clear_loco(addr);
+        list.set_loco_combined(addr, combined);
+        list.put_loco_speed_dir_packet(addr, LocoSpeed::from128(10 + i), SpeedMode::S128, true);
+        list.put_loco_fn_packet(addr, fn_group::F0_4, 1);
+        list.put_loco_fn_packet(addr, fn_group::F5_8, 1 << 5);
+        list.put_loco_fn_packet(addr, fn_group::F9_12, 1 << 9);
+        ch.runPackets(4);
+    }
+    ch.runPackets(500);
+    const auto before = list.stats().refresh_interval;
+    ch.runPackets(2000);
+    const auto after = list.stats().refresh_interval;
+    TEST_ASSERT_EQUAL(0, ch.validate().get_errors().total());
+
+    auto mean = [&](BasePacketList::RefreshClass c) {
+        return double(after[c].sum - before[c].sum) / (after[c].count - before[c].count);
+    };
+    const double speed = mean(BasePacketList::REFRESH_SPEED_DIR);
+    // in combined mode, functions go with speed
+    return {speed, combined ? speed : mean(BasePacketList::REFRESH_F5_F12)};
+}
+
+void testCombinedRefreshPeriod() {
+    const auto [separate_speed, separate_fn] = mean_refresh(false);
+    const auto [combined_speed, combined_fn] = mean_refresh(true);
+    TEST_ASSERT_LESS_THAN(separate_speed, combined_speed);
+    TEST_ASSERT_LESS_THAN(separate_fn / 2, combined_fn);
+}
+
+/** RailCom cutout follows every packet end bit and doesn't change packet timing. */
+void testRailcomCutout() {
+    PacketList<4> list, plain_list;
+    HostChannel ch{list}, plain{plain_list};
+    ch.begin();
+    plain.begin();
+    ch.setRailcomCutout(true);
+    for(auto *l: {&list, &plain_list}) {
+        l->put_loco_speed_dir_packet(LocoAddress::shortAddr(3), LocoSpeed::from128(50), SpeedMode::S128, true);
+        l->put_accessory_packet(17, true);
+    }
+    ch.runPackets(50);
+    plain.runPackets(50);
+
+    const WaveformValidator v = ch.validate();
+    TEST_ASSERT_EQUAL(0, v.get_errors().total());
+    TEST_ASSERT_EQUAL(50, v.packets().size());
+    TEST_ASSERT_EQUAL(50, v.cutouts());
+    for(size_t i=1; i<v.packets().size(); i++) {
+        // cutout takes place of 4 preamble bits
+        TEST_ASSERT_EQUAL(DEF_PREAMBLE_LEN - RailcomCutout::PREAMBLE_BITS, v.packets()[i].preamble_bits);
+        const auto &e = ch.emittedPackets(), &p = plain.emittedPackets();
+        TEST_ASSERT_EQUAL(p[i].end_us - p[i-1].end_us, e[i].end_us - e[i-1].end_us);
+    }
+
+    auto t = ch.halfBits();
+    auto cutout = std::find_if(t.begin(), t.end(), [](const HalfBit &h) { return h.cutout; });
+    TEST_ASSERT_TRUE(cutout != t.end());
+    TEST_ASSERT_EQUAL(RailcomCutout::START_US, (cutout - 1)->duration_us);
+    {   // cutout starts too late
+        (cutout - 1)->duration_us += 10;
+        cutout->start_us += 10;
+        cutout->duration_us -= 10;
+        WaveformValidator bad;
+        bad.feed(t.begin(), t.end());
+        TEST_ASSERT_EQUAL(1, bad.get_errors().cutout);
+    }
+}
+
+/** Validator must notice broken waveforms, otherwise passing tests above mean nothing. */
+void testValidatorCatchesErrors() {
+    PacketList<4> list;
+    HostChannel ch{list};
+    ch.begin();
+    ch.runPackets(3);
+    const std::vector<HalfBit> good = ch.halfBits();
+
+    {   // stretched "1" half
+        auto t = good;
+        t[10].duration_us = 70;
+        WaveformValidator v;
+        v.feed(t.begin(), t.end());
+        TEST_ASSERT_GREATER_THAN(0, v.get_errors().timing);
+    }
+    {   // both halves of "1" are within limits, but differ by more than 3us
+        auto t = good;
+        t[10].duration_us = 55;
+        t[11].duration_us = 61;
+        WaveformValidator v;
+        v.feed(t.begin(), t.end());
+        TEST_ASSERT_GREATER_THAN(0, v.get_errors().timing);
+    }
+    {   // flipped data bit: checksum mismatch
+        auto t = good;
+        const size_t bit = 2 * (DEF_PREAMBLE_LEN + 1 + 3); // 3rd bit of first byte, it's "1" in idle packet
+        t[bit].duration_us = t[bit+1].duration_us = 100;
+        WaveformValidator v;
+        v.feed(t.begin(), t.end());
+        TEST_ASSERT_GREATER_THAN(0, v.get_errors().checksum);
+    }
+    {   // short preamble
+        auto t = std::vector<HalfBit>(good.begin() + 2 * (DEF_PREAMBLE_LEN - 12), good.end());
+        WaveformValidator v;
+        v.feed(t.begin(), t.end());
+        TEST_ASSERT_EQUAL(1, v.get_errors().preamble);
+    }
+    {   // late refill holds end bit level
+        HostChannel late{list};
+        late.begin();
+        late.setGapUs(20);
+        late.runPackets(3);
+        TEST_ASSERT_GREATER_THAN(0, late.validate().get_errors().timing);
+    }
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(testIdleStream);
+    RUN_TEST(testPacketsRoundTrip);
+    RUN_TEST(testStatsMatchTrack);
+    RUN_TEST(testCombinedRefreshPeriod);
+    RUN_TEST(testRailcomCutout);
+    RUN_TEST(testValidatorCatchesErrors);
+    return UNITY_END();
+}